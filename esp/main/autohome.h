@@ -5,6 +5,8 @@ extern "C" {
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
+#include "freertos/semphr.h"
+#include "freertos/timers.h"
 #include "esp_system.h"
 #include "esp_log.h"
 #include "esp_netif.h"
@@ -13,6 +15,8 @@ extern "C" {
 #include "esp_wifi.h"
 #include "nvs.h"
 #include "nvs_flash.h"
+#include "esp_partition.h"
+#include "esp_spi_flash.h"
 
 #include "lwip/err.h"
 #include "lwip/sys.h"
@@ -26,7 +30,12 @@ extern "C" {
 #include <cJSON.h>
 #include <dht.h>
 #include <ds18x20.h>
-#include <list>
+#include <string.h>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+
+#include "flashlog.h"
 
 static const uint32_t VALID_DEVICE_PIN_MASK = BIT(0)|BIT(2)|BIT(4)|BIT(5)|BIT(12)|BIT(13)|BIT(14)|BIT(15)|BIT(16);
 
@@ -83,62 +92,68 @@ public:
 };
 
 class Zone;
-typedef std::list<Zone> ZoneList;
-
-class MQTTData
-{
-public:
-    char *topic;
-    char *data;
-    size_t data_len;
-
-    MQTTData();
-    ~MQTTData();
-
-    void reset();
-
-    void append( esp_mqtt_event_handle_t event );
-};
-
-class MQTTClient
+class MQTTClient;
+class SnapshotWriter;
+class SnapshotReader;
+class OneWireBus;
+class DS18X20Sensor;
+// zones are referred to by their devices, timers and the router, so they
+// stay where they were created and the list only holds pointers
+typedef std::vector<Zone*> ZoneList;
+
+// Home, zone and device ids are UUIDs. They are parsed once, when the
+// config or topic carrying them arrives, and compared a word at a time from
+// then on; the text is only rebuilt for topics and logs.
+class Uuid
 {
-    Network &_network;
-    ZoneList _zones;
-    esp_mqtt_client_config_t _mqtt_config;
-    esp_mqtt_client_handle_t _client;
-
-    MQTTData _data;
+    uint32_t _words[4];
+    // ids go back out in the case they came in
+    bool _upper;
 
 public:
-    MQTTClient( Network &network );
-    ~MQTTClient();
-
-    void init();
-    void connect( const char *brokerUrl );
-    void publish( const char *topic, const char *message, int qos = 1, bool retain = true );
-    void handleEvent( esp_mqtt_event_handle_t event );
-
-    void addZone( const char *home, const char *zone );
-    void removeZone( const char *home, const char *zone );
-    Zone *getZone( const char *home, const char *zone ) const;
+    static const size_t LENGTH = 36;
+
+    Uuid() : _words{ 0, 0, 0, 0 }, _upper( false ) {}
+    explicit Uuid( const char *id ) { parse( id ); }
+
+    // an empty id is the nil UUID; anything that is not a UUID is too, and
+    // is refused
+    bool parse( const char *id );
+    // for an id that has to name something: the nil UUID is refused too, as
+    // every id that failed to parse would alias it
+    bool parseRequired( const char *id ) { return parse( id ) && !isNil(); }
+    const char *format( char *buffer ) const;
+    void save( SnapshotWriter &writer ) const;
+    void load( SnapshotReader &reader );
+
+    bool isNil() const { return ( _words[0] | _words[1] | _words[2] | _words[3] ) == 0; }
+    uint32_t hash( uint32_t hash = 2166136261u ) const;
+
+    bool operator==( const Uuid &other ) const {
+        return _words[0] == other._words[0] && _words[1] == other._words[1] &&
+               _words[2] == other._words[2] && _words[3] == other._words[3];
+    }
+    bool operator!=( const Uuid &other ) const { return !( *this == other ); }
 };
 
-class DeviceChange
-{
-    char _homeId[37];
-    char _zoneId[37];
-    char _deviceId[37];
-    char _type[16];
-    int8_t _direction;
-
-public:
-    DeviceChange( cJSON *json, const char *defaultHomeId = NULL, const char *defaultZoneId = NULL );
-
-    bool matches( const char *homeId, const char *zoneId, const char *deviceId, const char *type ) const;
-    int8_t getDirection() const { return _direction; }
+// The kinds of reading the devices take. Changes and targets without a type
+// apply to every kind; types we do not know are only matched that way.
+enum ReadingType : uint8_t {
+    READING_ANY,
+    READING_TEMPERATURE,
+    READING_HUMIDITY,
+    READING_HUMIDEX,
+    READING_SWITCH,
+    READING_OTHER
 };
 
-typedef std::list<DeviceChange> DeviceChangeList;
+ReadingType readingType( const char *type );
+const char *readingTypeName( ReadingType type );
+
+inline bool readingTypeMatches( ReadingType wanted, ReadingType type )
+{
+    return wanted == READING_ANY || ( wanted == type && type != READING_OTHER );
+}
 
 class DeviceValue
 {
@@ -154,18 +169,70 @@ public:
         value.doubleValue = 0;
         unit[0] = '\0';
     }
+
+    void setUnit( const char *u ) {
+        strncpy( unit, u, sizeof( unit ) - 1 );
+        unit[sizeof( unit ) - 1] = '\0';
+    }
+
+    bool operator==( const DeviceValue &other ) const {
+        return memcmp( &value, &other.value, sizeof( value ) ) == 0 && strcmp( unit, other.unit ) == 0;
+    }
+
+    void save( SnapshotWriter &writer ) const;
+    void load( SnapshotReader &reader );
+};
+
+class DeviceChange
+{
+    Uuid _homeId;
+    Uuid _zoneId;
+    Uuid _deviceId;
+    ReadingType _type;
+    int8_t _direction;
+    bool _valid;
+
+public:
+    DeviceChange( const Uuid &defaultHomeId = Uuid(), const Uuid &defaultZoneId = Uuid() );
+
+    void setField( const char *field, const char *value );
+    // every id is a UUID, and there is a device
+    bool valid() const { return _valid && !_deviceId.isNil(); }
+
+    bool matches( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type ) const;
+    bool operator==( const DeviceChange &other ) const;
+    int8_t getDirection() const { return _direction; }
+
+    void save( SnapshotWriter &writer ) const;
+    void load( SnapshotReader &reader );
+
+    const Uuid &getHomeId() const { return _homeId; }
+    const Uuid &getZoneId() const { return _zoneId; }
+    const Uuid &getDeviceId() const { return _deviceId; }
 };
 
+typedef std::vector<DeviceChange> DeviceChangeList;
+
 class DeviceCalibration
 {
-    char _type[16];
+    ReadingType _type;
     DeviceValue _threshold;
     DeviceValue _calibration;
+    DeviceValue _deadband;
 
 public:
-    DeviceCalibration( cJSON *json );
+    DeviceCalibration();
+
+    void setType( const char *type );
+    DeviceValue &threshold() { return _threshold; }
+    DeviceValue &calibration() { return _calibration; }
+    DeviceValue &deadband() { return _deadband; }
 
-    bool matches( const char *type ) const;
+    bool matches( ReadingType type ) const;
+    bool operator==( const DeviceCalibration &other ) const;
+
+    void save( SnapshotWriter &writer ) const;
+    void load( SnapshotReader &reader );
 
     double adjust( double value ) const;
     int adjust( int value ) const;
@@ -173,14 +240,32 @@ public:
 
     double doubleThreshold() const { return _threshold.value.doubleValue; }
     int intThreshold() const { return _threshold.value.intValue; }
+    // change needed before a new reading is published
+    double deadband() const { return _deadband.value.doubleValue; }
 };
 
-typedef std::list<DeviceCalibration> DeviceCalibrationList;
+typedef std::vector<DeviceCalibration> DeviceCalibrationList;
+
+// How often an output may change, to spare a relay from a reading that
+// hovers around its target. Times are in milliseconds; zero is no limit.
+class SwitchLimits
+{
+public:
+    uint32_t minOnTime;
+    uint32_t minOffTime;
+    uint32_t maxPerHour;
+
+    SwitchLimits() : minOnTime( 0 ), minOffTime( 0 ), maxPerHour( 0 ) {}
+};
 
 class Device
 {
     Zone &_zone;
     char _id[37];
+    Uuid _uuid;
+    // what the hardware was last set up with
+    char _type[16];
+    char _address[32];
     DeviceChangeList _changes;
     DeviceCalibrationList _calibrations;
 
@@ -191,36 +276,72 @@ public:
     Zone &getZone() const;
 
     const char *getId() const;
+    const Uuid &getUuid() const { return _uuid; }
     virtual bool is( const char *deviceType ) const = 0; 
+    bool hasInterface( const char *type, const char *address ) const;
+    void setInterface( const char *type, const char *address );
     
     virtual void setInterval( uint32_t interval ) {};
-
-    void addChange( cJSON *json );
-    void clearChanges();
+    virtual uint32_t getInterval() const { return 0; }
+    virtual void read() {}
+    // a read in two steps, for a sensor that can be left to work on its
+    // own: how long until finishRead, or 0 when the read is done
+    virtual TickType_t startRead() { read(); return 0; }
+    virtual void finishRead() {}
+    virtual uint8_t getResolution() const { return 0; }
+    virtual void setLimits( const SwitchLimits &limits ) {}
+    virtual SwitchLimits getLimits() const { return SwitchLimits(); }
+
+    bool setChanges( DeviceChangeList &changes );
     const DeviceChangeList &getChanges() const { return _changes; }
 
-    void addCalibration( cJSON *json );
-    void clearCalibrations();
-    const DeviceCalibration *findCalibration( const char *type );
+    bool setCalibrations( DeviceCalibrationList &calibrations );
+    const DeviceCalibrationList &getCalibrations() const { return _calibrations; }
+
+    void save( SnapshotWriter &writer ) const;
+    const DeviceCalibration *findCalibration( ReadingType type );
 
-    virtual void on() {}
-    virtual void off() {}
+    // true when the output actually changed
+    virtual bool on() { return false; }
+    virtual bool off() { return false; }
+
+    // a change held back by the limits: how long until it may be made, and
+    // making it once it may
+    virtual TickType_t pendingDelay() { return portMAX_DELAY; }
+    virtual bool applyPending() { return false; }
 };
 
-typedef std::list<Device*> DeviceList;
+typedef std::vector<Device*> DeviceList;
 
 class DeviceTarget
 {
-    char _homeId[37];
-    char _zoneId[37];
-    char _deviceId[37];
-    char _type[16];
+    Uuid _homeId;
+    Uuid _zoneId;
+    Uuid _deviceId;
+    ReadingType _type;
     DeviceValue _value;
+    bool _valid;
 
 public:
-    DeviceTarget( cJSON *json, const char *defaultHomeId = NULL, const char *defaultZoneId = NULL );
+    DeviceTarget( const Uuid &defaultHomeId = Uuid(), const Uuid &defaultZoneId = Uuid() );
+
+    void setField( const char *field, const char *value );
+    // every id is a UUID, and there is a device
+    bool valid() const { return _valid && !_deviceId.isNil(); }
+    DeviceValue &value() { return _value; }
+    const DeviceValue &value() const { return _value; }
+    void setType( ReadingType type ) { _type = type; }
+
+    bool matches( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type ) const;
+    bool sameKey( const DeviceTarget &other ) const;
+
+    void save( SnapshotWriter &writer ) const;
+    void load( SnapshotReader &reader );
 
-    bool matches( const char *homeId, const char *zoneId, const char *deviceId, const char *type ) const;
+    const Uuid &getHomeId() const { return _homeId; }
+    const Uuid &getZoneId() const { return _zoneId; }
+    const Uuid &getDeviceId() const { return _deviceId; }
+    ReadingType getType() const { return _type; }
 
     double doubleValue() const { return _value.value.doubleValue; }
     int intValue() const { return _value.value.intValue; }
@@ -229,7 +350,7 @@ public:
     const char *unit() const { return _value.unit; }
 };
 
-typedef std::list<DeviceTarget> DeviceTargetList;
+typedef std::vector<DeviceTarget> DeviceTargetList;
 
 class Schedule
 {
@@ -239,16 +360,28 @@ class Schedule
     DeviceTargetList _targets;
 
 public:
-    Schedule( cJSON *json, const char *defaultHomeId = NULL, const char *defaultZoneId = NULL );
+    Schedule();
+    // moved, not copied, when the list grows or is sorted
+    Schedule( Schedule &&other ) = default;
+    Schedule &operator=( Schedule &&other ) = default;
     ~Schedule();
 
-    const DeviceTarget *getTarget( const char *homeId, const char *zoneId, const char *deviceId, const char *type ) const;
+    void addDay( int day );
+    void setStart( const char *start );
+    DeviceTarget &addTarget( const Uuid &defaultHomeId, const Uuid &defaultZoneId );
+    size_t pruneTargets();
+
+    const DeviceTarget *getTarget( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type ) const;
+    const DeviceTargetList &getTargets() const { return _targets; }
     uint8_t getHour() const { return _hour; }
     uint8_t getMinute() const { return _minute; }
     uint8_t getDays() const { return _days; }
+
+    void save( SnapshotWriter &writer ) const;
+    void load( SnapshotReader &reader );
 };
 
-typedef std::list<Schedule> ScheduleList;
+typedef std::vector<Schedule> ScheduleList;
 
 class Override
 {
@@ -257,40 +390,1007 @@ class Override
     DeviceTargetList _targets;
 
 public:
-    Override( cJSON *json, const char *defaultHomeId = NULL, const char *defaultZoneId = NULL );
+    Override();
+    // moved, not copied, so the targets stay where they are
+    Override( Override &&other ) = default;
+    Override &operator=( Override &&other ) = default;
     ~Override();
 
-    const DeviceTarget *getTarget( const char *homeId, const char *zoneId, const char *deviceId, const char *type ) const;
+    void setStart( const char *start );
+    void setEnd( const char *end );
+    DeviceTarget &addTarget( const Uuid &defaultHomeId, const Uuid &defaultZoneId );
+    size_t pruneTargets();
+
+    const DeviceTarget *getTarget( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type ) const;
+    const DeviceTargetList &getTargets() const { return _targets; }
     time_t getStart() const { return _start; }
     time_t getEnd() const { return _end; }
+
+    void save( SnapshotWriter &writer ) const;
+    void load( SnapshotReader &reader );
+};
+
+typedef std::vector<Override> OverrideList;
+
+// Overrides in order of their start, then end. Those that have ended are
+// pruned as boundaries pass, so the ones that have started are the ones in
+// effect.
+class OverrideIndex
+{
+    OverrideList _overrides;
+
+public:
+    typedef OverrideList::const_iterator const_iterator;
+
+    void assign( OverrideList &overrides );
+    void clear() { _overrides.clear(); }
+    size_t prune( time_t now );
+
+    // how many overrides have started by now; they come first
+    size_t started( time_t now ) const;
+    bool nextBoundary( time_t now, time_t &next ) const;
+
+    size_t size() const { return _overrides.size(); }
+    const Override &operator[]( size_t index ) const { return _overrides[index]; }
+    const_iterator cbegin() const { return _overrides.cbegin(); }
+    const_iterator cend() const { return _overrides.cend(); }
+};
+
+// Schedules and overrides compiled into the target that is in effect for
+// each device and type. Every distinct device and type named by a target
+// gets a slot; the schedules become a table of slots for each point in the
+// week where one starts, and the slots for the overrides and the current
+// point in the week are only worked out again when the next of those
+// boundaries passes. A lookup is a hash and a comparison of two slots.
+class TargetTimeline
+{
+    struct Slot
+    {
+        const DeviceTarget *target;
+        // later schedules and overrides win, and within one the last
+        // matching target does, as it always has
+        uint32_t rank;
+    };
+
+    struct Segment
+    {
+        uint16_t minute;
+        size_t slots;
+    };
+
+    const ScheduleList *_schedules;
+    const OverrideIndex *_overrides;
+    std::vector<const DeviceTarget*> _keys;
+    std::unordered_multimap<uint32_t, size_t> _index;
+    std::vector<Segment> _segments;
+    std::vector<Slot> _scheduleSlots;
+    std::vector<Slot> _overrideSlots;
+    size_t _segment;
+    time_t _validFrom;
+    time_t _validUntil;
+
+    size_t addKey( const DeviceTarget &target );
+    bool findKey( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type, size_t &key ) const;
+    void compileDay( int day );
+    void refresh( time_t now );
+    const DeviceTarget *best( const Slot *slots, bool hasExact, size_t exact, bool hasAny, size_t any ) const;
+
+public:
+    TargetTimeline();
+
+    void compile( const ScheduleList &schedules, const OverrideIndex &overrides );
+    const DeviceTarget *find( time_t now, const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type );
+    time_t nextBoundary( time_t now );
+    bool empty() const { return _keys.empty(); }
+};
+
+// The actuators that act on each channel, so a reading drives only its own
+class ActuatorIndex
+{
+public:
+    struct Actuator
+    {
+        Device *device;
+        const DeviceChange *change;
+    };
+
+    typedef std::unordered_multimap<uint32_t, Actuator>::const_iterator const_iterator;
+
+private:
+    std::unordered_multimap<uint32_t, Actuator> _index;
+
+public:
+    void rebuild( const DeviceList &devices );
+    std::pair<const_iterator, const_iterator> find( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId ) const;
+    size_t size() const { return _index.size(); }
+};
+
+enum ReadingAggregation {
+    AGGREGATE_NONE,
+    AGGREGATE_ALSO,
+    AGGREGATE_ONLY
+};
+
+class ZoneConfig
+{
+public:
+    char controller[18];
+    bool hasAggregate;
+    ReadingAggregation aggregate;
+    bool hasLogLevel;
+    esp_log_level_t logLevel;
+    bool hasLogFormat;
+    bool logBinary;
+    bool hasSchedules;
+    ScheduleList schedules;
+    bool hasOverrides;
+    OverrideList overrides;
+    // only ever restored from the snapshot
+    bool hasHeld;
+    DeviceTargetList held;
+
+    ZoneConfig();
+    void reset();
+    bool load( SnapshotReader &reader );
+};
+
+class DeviceConfig
+{
+public:
+    char type[16];
+    char address[32];
+    bool hasInterval;
+    uint32_t interval;
+    SwitchLimits limits;
+    uint8_t resolution;
+    bool hasChanges;
+    DeviceChangeList changes;
+    bool hasCalibrations;
+    DeviceCalibrationList calibrations;
+
+    DeviceConfig();
+    void reset();
+    bool load( SnapshotReader &reader );
 };
 
-typedef std::list<Override> OverrideList;
+class ConfigPath
+{
+public:
+    static const int MAX_DEPTH = 8;
+
+private:
+    static const size_t MAX_KEY = 32;
+
+    // the key of each open container's current member; empty for array elements
+    char _keys[MAX_DEPTH][MAX_KEY];
+    uint8_t _depth;
+
+public:
+    ConfigPath() : _depth( 0 ) {}
+
+    void reset() { _depth = 0; }
+    bool push();
+    void pop();
+    void setKey( const char *key );
+    uint8_t depth() const { return _depth; }
+    const char *key() const;
+
+    // pattern is a '/' separated list of keys, with '*' matching an array
+    // element and '+' matching any key
+    bool is( const char *pattern ) const;
+};
+
+class ConfigHandler
+{
+public:
+    virtual ~ConfigHandler() {}
+
+    virtual void beginObject( const ConfigPath &path ) {}
+    virtual void endObject( const ConfigPath &path ) {}
+    virtual void beginArray( const ConfigPath &path ) {}
+    virtual void endArray( const ConfigPath &path ) {}
+    virtual void string( const ConfigPath &path, const char *value ) {}
+    virtual void number( const ConfigPath &path, double value ) {}
+    virtual void boolean( const ConfigPath &path, bool value ) {}
+};
+
+class ConfigStream
+{
+public:
+    virtual ~ConfigStream() {}
+
+    virtual void reset() = 0;
+    virtual bool feed( const char *data, size_t len ) = 0;
+    virtual bool finish() = 0;
+    virtual bool failed() const = 0;
+};
+
+class JSONStream : public ConfigStream
+{
+    enum State {
+        VALUE,
+        FIRST_KEY,
+        KEY,
+        COLON,
+        NEXT,
+        STRING,
+        ESCAPE,
+        UNICODE,
+        NUMBER,
+        LITERAL,
+        DONE,
+        FAILED
+    };
+
+    ConfigHandler &_handler;
+    ConfigPath _path;
+    State _state;
+    bool _isKey;
+    // one bit per open container, set for objects
+    uint32_t _objects;
+    uint16_t _unicode;
+    uint8_t _unicodeDigits;
+    size_t _length;
+    char _scratch[CONFIG_AUTOHOME_DECODER_SCRATCH_SIZE];
+
+    bool value( char c );
+    bool close( char c );
+    bool append( char c );
+    bool finishNumber();
+    bool finishLiteral();
+    bool finishString();
+    void afterValue();
+
+public:
+    JSONStream( ConfigHandler &handler );
+
+    void reset();
+    bool feed( const char *data, size_t len );
+    bool finish();
+    bool failed() const { return _state == FAILED; }
+};
+
+class CBORStream : public ConfigStream
+{
+    enum State {
+        HEADER,
+        ARGUMENT,
+        TEXT,
+        SKIP,
+        DONE,
+        FAILED
+    };
+
+    ConfigHandler &_handler;
+    ConfigPath _path;
+    State _state;
+    uint8_t _major;
+    uint8_t _info;
+    uint8_t _argBytes;
+    uint64_t _arg;
+    // one bit per open container: maps, indefinite length, and maps whose
+    // next item is a key
+    uint32_t _maps;
+    uint32_t _indefinite;
+    uint32_t _keys;
+    uint64_t _remaining[ConfigPath::MAX_DEPTH + 1];
+    uint64_t _skip;
+    size_t _length;
+    char _scratch[CONFIG_AUTOHOME_DECODER_SCRATCH_SIZE];
+
+    bool expectingKey() const;
+    bool item();
+    bool itemDone();
+    bool open( bool map, uint64_t count, bool indefinite );
+    bool close();
+    bool finishText();
+    bool number( double value );
+
+public:
+    CBORStream( ConfigHandler &handler );
+
+    void reset();
+    bool feed( const char *data, size_t len );
+    bool finish();
+    bool failed() const { return _state == FAILED; }
+};
+
+enum PayloadEncoding {
+    ENCODING_JSON,
+    ENCODING_CBOR
+};
+
+class PayloadWriter
+{
+protected:
+    uint8_t *_buffer;
+    size_t _size;
+    size_t _length;
+    bool _overflow;
+
+    void put( const void *data, size_t len );
+    void put( uint8_t c );
+
+public:
+    PayloadWriter( void *buffer, size_t size );
+    virtual ~PayloadWriter() {}
+
+    // containers are given their size up front for encodings that need it
+    virtual void beginObject( size_t members ) = 0;
+    virtual void endObject() = 0;
+    virtual void beginArray( size_t items ) = 0;
+    virtual void endArray() = 0;
+    virtual void key( const char *name ) = 0;
+    virtual void string( const char *value ) = 0;
+    virtual void number( double value ) = 0;
+    virtual void boolean( bool value ) = 0;
+    virtual void timestamp( time_t time ) = 0;
+
+    const char *data() const { return (const char *)_buffer; }
+    size_t length() const { return _length; }
+    bool overflowed() const { return _overflow; }
+};
+
+class JSONWriter : public PayloadWriter
+{
+    uint8_t _depth;
+    uint32_t _first;
+    bool _afterKey;
+
+    void separate();
+    void open( char c );
+    void close( char c );
+    void quote( const char *value );
+
+public:
+    JSONWriter( void *buffer, size_t size );
+
+    void beginObject( size_t members );
+    void endObject();
+    void beginArray( size_t items );
+    void endArray();
+    void key( const char *name );
+    void string( const char *value );
+    void number( double value );
+    void boolean( bool value );
+    void timestamp( time_t time );
+};
+
+class CBORWriter : public PayloadWriter
+{
+    void header( uint8_t major, uint64_t arg );
+
+public:
+    CBORWriter( void *buffer, size_t size );
+
+    void beginObject( size_t members );
+    void endObject();
+    void beginArray( size_t items );
+    void endArray();
+    void key( const char *name );
+    void string( const char *value );
+    void number( double value );
+    void boolean( bool value );
+    void timestamp( time_t time );
+};
+
+class Reading
+{
+public:
+    time_t time;
+    DeviceValue value;
+    bool hasTarget;
+    DeviceValue target;
+    bool hasThreshold;
+    DeviceValue threshold;
+
+    Reading();
+
+    size_t members() const;
+    void encodeMembers( PayloadWriter &writer ) const;
+    void encode( PayloadWriter &writer ) const;
+};
+
+class ReadingFrame
+{
+    class Entry
+    {
+    public:
+        Uuid deviceId;
+        ReadingType type;
+        Reading reading;
+    };
+
+    Entry _entries[CONFIG_AUTOHOME_READING_FRAME_ENTRIES];
+    size_t _count;
+    uint8_t _payload[CONFIG_AUTOHOME_PUBLISH_MAX_MESSAGE];
+
+public:
+    ReadingFrame();
+
+    bool add( const Uuid &deviceId, ReadingType type, const Reading &reading );
+    size_t count() const { return _count; }
+    bool full() const { return _count == CONFIG_AUTOHOME_READING_FRAME_ENTRIES; }
+    void clear() { _count = 0; }
+
+    size_t encode( PayloadEncoding encoding, size_t size, size_t first, size_t count );
+    const char *payload() const { return (const char *)_payload; }
+};
+
+class MQTTTopic
+{
+public:
+    enum Kind {
+        UNKNOWN,
+        HOME_CONFIG,
+        ZONE_CONFIG,
+        DEVICE_CONFIG,
+        DEVICE_VALUE
+    };
+
+    Kind kind;
+    const char *homeId;
+    const char *zoneId;
+    const char *deviceId;
+    const char *type;
+    Uuid home;
+    Uuid zone;
+    Uuid device;
+    ReadingType reading;
+
+    // splits the topic in place; the parts point into the given buffer
+    MQTTTopic( char *topic = NULL );
+};
+
+class ConfigDecoder : public ConfigHandler
+{
+    MQTTTopic::Kind _kind;
+    Uuid _homeId;
+    Uuid _zoneId;
+    DeviceTarget *_target;
+
+    char _encoding[8];
+    ZoneConfig _zone;
+    DeviceConfig _device;
+    DeviceValue _value;
+    bool _hasValue;
+    double _threshold;
+
+public:
+    ConfigDecoder();
+
+    void reset( const MQTTTopic &topic );
+
+    const char *encoding() const { return _encoding; }
+    ZoneConfig &zoneConfig() { return _zone; }
+    DeviceConfig &deviceConfig() { return _device; }
+    const DeviceValue *value() const { return _hasValue ? &_value : NULL; }
+    double threshold() const { return _threshold; }
+
+    void beginObject( const ConfigPath &path );
+    void beginArray( const ConfigPath &path );
+    void string( const ConfigPath &path, const char *value );
+    void number( const ConfigPath &path, double value );
+    void boolean( const ConfigPath &path, bool value );
+
+    // drops what was decoded but cannot be used
+    void finish();
+};
+
+class TopicRouter
+{
+    // keyed on a hash of home/zone (zones) or home/zone/device (consumers of
+    // remote readings); candidates are verified on lookup
+    std::unordered_multimap<uint32_t, Zone*> _zones;
+    std::unordered_multimap<uint32_t, Zone*> _consumers;
+
+public:
+    static uint32_t hashKey( const Uuid &homeId, const Uuid &zoneId, const Uuid *deviceId = NULL );
+
+    void addZone( Zone *zone );
+    void removeZone( const Uuid &homeId, const Uuid &zoneId );
+    void rebuildConsumers( ZoneList &zones );
+
+    Zone *findZone( const Uuid &homeId, const Uuid &zoneId ) const;
+    bool wants( const MQTTTopic &topic ) const;
+    void dispatch( const MQTTTopic &topic, ConfigDecoder &decoder ) const;
+};
+
+class MQTTData
+{
+public:
+    bool active;
+    int msg_id;
+    uint32_t sequence;
+    // a device topic with three UUIDs and a reading type runs to 141 characters
+    char topicBuffer[160];
+    MQTTTopic topic;
+    bool wanted;
+    size_t data_len;
+    size_t total_data_len;
+    ConfigDecoder decoder;
+    JSONStream json;
+    CBORStream cbor;
+    ConfigStream *stream;
+
+    MQTTData();
+    ~MQTTData();
+
+    void reset();
+
+    void begin( esp_mqtt_event_handle_t event );
+    void append( esp_mqtt_event_handle_t event );
+};
+
+class MQTTDataPool
+{
+    // messages being reassembled, matched to their fragments by msg_id and offset
+    MQTTData _slots[CONFIG_AUTOHOME_MQTT_INFLIGHT];
+    uint32_t _sequence;
+
+public:
+    MQTTDataPool();
+
+    MQTTData *acquire( esp_mqtt_event_handle_t event );
+    MQTTData *find( esp_mqtt_event_handle_t event );
+    void release( MQTTData *data );
+    void clear();
+};
+
+enum PublishPriority {
+    PUBLISH_ACTUATION,
+    PUBLISH_TELEMETRY,
+    PUBLISH_LOG,
+    PUBLISH_PRIORITIES
+};
+
+class PublishMessage
+{
+public:
+    // the length of "/history", which a message replayed from the spool
+    // has added to its topic
+    static const size_t HISTORY_LENGTH = 8;
+
+    char buffer[CONFIG_AUTOHOME_PUBLISH_MAX_MESSAGE + HISTORY_LENGTH];
+    char *topic;
+    char *message;
+    size_t length;
+    int qos;
+    bool retain;
+};
+
+class PublishRing
+{
+    // variable length records packed back to back; unless the ring keeps
+    // everything it took, the oldest are dropped to make room for new ones
+    uint8_t *_buffer;
+    size_t _size;
+    size_t _head;
+    size_t _used;
+    bool _keepAll;
+    // messages dropped, or refused for want of room
+    uint32_t _dropped;
+
+    void write( size_t offset, const void *data, size_t len );
+    void read( size_t offset, void *data, size_t len ) const;
+    void dropOldest();
+
+public:
+    PublishRing( size_t size, bool keepAll = false );
+    ~PublishRing();
+
+    bool push( const char *topic, const char *message, size_t len, int qos, bool retain );
+    bool pop( PublishMessage &message );
+    size_t size() const { return _size; }
+    size_t used() const { return _used; }
+    uint32_t dropped() const { return _dropped; }
+};
+
+class PartitionStorage : public LogStorage
+{
+    const esp_partition_t *_partition;
+
+public:
+    PartitionStorage();
+
+    bool open( const char *label );
+
+    size_t size() const { return _partition ? _partition->size : 0; }
+    size_t sectorSize() const { return SPI_FLASH_SEC_SIZE; }
+    bool read( size_t offset, void *data, size_t len );
+    bool write( size_t offset, const void *data, size_t len );
+    bool erase( size_t offset, size_t len );
+};
+
+class SnapshotWriter
+{
+    std::vector<uint8_t> _data;
+
+public:
+    void clear() { _data.clear(); }
+    void put8( uint8_t value ) { _data.push_back( value ); }
+    void put16( uint16_t value );
+    void put32( uint32_t value );
+    void put64( uint64_t value );
+    void putBytes( const void *data, size_t len );
+    void putString( const char *value );
+
+    const uint8_t *data() const { return _data.data(); }
+    size_t length() const { return _data.size(); }
+};
+
+class SnapshotReader
+{
+    const uint8_t *_data;
+    size_t _length;
+    size_t _position;
+    bool _failed;
+
+public:
+    SnapshotReader( const uint8_t *data, size_t len );
+
+    uint8_t get8();
+    uint16_t get16();
+    uint32_t get32();
+    uint64_t get64();
+    void getBytes( void *data, size_t len );
+    void getString( char *value, size_t size );
+
+    // a count of items still to come, refused if they cannot fit
+    size_t getCount( size_t itemSize );
+    bool ok() const { return !_failed; }
+    bool done() const { return !_failed && _position == _length; }
+};
+
+// Takes the readings of every sensor from one task. Each sensor is read at
+// a fixed rate from its own deadline, so its period does not drift by the
+// time a read takes, and sensors with the same interval are spread out over
+// it rather than all reading at once.
+class SensorScheduler
+{
+    struct Entry
+    {
+        TickType_t deadline;
+        // 0 for the second step of a read
+        TickType_t period;
+        Device *device;
+    };
+
+    SemaphoreHandle_t _lock;
+    TaskHandle_t _task;
+    // a min-heap on the deadline
+    std::vector<Entry> _heap;
+    Device *_reading;
+    // tasks in remove() to be notified once the read in progress is done
+    std::vector<TaskHandle_t> _waiters;
+
+    static bool later( const Entry &first, const Entry &second );
+    TickType_t phase( TickType_t now, TickType_t period ) const;
+    size_t unschedule( Device *device );
+
+public:
+    SensorScheduler();
+    ~SensorScheduler();
+
+    void add( Device *device, uint32_t interval );
+    // once it returns the device is not being read
+    void remove( Device *device );
+    void run();
+};
+
+// The zone and device config last applied, kept in NVS so that after a
+// reset the zones are back at work before the network and the broker are.
+// Config from the broker then only changes what differs.
+class ConfigSnapshot
+{
+    static const uint8_t VERSION = 4;
+
+    enum Kind {
+        ZONE = 1,
+        DEVICE = 2
+    };
+
+    nvs_handle _handle;
+    bool _open;
+    bool _restoring;
+    std::vector<uint32_t> _zones;
+    std::vector<uint32_t> _devices;
+    SnapshotWriter _writer;
+
+    bool open();
+    void loadKeys( const char *name, std::vector<uint32_t> &keys );
+    void saveKeys( const char *name, const std::vector<uint32_t> &keys );
+    void store( char prefix, std::vector<uint32_t> &keys, uint32_t key );
+    void erase( char prefix, std::vector<uint32_t> &keys, uint32_t key );
+    bool fetch( char prefix, uint32_t key, std::vector<uint8_t> &data );
+    void restoreZone( MQTTClient &client, uint32_t key, std::vector<uint8_t> &data );
+    void restoreDevice( MQTTClient &client, uint32_t key, std::vector<uint8_t> &data );
+
+public:
+    ConfigSnapshot();
+    ~ConfigSnapshot();
+
+    void restore( MQTTClient &client );
+    void saveZone( const Zone &zone );
+    void saveDevice( const Zone &zone, const Device &device );
+    void removeZone( const Uuid &homeId, const Uuid &zoneId );
+    void removeDevice( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId );
+};
+
+class Publisher
+{
+    esp_mqtt_client_handle_t _client;
+    SemaphoreHandle_t _lock;
+    TaskHandle_t _task;
+    bool _connected;
+    int _inflight;
+    bool _hasPending;
+    bool _pendingSpooled;
+    PublishMessage _pending;
+
+    PublishRing _actuation;
+    PublishRing _telemetry;
+    PublishRing _logs;
+    PublishRing *_rings[PUBLISH_PRIORITIES];
+
+    // readings and actuations that overflow the queues while disconnected
+    // wait in flash; only the publisher task touches it once started
+    PartitionStorage _storage;
+    FlashRingLog _spool;
+    PublishMessage _overflow;
+    TickType_t _lastReplay;
+
+    bool spool( PublishMessage &message );
+    void spoolOverflow();
+    bool unspool( PublishMessage &message );
+    bool next();
+    TickType_t replayDelay();
+
+public:
+    Publisher();
+    ~Publisher();
+
+    void start( esp_mqtt_client_handle_t client );
+    bool enqueue( PublishPriority priority, const char *topic, const char *message, size_t len, int qos, bool retain );
+    void setConnected( bool connected );
+    void published( int msg_id );
+    void run();
+};
+
+class LogRecord
+{
+public:
+    time_t time;
+    uint32_t uptime;
+    esp_log_level_t level;
+    char tag[16];
+    char homeId[37];
+    char zoneId[37];
+    // binary records keep the format and tag addresses and the packed
+    // arguments in place of the message; the host resolves them against
+    // the firmware image
+    bool binary;
+    const char *format;
+    const char *tagId;
+    uint8_t length;
+    char message[CONFIG_AUTOHOME_LOG_MESSAGE_SIZE];
+};
+
+size_t packLogArguments( char *buffer, size_t size, const char *format, va_list args );
+
+class RemoteLog
+{
+    static const uint32_t SIZE = CONFIG_AUTOHOME_LOG_QUEUE_SIZE;
+    static_assert( ( SIZE & ( SIZE - 1 ) ) == 0, "log queue size must be a power of two" );
+
+    class Cell
+    {
+    public:
+        std::atomic<uint32_t> sequence;
+        LogRecord record;
+    };
+
+    // bounded multi-producer multi-consumer queue: each cell's sequence
+    // says whether it is free for the writer or ready for the reader at a
+    // given position, so producers only contend on one atomic counter
+    Cell _cells[SIZE];
+    std::atomic<uint32_t> _enqueue;
+    std::atomic<uint32_t> _dequeue;
+    std::atomic<uint32_t> _dropped;
+
+    MQTTClient *_client;
+    TaskHandle_t _task;
+    char _topic[128];
+    char _batch[CONFIG_AUTOHOME_PUBLISH_MAX_MESSAGE];
+    size_t _batchLength;
+    bool _batchBinary;
+    char _entry[CONFIG_AUTOHOME_LOG_MESSAGE_SIZE + 128];
+
+    LogRecord *front( uint32_t &position );
+    void release( uint32_t position );
+    void append( const LogRecord &record );
+    void publishBatch();
+    size_t encodeText( const LogRecord &record );
+    size_t encodeBinary( const LogRecord &record );
+
+public:
+    RemoteLog();
+
+    void start( MQTTClient *client );
+
+    // claims a record to fill in, or NULL when the queue is full
+    LogRecord *reserve( uint32_t &position );
+    void commit( uint32_t position );
+
+    void flush();
+    void run();
+};
+
+class HomeSettings
+{
+public:
+    char homeId[37];
+    PayloadEncoding encoding;
+};
+
+typedef std::vector<HomeSettings> HomeSettingsList;
+
+class Subscription
+{
+public:
+    char topic[160];
+    bool wanted;
+};
+
+typedef std::vector<Subscription> SubscriptionList;
+
+class MQTTClient
+{
+    Network &_network;
+    ZoneList _zones;
+    HomeSettingsList _homes;
+    SubscriptionList _subscriptions;
+    esp_mqtt_client_config_t _mqtt_config;
+    esp_mqtt_client_handle_t _client;
+    bool _connected;
+    TopicRouter _router;
+
+    MQTTDataPool _inflight;
+    Publisher _publisher;
+    RemoteLog _log;
+    ConfigSnapshot _snapshot;
+    SensorScheduler _scheduler;
+    std::vector<OneWireBus*> _buses;
+
+    void subscribeZone( const Zone &zone );
+    void updateSubscriptions();
+
+public:
+    MQTTClient( Network &network );
+    ~MQTTClient();
+
+    void init();
+    void connect( const char *brokerUrl );
+    void publish( const char *topic, const char *message, int qos = 1, bool retain = true, PublishPriority priority = PUBLISH_TELEMETRY );
+    void publish( const char *topic, const char *data, size_t len, int qos, bool retain, PublishPriority priority );
+    void handleEvent( esp_mqtt_event_handle_t event );
+
+    void addZone( const char *home, const char *zone );
+    void removeZone( const char *home, const char *zone );
+    Zone *getZone( const char *home, const char *zone ) const;
+    void updateRoutes();
+
+    void setEncoding( const char *home, PayloadEncoding encoding );
+    PayloadEncoding getEncoding( const char *home ) const;
+
+    RemoteLog &getLog() { return _log; }
+    ConfigSnapshot &getSnapshot() { return _snapshot; }
+    SensorScheduler &getScheduler() { return _scheduler; }
+    OneWireBus &getBus( gpio_num_t pin );
+    void restore();
+};
+
+enum ValueKind {
+    VALUE_DOUBLE,
+    VALUE_INT,
+    VALUE_BOOL
+};
+
+class ReportedValue
+{
+public:
+    Uuid deviceId;
+    ReadingType type;
+    bool reported;
+    double value;
+    bool hasTarget;
+    double target;
+    TickType_t time;
+    // the latest reading, reported or not, to act on again when the
+    // targets change
+    ValueKind kind;
+    DeviceValue latest;
+    double threshold;
+};
+
+typedef std::vector<ReportedValue> ReportedValueList;
+
+class RemoteReading
+{
+public:
+    Uuid homeId;
+    Uuid zoneId;
+    Uuid deviceId;
+    ReadingType type;
+    DeviceValue value;
+    double threshold;
+    TickType_t time;
+
+    bool matches( const Uuid &home, const Uuid &zone, const Uuid &device, ReadingType type ) const;
+    bool stale( TickType_t now ) const;
+};
+
+// bounded to CONFIG_AUTOHOME_REMOTE_READINGS, and reserved up front so that
+// entries never move
+typedef std::vector<RemoteReading> RemoteReadingList;
 
 class Zone
 {
     MQTTClient &_client;
     DeviceList _devices;
     ScheduleList _schedules;
-    OverrideList _overrides;
+    OverrideIndex _overrides;
+    mutable TargetTimeline _timeline;
+    ActuatorIndex _actuators;
+    ReportedValueList _reported;
+    RemoteReadingList _remote;
+    // the target last found for each reading while the clock was set, which
+    // stands in for the schedules until it is set again
+    mutable DeviceTargetList _held;
+    mutable bool _heldChanged;
     char _homeId[37];
     char _zoneId[37];
+    Uuid _homeUuid;
+    Uuid _zoneUuid;
+    PayloadEncoding _encoding;
+    esp_log_level_t _logLevel;
+    bool _logBinary;
+    ReadingAggregation _aggregate;
+    ReadingFrame *_frame;
+    TimerHandle_t _frameTimer;
+    SemaphoreHandle_t _frameLock;
+    TimerHandle_t _transitionTimer;
+    TimerHandle_t _actuationTimer;
+    SemaphoreHandle_t _lock;
+    // set once the zone is being deleted; timer callbacks then do nothing
+    bool _closing;
+
+    ReportedValue &lastReading( const Uuid &deviceId, ReadingType type );
+    bool shouldReport( ReportedValue &last, double value, const DeviceTarget *target );
+    void scheduleTransition();
 
     void handleValue( const char *homeId, const char *zoneId, const char *deviceId, const char *type, double value, const char *valueUnit, double target, const char *targetUnit );
     void handleValue( const char *homeId, const char *zoneId, const char *deviceId, const char *type, int value, const char *valueUnit, int target, const char *targetUnit );
     void handleValue( const char *homeId, const char *zoneId, const char *deviceId, const char *type, bool value, const char *valueUnit, bool target, const char *targetUnit );
 
-    const DeviceTarget *findDeviceTarget( const char *deviceId, const char *type ) const;
+    const DeviceTarget *findDeviceTarget( const Uuid &home, const Uuid &zone, const Uuid &deviceId, ReadingType type ) const;
+    void holdTarget( const Uuid &home, const Uuid &zone, const Uuid &deviceId, ReadingType type, const DeviceTarget *target ) const;
+    RemoteReading &cacheRemoteValue( const Uuid &home, const Uuid &zone, const Uuid &deviceId, ReadingType type, const DeviceValue &value, double threshold );
+    const RemoteReading *findRemoteValue( const Uuid &home, const Uuid &zone, const Uuid &deviceId, ReadingType type ) const;
+    void evaluateRemoteValue( const RemoteReading &reading );
+    void evaluateRemoteValues();
+    void discardDevice( Device *device );
     const Device *findDeviceForTarget( const char *home, const char *zone, const char *deviceId, const char *type, int8_t direction );
 
-    bool matchesZone( const char **path, size_t pathlen );
-    void configureZoneDeviceJSON( const char *deviceId, cJSON *json );
-    void sendDeviceReadingJSON( const char *deviceId, const char *type, cJSON *value, cJSON *target=NULL, cJSON *threshold=NULL );
-    void setRemoteValueJSON( const char *home, const char *zone, const char *deviceId, const char *type, cJSON *json );
+    void sendDeviceReading( const Uuid &deviceId, ReadingType type, const Reading &reading );
+    void queueReading( const Uuid &deviceId, ReadingType type, const Reading &reading );
+    void publishFrame();
 
-    void takeAction( const char *home, const char *zone, const char *deviceId, const char *type, double value, const char *unit, double targetValue, const char *targetUnit, double threshold = 0 );
-    void takeAction( const char *home, const char *zone, const char *deviceId, const char *type, int value, const char *unit, int targetValue, const char *targetUnit, int threshold = 0 );
-    void takeAction( const char *home, const char *zone, const char *deviceId, const char *type, bool value, bool targetValue );
+    void indexActuators();
+    void driveActuators( const Uuid &home, const Uuid &zone, const Uuid &deviceId, ReadingType type, bool belowTarget );
+    void takeAction( const Uuid &home, const Uuid &zone, const Uuid &deviceId, ReadingType type, double value, const char *unit, double targetValue, const char *targetUnit, double threshold = 0 );
+    void takeAction( const Uuid &home, const Uuid &zone, const Uuid &deviceId, ReadingType type, int value, const char *unit, int targetValue, const char *targetUnit, int threshold = 0 );
+    void takeAction( const Uuid &home, const Uuid &zone, const Uuid &deviceId, ReadingType type, bool value, bool targetValue );
     
 public:
     Zone( MQTTClient &client, const char *home, const char *zone );
@@ -298,23 +1398,46 @@ public:
 
     const char *getHomeId() const { return _homeId; }
     const char *getZoneId() const { return _zoneId; }
-
-    bool matches( const char *home, const char *zone ) const;
-    void configureZoneJSON( const char **path, size_t pathlen, cJSON *json );
-
-    void setValue( const char *id, const char *type, double value, const char *unit, double threshold=0 );
-    void setValue( const char *id, const char *type, int value, const char *unit, int threshold=0 );
-    void setValue( const char *id, const char *type, bool value );
+    const Uuid &getHomeUuid() const { return _homeUuid; }
+    const Uuid &getZoneUuid() const { return _zoneUuid; }
+    SensorScheduler &getScheduler() { return _client.getScheduler(); }
+    OneWireBus &getBus( gpio_num_t pin ) { return _client.getBus( pin ); }
+
+    void setEncoding( PayloadEncoding encoding ) { _encoding = encoding; }
+    void setAggregation( ReadingAggregation aggregate );
+    void setLogLevel( esp_log_level_t level );
+    void setLogBinary( bool binary ) { _logBinary = binary; }
+    void save( SnapshotWriter &writer ) const;
+    void flushReadings();
+    void applyTransitions();
+    void scheduleActuation();
+    void applyActuations();
+
+    bool matches( const Uuid &home, const Uuid &zone ) const;
+    bool dependsOn( const Uuid &home, const Uuid &zone, const Uuid &deviceId ) const;
+    const DeviceList &getDevices() const { return _devices; }
+
+    void configureZone( ZoneConfig &config );
+    void configureZoneDevice( const char *deviceId, DeviceConfig &config );
+    void setRemoteValue( const Uuid &home, const Uuid &zone, const Uuid &deviceId, ReadingType type, const DeviceValue &value, double threshold );
+
+    void setValue( const Uuid &id, ReadingType type, double value, const char *unit, double threshold=0 );
+    void setValue( const Uuid &id, ReadingType type, int value, const char *unit, int threshold=0 );
+    void setValue( const Uuid &id, ReadingType type, bool value );
+    void republish();
 
     void addDevice( Device *device );
     void removeDevice( const char *deviceId );
     Device * findDevice( const char *deviceId );
+    Device * findDevice( const Uuid &deviceId );
+    // copied, as new config may replace the calibrations while a sensor reads
+    bool getCalibration( Device *device, ReadingType type, DeviceCalibration &calibration );
     void clearDevices();
 
-    void addSchedule( cJSON *json );
+    void setSchedules( ScheduleList &schedules );
     void clearSchedules();
 
-    void addOverride( cJSON *json );
+    void setOverrides( OverrideList &overrides );
     void clearOverrides();
     
     Device *getDevice( const char *deviceId );
@@ -328,7 +1451,6 @@ class DHTSensor : public Device
     gpio_num_t _pin;
     dht_sensor_type_t _type;
     uint32_t _interval;
-    TaskHandle_t _task;
 
 public:
     DHTSensor( Zone &zone, const char *id );
@@ -344,12 +1466,52 @@ public:
     void read();
 };
 
+// The DS18X20 sensors sharing a pin. A conversion is started on all of them
+// at once; a sensor read while one is under way waits for it instead of
+// starting another, and each then reads its own scratchpad.
+class OneWireBus
+{
+    gpio_num_t _pin;
+    SemaphoreHandle_t _lock;
+    std::vector<DS18X20Sensor*> _sensors;
+    bool _converting;
+    TickType_t _started;
+    TickType_t _conversion;
+    // counts conversions started and abandoned, so a read can tell whether
+    // the one it waited for is what the scratchpad holds
+    uint32_t _generation;
+
+    TickType_t conversionTime() const;
+    void abandon();
+
+public:
+    OneWireBus( gpio_num_t pin );
+    ~OneWireBus();
+
+    gpio_num_t getPin() const { return _pin; }
+    void attach( DS18X20Sensor *sensor );
+    void detach( DS18X20Sensor *sensor );
+    int scan( ds18x20_addr_t *addrs, int count );
+    esp_err_t configure( ds18x20_addr_t addr, uint8_t resolution );
+
+    // how long until the conversion is done, and which one it is
+    esp_err_t start( TickType_t &wait, uint32_t &conversion );
+    // reads the result of that conversion for one sensor
+    esp_err_t finish( ds18x20_addr_t addr, uint32_t conversion, float &temperature );
+};
+
 class DS18X20Sensor : public Device
 {
     gpio_num_t _pin;
     ds18x20_addr_t _addr;
     uint32_t _interval;
-    TaskHandle_t _task;
+    OneWireBus *_bus;
+    uint32_t _conversion;
+    uint8_t _resolution;
+    bool _configured;
+
+    void sampled( float temperature );
+    void failed( esp_err_t err );
 
 public:
     DS18X20Sensor( Zone &zone, const char *id );
@@ -362,12 +1524,29 @@ public:
     esp_err_t init( gpio_num_t pin, ds18x20_addr_t addr = ds18x20_ANY );
     void setInterval( uint32_t interval );
     uint32_t getInterval() const;
-    void read();
+    ds18x20_addr_t getAddress() const { return _addr; }
+    void setResolution( uint8_t resolution );
+    uint8_t getResolution() const { return _resolution; }
+    bool hasResolution() const;
+    TickType_t startRead();
+    void finishRead();
 };
 
 class Switch : public Device
 {
     OutputToggle _toggle;
+    SwitchLimits _limits;
+    bool _changed;
+    TickType_t _lastChange;
+    // when the last changes were made, for the hourly limit
+    std::vector<TickType_t> _history;
+    bool _hasPending;
+    bool _pending;
+    uint32_t _suppressed;
+
+    TickType_t holdTime();
+    bool request( bool on );
+    bool apply( bool on );
 
 public:
     Switch( Zone &zone, const char *id );
@@ -378,8 +1557,14 @@ public:
     }
 
     esp_err_t init( gpio_num_t pin );
-    void on();
-    void off();
+    void setLimits( const SwitchLimits &limits ) { _limits = limits; }
+    SwitchLimits getLimits() const { return _limits; }
+    uint32_t suppressed() const { return _suppressed; }
+
+    bool on();
+    bool off();
+    TickType_t pendingDelay();
+    bool applyPending();
 };
 
 #endif
@@ -0,0 +1,911 @@
+#include "autohome.h"
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+
+static const char *TAG = "decoder";
+
+ZoneConfig::ZoneConfig()
+{
+    reset();
+}
+
+void ZoneConfig::reset()
+{
+    controller[0] = '\0';
+    hasAggregate = false;
+    aggregate = AGGREGATE_NONE;
+    hasLogLevel = false;
+    logLevel = ESP_LOG_NONE;
+    hasLogFormat = false;
+    logBinary = false;
+    hasSchedules = false;
+    schedules.clear();
+    hasOverrides = false;
+    overrides.clear();
+    hasHeld = false;
+    held.clear();
+}
+
+DeviceConfig::DeviceConfig()
+{
+    reset();
+}
+
+void DeviceConfig::reset()
+{
+    type[0] = '\0';
+    address[0] = '\0';
+    hasInterval = false;
+    interval = 0;
+    limits = SwitchLimits();
+    resolution = 0;
+    hasChanges = false;
+    changes.clear();
+    hasCalibrations = false;
+    calibrations.clear();
+}
+
+bool ZoneConfig::load( SnapshotReader &reader )
+{
+    reset();
+
+    hasAggregate = true;
+    aggregate = (ReadingAggregation)reader.get8();
+    hasLogLevel = true;
+    logLevel = (esp_log_level_t)reader.get8();
+    hasLogFormat = true;
+    logBinary = reader.get8() != 0;
+
+    hasSchedules = true;
+    schedules.resize( reader.getCount( 5 ) );
+    for( ScheduleList::iterator schedule = schedules.begin(); schedule != schedules.end(); ++schedule ) {
+        schedule->load( reader );
+    }
+
+    hasOverrides = true;
+    overrides.resize( reader.getCount( 18 ) );
+    for( OverrideList::iterator o = overrides.begin(); o != overrides.end(); ++o ) {
+        o->load( reader );
+    }
+
+    hasHeld = true;
+    held.resize( reader.getCount( 3 * 17 ) );
+    for( DeviceTargetList::iterator target = held.begin(); target != held.end(); ++target ) {
+        target->load( reader );
+    }
+
+    return reader.done();
+}
+
+bool DeviceConfig::load( SnapshotReader &reader )
+{
+    reset();
+
+    reader.getString( type, sizeof( type ) );
+    reader.getString( address, sizeof( address ) );
+    hasInterval = true;
+    interval = reader.get32();
+    limits.minOnTime = reader.get32();
+    limits.minOffTime = reader.get32();
+    limits.maxPerHour = reader.get32();
+    resolution = reader.get8();
+
+    hasChanges = true;
+    changes.resize( reader.getCount( 3 * 17 + 2 ) );
+    for( DeviceChangeList::iterator change = changes.begin(); change != changes.end(); ++change ) {
+        change->load( reader );
+    }
+
+    hasCalibrations = true;
+    calibrations.resize( reader.getCount( 1 + 3 * 9 ) );
+    for( DeviceCalibrationList::iterator calibration = calibrations.begin(); calibration != calibrations.end(); ++calibration ) {
+        calibration->load( reader );
+    }
+
+    return reader.done();
+}
+
+bool ConfigPath::push()
+{
+    if( _depth >= MAX_DEPTH ) {
+        return false;
+    }
+
+    _keys[_depth++][0] = '\0';
+    return true;
+}
+
+void ConfigPath::pop()
+{
+    if( _depth > 0 ) {
+        --_depth;
+    }
+}
+
+void ConfigPath::setKey( const char *key )
+{
+    if( _depth == 0 ) {
+        return;
+    }
+
+    // cut short, a key could match a shorter one; instead it matches nothing
+    if( strlen( key ) >= sizeof( _keys[0] ) ) {
+        ESP_LOGW( TAG, "Ignoring config key %.16s..., it is too long", key );
+        strcpy( _keys[_depth - 1], "\x7f" );
+        return;
+    }
+
+    strcpy( _keys[_depth - 1], key );
+}
+
+const char *ConfigPath::key() const
+{
+    return _depth > 0 ? _keys[_depth - 1] : "";
+}
+
+bool ConfigPath::is( const char *pattern ) const
+{
+    const char *part = pattern;
+
+    for( uint8_t d = 0; d < _depth; ++d ) {
+        if( *part == '\0' ) {
+            return false;
+        }
+
+        const char *end = strchr( part, '/' );
+        size_t len = end ? (size_t)( end - part ) : strlen( part );
+
+        if( len == 1 && *part == '*' ) {
+            if( _keys[d][0] != '\0' ) {
+                return false;
+            }
+        } else if( !( len == 1 && *part == '+' ) ) {
+            if( strncmp( _keys[d], part, len ) != 0 || _keys[d][len] != '\0' ) {
+                return false;
+            }
+        }
+
+        part = end ? end + 1 : part + len;
+    }
+
+    return *part == '\0';
+}
+
+JSONStream::JSONStream( ConfigHandler &handler )
+    : _handler( handler )
+{
+    reset();
+}
+
+void JSONStream::reset()
+{
+    _path.reset();
+    _state = VALUE;
+    _isKey = false;
+    _objects = 0;
+    _unicode = 0;
+    _unicodeDigits = 0;
+    _length = 0;
+}
+
+bool JSONStream::append( char c )
+{
+    // strings longer than the scratch buffer are truncated, not rejected
+    if( _length < sizeof( _scratch ) - 1 ) {
+        _scratch[_length++] = c;
+    }
+    return true;
+}
+
+void JSONStream::afterValue()
+{
+    _state = _path.depth() == 0 ? DONE : NEXT;
+}
+
+bool JSONStream::value( char c )
+{
+    switch( c ) {
+    case '{':
+        _handler.beginObject( _path );
+        if( !_path.push() ) {
+            return false;
+        }
+        _objects |= BIT( _path.depth() );
+        _state = FIRST_KEY;
+        return true;
+    case '[':
+        _handler.beginArray( _path );
+        if( !_path.push() ) {
+            return false;
+        }
+        _objects &= ~BIT( _path.depth() );
+        _state = VALUE;
+        return true;
+    case ']':
+        // only valid straight after '[' (or after a trailing ',')
+        return _path.depth() > 0 && !( _objects & BIT( _path.depth() ) ) && close( c );
+    case '"':
+        _isKey = false;
+        _length = 0;
+        _state = STRING;
+        return true;
+    default:
+        _length = 0;
+        if( c == '-' || ( c >= '0' && c <= '9' ) ) {
+            _state = NUMBER;
+            return append( c );
+        } else if( c >= 'a' && c <= 'z' ) {
+            _state = LITERAL;
+            return append( c );
+        }
+        return false;
+    }
+}
+
+bool JSONStream::close( char c )
+{
+    bool object = ( _objects & BIT( _path.depth() ) ) != 0;
+    if( _path.depth() == 0 || object != ( c == '}' ) ) {
+        return false;
+    }
+
+    _path.pop();
+    if( object ) {
+        _handler.endObject( _path );
+    } else {
+        _handler.endArray( _path );
+    }
+
+    afterValue();
+    return true;
+}
+
+bool JSONStream::finishString()
+{
+    _scratch[_length] = '\0';
+
+    if( _isKey ) {
+        _path.setKey( _scratch );
+        _state = COLON;
+    } else {
+        _handler.string( _path, _scratch );
+        afterValue();
+    }
+    return true;
+}
+
+bool JSONStream::finishNumber()
+{
+    char *end = NULL;
+    _scratch[_length] = '\0';
+
+    double number = strtod( _scratch, &end );
+    if( end == _scratch || *end != '\0' ) {
+        return false;
+    }
+
+    _handler.number( _path, number );
+    afterValue();
+    return true;
+}
+
+bool JSONStream::finishLiteral()
+{
+    _scratch[_length] = '\0';
+
+    if( strcmp( _scratch, "true" ) == 0 ) {
+        _handler.boolean( _path, true );
+    } else if( strcmp( _scratch, "false" ) == 0 ) {
+        _handler.boolean( _path, false );
+    } else if( strcmp( _scratch, "null" ) != 0 ) {
+        return false;
+    }
+
+    afterValue();
+    return true;
+}
+
+bool JSONStream::feed( const char *data, size_t len )
+{
+    size_t i = 0;
+
+    while( i < len && _state != FAILED ) {
+        char c = data[i];
+        bool ok = true;
+        bool consumed = true;
+
+        switch( _state ) {
+        case STRING:
+            if( c == '"' ) {
+                ok = finishString();
+            } else if( c == '\\' ) {
+                _state = ESCAPE;
+            } else {
+                ok = append( c );
+            }
+            break;
+        case ESCAPE:
+            _state = STRING;
+            switch( c ) {
+            case 'b': ok = append( '\b' ); break;
+            case 'f': ok = append( '\f' ); break;
+            case 'n': ok = append( '\n' ); break;
+            case 'r': ok = append( '\r' ); break;
+            case 't': ok = append( '\t' ); break;
+            case 'u':
+                _unicode = 0;
+                _unicodeDigits = 0;
+                _state = UNICODE;
+                break;
+            default: ok = append( c ); break;
+            }
+            break;
+        case UNICODE:
+            if( c >= '0' && c <= '9' ) {
+                _unicode = ( _unicode << 4 ) | ( c - '0' );
+            } else if( ( c | 0x20 ) >= 'a' && ( c | 0x20 ) <= 'f' ) {
+                _unicode = ( _unicode << 4 ) | ( ( c | 0x20 ) - 'a' + 10 );
+            } else {
+                ok = false;
+                break;
+            }
+
+            if( ++_unicodeDigits == 4 ) {
+                if( _unicode < 0x80 ) {
+                    append( (char)_unicode );
+                } else if( _unicode < 0x800 ) {
+                    append( (char)( 0xc0 | ( _unicode >> 6 ) ) );
+                    append( (char)( 0x80 | ( _unicode & 0x3f ) ) );
+                } else {
+                    append( (char)( 0xe0 | ( _unicode >> 12 ) ) );
+                    append( (char)( 0x80 | ( ( _unicode >> 6 ) & 0x3f ) ) );
+                    append( (char)( 0x80 | ( _unicode & 0x3f ) ) );
+                }
+                _state = STRING;
+            }
+            break;
+        case NUMBER:
+            if( ( c >= '0' && c <= '9' ) || c == '.' || c == '-' || c == '+' || c == 'e' || c == 'E' ) {
+                ok = append( c );
+            } else {
+                ok = finishNumber();
+                consumed = false;
+            }
+            break;
+        case LITERAL:
+            if( c >= 'a' && c <= 'z' ) {
+                ok = append( c );
+            } else {
+                ok = finishLiteral();
+                consumed = false;
+            }
+            break;
+        default:
+            if( c == ' ' || c == '\t' || c == '\r' || c == '\n' ) {
+                break;
+            }
+
+            switch( _state ) {
+            case VALUE:
+                ok = value( c );
+                break;
+            case FIRST_KEY:
+                if( c == '}' ) {
+                    ok = close( c );
+                    break;
+                }
+                // fall through
+            case KEY:
+                if( c == '"' ) {
+                    _isKey = true;
+                    _length = 0;
+                    _state = STRING;
+                } else {
+                    ok = false;
+                }
+                break;
+            case COLON:
+                if( c == ':' ) {
+                    _state = VALUE;
+                } else {
+                    ok = false;
+                }
+                break;
+            case NEXT:
+                if( c == ',' ) {
+                    _state = ( _objects & BIT( _path.depth() ) ) ? KEY : VALUE;
+                } else {
+                    ok = close( c );
+                }
+                break;
+            default:
+                // nothing but whitespace may follow the top level value
+                ok = false;
+                break;
+            }
+            break;
+        }
+
+        if( !ok ) {
+            ESP_LOGW( TAG, "Invalid JSON at '%c' (depth %d)", c, _path.depth() );
+            _state = FAILED;
+        } else if( consumed ) {
+            ++i;
+        }
+    }
+
+    return _state != FAILED;
+}
+
+bool JSONStream::finish()
+{
+    if( _state == NUMBER && !finishNumber() ) {
+        _state = FAILED;
+    } else if( _state == LITERAL && !finishLiteral() ) {
+        _state = FAILED;
+    }
+
+    return _state == DONE;
+}
+
+ConfigDecoder::ConfigDecoder()
+    : _kind( MQTTTopic::UNKNOWN ), _target( NULL ), _hasValue( false )
+{
+}
+
+void ConfigDecoder::reset( const MQTTTopic &topic )
+{
+    _kind = topic.kind;
+    _homeId = topic.home;
+    _zoneId = topic.zone;
+    _target = NULL;
+
+    _encoding[0] = '\0';
+    _zone.reset();
+    _device.reset();
+    _value = DeviceValue();
+    _hasValue = false;
+    _threshold = 0;
+}
+
+void ConfigDecoder::beginObject( const ConfigPath &path )
+{
+    if( _kind == MQTTTopic::ZONE_CONFIG ) {
+        if( path.is( "schedules/*" ) ) {
+            _zone.schedules.emplace_back();
+        } else if( path.is( "overrides/*" ) ) {
+            _zone.overrides.emplace_back();
+        } else if( path.is( "schedules/*/changes/*" ) && !_zone.schedules.empty() ) {
+            _target = &_zone.schedules.back().addTarget( _homeId, _zoneId );
+        } else if( path.is( "overrides/*/changes/*" ) && !_zone.overrides.empty() ) {
+            _target = &_zone.overrides.back().addTarget( _homeId, _zoneId );
+        }
+    } else if( _kind == MQTTTopic::DEVICE_CONFIG ) {
+        if( path.is( "changes/*" ) ) {
+            _device.changes.emplace_back( _homeId, _zoneId );
+        } else if( path.is( "calibrations/*" ) ) {
+            _device.calibrations.emplace_back();
+        }
+    }
+}
+
+void ConfigDecoder::beginArray( const ConfigPath &path )
+{
+    if( _kind == MQTTTopic::ZONE_CONFIG ) {
+        if( path.is( "schedules" ) ) {
+            _zone.hasSchedules = true;
+        } else if( path.is( "overrides" ) ) {
+            _zone.hasOverrides = true;
+        }
+    } else if( _kind == MQTTTopic::DEVICE_CONFIG ) {
+        if( path.is( "changes" ) ) {
+            _device.hasChanges = true;
+        } else if( path.is( "calibrations" ) ) {
+            _device.hasCalibrations = true;
+        }
+    }
+}
+
+void ConfigDecoder::string( const ConfigPath &path, const char *value )
+{
+    if( _kind == MQTTTopic::HOME_CONFIG ) {
+        if( path.is( "encoding" ) ) {
+            strncpy( _encoding, value, sizeof( _encoding ) - 1 );
+            _encoding[sizeof( _encoding ) - 1] = '\0';
+        }
+    } else if( _kind == MQTTTopic::ZONE_CONFIG ) {
+        if( path.is( "controller" ) ) {
+            strncpy( _zone.controller, value, sizeof( _zone.controller ) - 1 );
+            _zone.controller[sizeof( _zone.controller ) - 1] = '\0';
+        } else if( path.is( "aggregate" ) ) {
+            _zone.hasAggregate = true;
+            if( strcmp( value, "also" ) == 0 ) {
+                _zone.aggregate = AGGREGATE_ALSO;
+            } else if( strcmp( value, "only" ) == 0 ) {
+                _zone.aggregate = AGGREGATE_ONLY;
+            } else {
+                _zone.aggregate = AGGREGATE_NONE;
+            }
+        } else if( path.is( "logLevel" ) ) {
+            static const char *levels[] = { "none", "error", "warn", "info", "debug", "verbose" };
+            for( int level = ESP_LOG_NONE; level <= ESP_LOG_VERBOSE; ++level ) {
+                if( strcmp( value, levels[level] ) == 0 ) {
+                    _zone.hasLogLevel = true;
+                    _zone.logLevel = (esp_log_level_t)level;
+                }
+            }
+        } else if( path.is( "logFormat" ) ) {
+            _zone.hasLogFormat = true;
+            _zone.logBinary = strcmp( value, "binary" ) == 0;
+        } else if( path.is( "schedules/*/start" ) && !_zone.schedules.empty() ) {
+            _zone.schedules.back().setStart( value );
+        } else if( path.is( "overrides/*/start" ) && !_zone.overrides.empty() ) {
+            _zone.overrides.back().setStart( value );
+        } else if( path.is( "overrides/*/end" ) && !_zone.overrides.empty() ) {
+            _zone.overrides.back().setEnd( value );
+        } else if( path.is( "+/*/changes/*/value/unit" ) && _target ) {
+            _target->value().setUnit( value );
+        } else if( path.is( "+/*/changes/*/+" ) && _target ) {
+            _target->setField( path.key(), value );
+        }
+    } else if( _kind == MQTTTopic::DEVICE_CONFIG ) {
+        if( path.is( "interface/type" ) ) {
+            strncpy( _device.type, value, sizeof( _device.type ) - 1 );
+            _device.type[sizeof( _device.type ) - 1] = '\0';
+        } else if( path.is( "interface/address" ) ) {
+            strncpy( _device.address, value, sizeof( _device.address ) - 1 );
+            _device.address[sizeof( _device.address ) - 1] = '\0';
+        } else if( path.is( "changes/*/+" ) && !_device.changes.empty() ) {
+            _device.changes.back().setField( path.key(), value );
+        } else if( path.is( "calibrations/*/type" ) && !_device.calibrations.empty() ) {
+            _device.calibrations.back().setType( value );
+        } else if( path.is( "calibrations/*/calibration/unit" ) && !_device.calibrations.empty() ) {
+            _device.calibrations.back().calibration().setUnit( value );
+        } else if( path.is( "calibrations/*/threshold/unit" ) && !_device.calibrations.empty() ) {
+            _device.calibrations.back().threshold().setUnit( value );
+        }
+    } else if( _kind == MQTTTopic::DEVICE_VALUE ) {
+        if( path.is( "value/unit" ) ) {
+            _value.setUnit( value );
+        }
+    }
+}
+
+void ConfigDecoder::finish()
+{
+    size_t dropped = 0;
+
+    // a change or target with an id that is not a UUID would alias every
+    // other such id, so it is left out rather than kept as the nil UUID
+    for( ScheduleList::iterator schedule = _zone.schedules.begin(); schedule != _zone.schedules.end(); ++schedule ) {
+        dropped += schedule->pruneTargets();
+    }
+    for( OverrideList::iterator o = _zone.overrides.begin(); o != _zone.overrides.end(); ++o ) {
+        dropped += o->pruneTargets();
+    }
+
+    size_t changes = _device.changes.size();
+    _device.changes.erase( std::remove_if( _device.changes.begin(), _device.changes.end(),
+        [](const DeviceChange &change) {
+            return !change.valid();
+        }), _device.changes.end() );
+    dropped += changes - _device.changes.size();
+
+    if( dropped > 0 ) {
+        ESP_LOGW( TAG, "Skipped %u changes and targets whose ids are not UUIDs", (unsigned)dropped );
+    }
+}
+
+void ConfigDecoder::number( const ConfigPath &path, double value )
+{
+    if( _kind == MQTTTopic::ZONE_CONFIG ) {
+        if( path.is( "schedules/*/days/*" ) && !_zone.schedules.empty() ) {
+            _zone.schedules.back().addDay( (int)value );
+        } else if( path.is( "+/*/changes/*/value/value" ) && _target ) {
+            _target->value().value.doubleValue = value;
+        }
+    } else if( _kind == MQTTTopic::DEVICE_CONFIG ) {
+        if( path.is( "interface/interval" ) ) {
+            _device.hasInterval = true;
+            _device.interval = (uint32_t)value;
+        } else if( path.is( "interface/minOnTime" ) ) {
+            _device.limits.minOnTime = (uint32_t)value;
+        } else if( path.is( "interface/minOffTime" ) ) {
+            _device.limits.minOffTime = (uint32_t)value;
+        } else if( path.is( "interface/maxSwitchesPerHour" ) ) {
+            _device.limits.maxPerHour = (uint32_t)value;
+        } else if( path.is( "interface/resolution" ) ) {
+            _device.resolution = (uint8_t)value;
+        } else if( path.is( "calibrations/*/calibration/value" ) && !_device.calibrations.empty() ) {
+            _device.calibrations.back().calibration().value.doubleValue = value;
+        } else if( path.is( "calibrations/*/threshold/value" ) && !_device.calibrations.empty() ) {
+            _device.calibrations.back().threshold().value.doubleValue = value;
+        } else if( path.is( "calibrations/*/deadband/value" ) && !_device.calibrations.empty() ) {
+            _device.calibrations.back().deadband().value.doubleValue = value;
+        }
+    } else if( _kind == MQTTTopic::DEVICE_VALUE ) {
+        if( path.is( "value/value" ) ) {
+            _value.value.doubleValue = value;
+            _hasValue = true;
+        } else if( path.is( "threshold/value" ) ) {
+            _threshold = value;
+        }
+    }
+}
+
+void ConfigDecoder::boolean( const ConfigPath &path, bool value )
+{
+    if( _kind == MQTTTopic::ZONE_CONFIG ) {
+        if( path.is( "+/*/changes/*/value/value" ) && _target ) {
+            _target->value().value.boolValue = value;
+        }
+    } else if( _kind == MQTTTopic::DEVICE_CONFIG ) {
+        if( path.is( "calibrations/*/calibration/value" ) && !_device.calibrations.empty() ) {
+            _device.calibrations.back().calibration().value.boolValue = value;
+        } else if( path.is( "calibrations/*/threshold/value" ) && !_device.calibrations.empty() ) {
+            _device.calibrations.back().threshold().value.boolValue = value;
+        }
+    } else if( _kind == MQTTTopic::DEVICE_VALUE ) {
+        // remote readings are compared as numbers, like the ones we publish
+        if( path.is( "value/value" ) ) {
+            _value.value.doubleValue = value ? 1 : 0;
+            _hasValue = true;
+        }
+    }
+}
+
+static double halfToDouble( uint16_t half )
+{
+    int exponent = ( half >> 10 ) & 0x1f;
+    int mantissa = half & 0x3ff;
+    double value;
+
+    if( exponent == 0 ) {
+        value = ldexp( mantissa, -24 );
+    } else if( exponent != 31 ) {
+        value = ldexp( mantissa + 1024, exponent - 25 );
+    } else {
+        value = mantissa == 0 ? INFINITY : NAN;
+    }
+
+    return ( half & 0x8000 ) ? -value : value;
+}
+
+CBORStream::CBORStream( ConfigHandler &handler )
+    : _handler( handler )
+{
+    reset();
+}
+
+void CBORStream::reset()
+{
+    _path.reset();
+    _state = HEADER;
+    _major = 0;
+    _argBytes = 0;
+    _arg = 0;
+    _maps = 0;
+    _indefinite = 0;
+    _keys = 0;
+    _length = 0;
+    _skip = 0;
+}
+
+bool CBORStream::expectingKey() const
+{
+    return _path.depth() > 0 && ( _keys & BIT( _path.depth() ) ) != 0;
+}
+
+bool CBORStream::itemDone()
+{
+    uint8_t depth = _path.depth();
+
+    if( depth == 0 ) {
+        _state = DONE;
+        return true;
+    }
+
+    _state = HEADER;
+
+    if( _maps & BIT( depth ) ) {
+        _keys ^= BIT( depth );
+    }
+
+    if( !( _indefinite & BIT( depth ) ) && --_remaining[depth] == 0 ) {
+        return close();
+    }
+    return true;
+}
+
+bool CBORStream::open( bool map, uint64_t count, bool indefinite )
+{
+    if( expectingKey() ) {
+        return false;
+    }
+
+    if( map ) {
+        _handler.beginObject( _path );
+    } else {
+        _handler.beginArray( _path );
+    }
+
+    if( !_path.push() || count > CONFIG_AUTOHOME_MQTT_MAX_PAYLOAD ) {
+        return false;
+    }
+
+    uint8_t depth = _path.depth();
+    _remaining[depth] = map ? count * 2 : count;
+    _maps = map ? ( _maps | BIT( depth ) ) : ( _maps & ~BIT( depth ) );
+    _keys = map ? ( _keys | BIT( depth ) ) : ( _keys & ~BIT( depth ) );
+    _indefinite = indefinite ? ( _indefinite | BIT( depth ) ) : ( _indefinite & ~BIT( depth ) );
+    _state = HEADER;
+
+    if( !indefinite && count == 0 ) {
+        return close();
+    }
+    return true;
+}
+
+bool CBORStream::close()
+{
+    bool map = ( _maps & BIT( _path.depth() ) ) != 0;
+
+    _path.pop();
+    if( map ) {
+        _handler.endObject( _path );
+    } else {
+        _handler.endArray( _path );
+    }
+
+    return itemDone();
+}
+
+bool CBORStream::finishText()
+{
+    _scratch[_length] = '\0';
+
+    if( expectingKey() ) {
+        _path.setKey( _scratch );
+    } else {
+        _handler.string( _path, _scratch );
+    }
+    return itemDone();
+}
+
+bool CBORStream::number( double value )
+{
+    if( expectingKey() ) {
+        return false;
+    }
+
+    _handler.number( _path, value );
+    return itemDone();
+}
+
+bool CBORStream::item()
+{
+    // only text keys are supported in maps
+    if( expectingKey() && _major != 3 ) {
+        return false;
+    }
+
+    switch( _major ) {
+    case 0:
+        return number( (double)_arg );
+    case 1:
+        return number( -1.0 - (double)_arg );
+    case 2:
+    case 3:
+        _length = 0;
+        _skip = _arg;
+        if( _skip == 0 ) {
+            return _major == 3 ? finishText() : itemDone();
+        }
+        _state = _major == 3 ? TEXT : SKIP;
+        return true;
+    case 4:
+    case 5:
+        return open( _major == 5, _arg, false );
+    case 6:
+        // tags only describe the item that follows
+        _state = HEADER;
+        return true;
+    default:
+        switch( _info ) {
+        case 20:
+        case 21:
+            _handler.boolean( _path, _info == 21 );
+            return itemDone();
+        case 22:
+        case 23:
+            return itemDone();
+        case 25:
+            return number( halfToDouble( (uint16_t)_arg ) );
+        case 26: {
+            float f;
+            uint32_t bits = (uint32_t)_arg;
+            memcpy( &f, &bits, sizeof( f ) );
+            return number( f );
+        }
+        case 27: {
+            double d;
+            memcpy( &d, &_arg, sizeof( d ) );
+            return number( d );
+        }
+        default:
+            return false;
+        }
+    }
+}
+
+bool CBORStream::feed( const char *data, size_t len )
+{
+    for( size_t i = 0; i < len && _state != FAILED; ++i ) {
+        uint8_t b = (uint8_t)data[i];
+        bool ok = true;
+
+        switch( _state ) {
+        case HEADER:
+            if( b == 0xff ) {
+                // break: ends the innermost indefinite length container
+                ok = _path.depth() > 0 && ( _indefinite & BIT( _path.depth() ) ) && !( ( _maps & BIT( _path.depth() ) ) && !expectingKey() ) && close();
+                break;
+            }
+
+            _major = b >> 5;
+            _info = b & 0x1f;
+            _arg = 0;
+
+            if( _info < 24 ) {
+                _arg = _info;
+                ok = item();
+            } else if( _info <= 27 ) {
+                _argBytes = 1 << ( _info - 24 );
+                _state = ARGUMENT;
+            } else if( _info == 31 && ( _major == 4 || _major == 5 ) ) {
+                ok = open( _major == 5, 0, true );
+            } else {
+                ok = false;
+            }
+            break;
+        case ARGUMENT:
+            _arg = ( _arg << 8 ) | b;
+            if( --_argBytes == 0 ) {
+                ok = item();
+            }
+            break;
+        case TEXT:
+            // strings longer than the scratch buffer are truncated, not rejected
+            if( _length < sizeof( _scratch ) - 1 ) {
+                _scratch[_length++] = (char)b;
+            }
+            if( --_skip == 0 ) {
+                ok = finishText();
+            }
+            break;
+        case SKIP:
+            if( --_skip == 0 ) {
+                ok = itemDone();
+            }
+            break;
+        default:
+            // nothing may follow the top level item
+            ok = false;
+            break;
+        }
+
+        if( !ok ) {
+            ESP_LOGW( TAG, "Invalid CBOR at byte %02x (depth %d)", b, _path.depth() );
+            _state = FAILED;
+        }
+    }
+
+    return _state != FAILED;
+}
+
+bool CBORStream::finish()
+{
+    return _state == DONE;
+}
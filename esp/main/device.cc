@@ -3,8 +3,6 @@
 #include <stdlib.h>
 #include <algorithm>
 
-static const char *TAG = "device";
-
 Device::Device( Zone &zone, const char *id )
     : _zone( zone )
 {
@@ -14,6 +12,9 @@ Device::Device( Zone &zone, const char *id )
     } else {
         _id[0] = '\0';
     }
+    _uuid.parse( _id );
+    _type[0] = '\0';
+    _address[0] = '\0';
 }
 
 Device::~Device()
@@ -30,32 +31,68 @@ const char *Device::getId() const
     return _id;
 }
 
-void Device::addChange( cJSON *json )
+bool Device::hasInterface( const char *type, const char *address ) const
 {
-    _changes.emplace_front( json, _zone.getHomeId(), _zone.getZoneId() );
+    return strcmp( _type, type ) == 0 && strcmp( _address, address ) == 0;
 }
 
-void Device::clearChanges()
+void Device::setInterface( const char *type, const char *address )
 {
-    _changes.clear();
+    strncpy( _type, type, sizeof( _type ) - 1 );
+    _type[sizeof( _type ) - 1] = '\0';
+    strncpy( _address, address, sizeof( _address ) - 1 );
+    _address[sizeof( _address ) - 1] = '\0';
 }
 
-void Device::addCalibration( cJSON *json )
+bool Device::setChanges( DeviceChangeList &changes )
 {
-    _calibrations.emplace_front( json );
+    if( changes == _changes ) {
+        return false;
+    }
+
+    _changes.swap( changes );
+    return true;
 }
 
-void Device::clearCalibrations()
+bool Device::setCalibrations( DeviceCalibrationList &calibrations )
 {
-    _calibrations.clear();
+    if( calibrations == _calibrations ) {
+        return false;
+    }
+
+    _calibrations.swap( calibrations );
+    return true;
+}
+
+void Device::save( SnapshotWriter &writer ) const
+{
+    writer.putString( _type );
+    writer.putString( _address );
+    writer.put32( getInterval() );
+
+    SwitchLimits limits = getLimits();
+    writer.put32( limits.minOnTime );
+    writer.put32( limits.minOffTime );
+    writer.put32( limits.maxPerHour );
+    writer.put8( getResolution() );
+
+    writer.put16( _changes.size() );
+    for( DeviceChangeList::const_iterator change = _changes.cbegin(); change != _changes.cend(); ++change ) {
+        change->save( writer );
+    }
+
+    writer.put16( _calibrations.size() );
+    for( DeviceCalibrationList::const_iterator calibration = _calibrations.cbegin(); calibration != _calibrations.cend(); ++calibration ) {
+        calibration->save( writer );
+    }
 }
 
-const DeviceCalibration* Device::findCalibration( const char *type )
+const DeviceCalibration* Device::findCalibration( ReadingType type )
 {
     DeviceCalibrationList::iterator it = std::find_if(
         _calibrations.begin(), _calibrations.end(),
         [type](const DeviceCalibration &calibration) {
-            return calibration.matches( (const char *)type );
+            return calibration.matches( type );
         });
 
     if( it != _calibrations.end() ) {
@@ -65,130 +102,94 @@ const DeviceCalibration* Device::findCalibration( const char *type )
     return NULL;
 }
 
-DeviceChange::DeviceChange( cJSON *json, const char *defaultHomeId, const char *defaultZoneId )
+DeviceChange::DeviceChange( const Uuid &defaultHomeId, const Uuid &defaultZoneId )
+    : _homeId( defaultHomeId ), _zoneId( defaultZoneId ), _type( READING_ANY ), _direction( 0 ), _valid( true )
 {
-    {
-        cJSON *homeId = cJSON_GetObjectItem( json, "home" );
-        if( homeId && cJSON_IsString( homeId ) ) {
-            strncpy( _homeId, homeId->valuestring, sizeof( _homeId ) - 1 );
-            _homeId[sizeof( _homeId ) - 1] = '\0';
-        } else if( defaultHomeId ) {
-            strncpy( _homeId, defaultHomeId, sizeof( _homeId ) - 1 );
-            _homeId[sizeof( _homeId ) - 1] = '\0';
-        } else {
-            _homeId[0] = '\0';
-        }
-    }
-    {
-        cJSON *zoneId = cJSON_GetObjectItem( json, "zone" );
-        if( zoneId && cJSON_IsString( zoneId ) ) {
-            strncpy( _zoneId, zoneId->valuestring, sizeof( _zoneId ) - 1 );
-            _zoneId[sizeof( _zoneId ) - 1] = '\0';
-        } else if( defaultZoneId ) {
-            strncpy( _zoneId, defaultZoneId, sizeof( _zoneId ) - 1 );
-            _zoneId[sizeof( _zoneId ) - 1] = '\0';
-        } else {
-            _zoneId[0] = '\0';
-        }
-    }
-    {
-        cJSON *deviceId = cJSON_GetObjectItem( json, "device" );
-        if( deviceId && cJSON_IsString( deviceId ) ) {
-            strncpy( _deviceId, deviceId->valuestring, sizeof( _deviceId ) - 1 );
-            _deviceId[sizeof( _deviceId ) - 1] = '\0';
-        } else {
-            _deviceId[0] = '\0';
-        }
-    }
-    {
-        cJSON *type = cJSON_GetObjectItem( json, "type" );
-        if( type && cJSON_IsString( type ) ) {
-            strncpy( _type, type->valuestring, sizeof( _type ) - 1 );
-            _type[sizeof( _type ) - 1] = '\0';
-        } else {
-            _type[0] = '\0';
-        }
-    }
-    {
-        cJSON *direction = cJSON_GetObjectItem( json, "direction" );
-        if( direction && cJSON_IsString( direction ) ) {
-            if( strcmp( direction->valuestring, "increase" ) == 0 ) {
-                _direction = 1;
-            } else if( strcmp( direction->valuestring, "decrease" ) == 0 ) {
-                _direction = -1;
-            }
+}
+
+void DeviceChange::setField( const char *field, const char *value )
+{
+    if( strcmp( field, "home" ) == 0 ) {
+        _valid = _homeId.parseRequired( value ) && _valid;
+    } else if( strcmp( field, "zone" ) == 0 ) {
+        _valid = _zoneId.parseRequired( value ) && _valid;
+    } else if( strcmp( field, "device" ) == 0 ) {
+        _valid = _deviceId.parseRequired( value ) && _valid;
+    } else if( strcmp( field, "type" ) == 0 ) {
+        _type = readingType( value );
+    } else if( strcmp( field, "direction" ) == 0 ) {
+        if( strcmp( value, "increase" ) == 0 ) {
+            _direction = 1;
+        } else if( strcmp( value, "decrease" ) == 0 ) {
+            _direction = -1;
         }
     }
-    ESP_LOGI( TAG, "Created new change for home %s zone %s device %s type %s direction %d", _homeId, _zoneId, _deviceId, _type, _direction );
 }
 
-bool DeviceChange::matches( const char *homeId, const char *zoneId, const char *deviceId, const char *type ) const
+bool DeviceChange::matches( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type ) const
 {
-    ESP_LOGD( TAG, "Checking change %s %s %s %s -> %s %s %s %s", _homeId, _zoneId, _deviceId, _type, homeId, zoneId, deviceId, type );
-    return( strcmp( _homeId, homeId ) == 0 && strcmp( _zoneId, zoneId ) == 0 &&
-            strcmp( _deviceId, deviceId ) == 0 && ( _type[0] == '\0' || strcmp( _type, type ) == 0 ) );
+    return( _deviceId == deviceId && _zoneId == zoneId && _homeId == homeId && readingTypeMatches( _type, type ) );
 }
 
-DeviceCalibration::DeviceCalibration( cJSON *json )
+void DeviceChange::save( SnapshotWriter &writer ) const
 {
-    {
-        cJSON *type = cJSON_GetObjectItem( json, "type" );
-        if( type && cJSON_IsString( type ) ) {
-            strncpy( _type, type->valuestring, sizeof( _type ) - 1 );
-            _type[sizeof( _type ) - 1] = '\0';
-        } else {
-            _type[0] = '\0';
-        }
-    }
-    {
-        cJSON *value = cJSON_GetObjectItem( json, "calibration" );
-        if( value && cJSON_IsObject( value ) ) {
-            cJSON *v = cJSON_GetObjectItem( value, "value" );
-            if( v && cJSON_IsBool( v ) ) {
-                _calibration.value.boolValue = v->valueint != 0;
-            } else if( v && cJSON_IsNumber( v ) ) {
-                _calibration.value.doubleValue = v->valuedouble;
-            } else {
-                _calibration.value.doubleValue = 0;
-            }
-
-            cJSON *u = cJSON_GetObjectItem( value, "unit" );
-            if( u && cJSON_IsString( u ) ) {
-                strncpy( _calibration.unit, u->valuestring, sizeof( _calibration.unit ) - 1 );
-                _calibration.unit[sizeof( _calibration.unit ) - 1] = '\0';
-            } else {
-                _calibration.unit[0] = '\0';
-            }
-        }
-    }
-    {
-        cJSON *value = cJSON_GetObjectItem( json, "threshold" );
-        if( value && cJSON_IsObject( value ) ) {
-            cJSON *v = cJSON_GetObjectItem( value, "value" );
-            if( v && cJSON_IsBool( v ) ) {
-                _threshold.value.boolValue = v->valueint != 0;
-            } else if( v && cJSON_IsNumber( v ) ) {
-                _threshold.value.doubleValue = v->valuedouble;
-            } else {
-                _threshold.value.doubleValue = 0;
-            }
-
-            cJSON *u = cJSON_GetObjectItem( value, "unit" );
-            if( u && cJSON_IsString( u ) ) {
-                strncpy( _calibration.unit, u->valuestring, sizeof( _threshold.unit ) - 1 );
-                _threshold.unit[sizeof( _threshold.unit ) - 1] = '\0';
-            } else {
-                _threshold.unit[0] = '\0';
-            }
-        }
-    }
-    ESP_LOGI( TAG, "Created new calibration for type %s", _type );
+    _homeId.save( writer );
+    _zoneId.save( writer );
+    _deviceId.save( writer );
+    writer.put8( _type );
+    writer.put8( _direction );
+}
+
+void DeviceChange::load( SnapshotReader &reader )
+{
+    _homeId.load( reader );
+    _zoneId.load( reader );
+    _deviceId.load( reader );
+    _type = (ReadingType)reader.get8();
+    _direction = (int8_t)reader.get8();
+}
+
+bool DeviceChange::operator==( const DeviceChange &other ) const
+{
+    return( _deviceId == other._deviceId && _zoneId == other._zoneId && _homeId == other._homeId &&
+            _type == other._type && _direction == other._direction );
+}
+
+DeviceCalibration::DeviceCalibration()
+    : _type( READING_OTHER )
+{
+}
+
+void DeviceCalibration::setType( const char *type )
+{
+    _type = readingType( type );
+}
+
+bool DeviceCalibration::matches( ReadingType type ) const
+{
+    return( _type == type && type != READING_OTHER );
+}
+
+void DeviceCalibration::save( SnapshotWriter &writer ) const
+{
+    writer.put8( _type );
+    _threshold.save( writer );
+    _calibration.save( writer );
+    _deadband.save( writer );
+}
+
+void DeviceCalibration::load( SnapshotReader &reader )
+{
+    _type = (ReadingType)reader.get8();
+    _threshold.load( reader );
+    _calibration.load( reader );
+    _deadband.load( reader );
 }
 
-bool DeviceCalibration::matches( const char *type ) const
+bool DeviceCalibration::operator==( const DeviceCalibration &other ) const
 {
-    ESP_LOGD( TAG, "Checking calibration %s -> %s", _type, type );
-    return( strcmp( _type, type ) == 0 );
+    return( _type == other._type && _threshold == other._threshold &&
+            _calibration == other._calibration && _deadband == other._deadband );
 }
 
 double DeviceCalibration::adjust( double value ) const
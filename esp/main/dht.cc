@@ -7,22 +7,8 @@ static const float DEFAULT_TEMPERATURE_THRESHOLD = 0;
 static const float DEFAULT_HUMIDITY_THRESHOLD = 5;
 static const float DEFAULT_HUMIDEX_THRESHOLD = 0;
 
-static void dhtTask( void *arg )
-{
-    DHTSensor *sensor = (DHTSensor*)arg;
-    uint32_t notifiedValue = ulTaskNotifyTake( pdFALSE, 0 );
-
-    while( !notifiedValue ) {
-        sensor->read();
-        notifiedValue = ulTaskNotifyTake( pdFALSE, sensor->getInterval() / portTICK_RATE_MS );
-    }
-
-    ESP_LOGI( TAG, "DHT task finished\n" );
-    vTaskDelete( NULL );
-}
-
 DHTSensor::DHTSensor( Zone &zone, const char *id )
-    : Device( zone, id ), _pin( (gpio_num_t)-1 ), _interval( 0 ), _task( NULL )
+    : Device( zone, id ), _pin( (gpio_num_t)-1 ), _interval( 0 )
 {
 }
 
@@ -60,19 +46,18 @@ esp_err_t DHTSensor::init( gpio_num_t pin, dht_sensor_type_t type, bool pull_up
 
 void DHTSensor::setInterval( uint32_t interval )
 {
-    ESP_LOGI( TAG, "DHTSensor::setInterval %d (existing task %p)", interval, _task );
+    ESP_LOGI( TAG, "DHTSensor::setInterval %u (was %u)", interval, _interval );
 
-    if( _task != NULL ) {
-        ESP_LOGI( TAG, "Sending notification\n" );
-        xTaskNotifyGive( _task );
-        ESP_LOGI( TAG, "Sent notification\n" );
-        _task = NULL;
+    // readings already scheduled at this interval keep their deadline
+    if( interval == _interval ) {
+        return;
     }
 
     _interval = interval;
     if( _interval > 0 ) {
-        xTaskCreate( &dhtTask, "dhtmonitor", 4096, this, 5, &_task );
-        ESP_LOGI( TAG, "DHTSensor::setInterval %d (created task %p)", interval, _task );
+        getZone().getScheduler().add( this, _interval );
+    } else {
+        getZone().getScheduler().remove( this );
     }
 }
 
@@ -91,29 +76,29 @@ void DHTSensor::read()
     getZone().sendZoneLog( ESP_LOG_INFO, TAG, "DHTSensor::read %s starting", getId() );
     esp_err_t err = dht_read_float_data( _type, _pin, &humidity, &temperature );
     if( !err ) {
-        const DeviceCalibration *calibration = findCalibration( "temperature" );
-        if( calibration ) {
-            temperature = calibration->adjust( temperature );
-            threshold = calibration->doubleThreshold();
+        DeviceCalibration calibration;
+        if( zone.getCalibration( this, READING_TEMPERATURE, calibration ) ) {
+            temperature = calibration.adjust( temperature );
+            threshold = calibration.doubleThreshold();
         } else {
             threshold = DEFAULT_TEMPERATURE_THRESHOLD;
         }
         
         getZone().sendZoneLog( ESP_LOG_INFO, TAG, "DHTSensor::read %s got temperature %0.1f", getId(), temperature );
-        zone.setValue( getId(), "temperature", temperature, "celsius", threshold );
+        zone.setValue( getUuid(), READING_TEMPERATURE, temperature, "celsius", threshold );
     }
 
     if( !err ) {
-        const DeviceCalibration *calibration = findCalibration( "humidity" );
-        if( calibration ) {
-            humidity = calibration->adjust( humidity );
-            threshold = calibration->doubleThreshold();
+        DeviceCalibration calibration;
+        if( zone.getCalibration( this, READING_HUMIDITY, calibration ) ) {
+            humidity = calibration.adjust( humidity );
+            threshold = calibration.doubleThreshold();
         } else {
             threshold = DEFAULT_HUMIDITY_THRESHOLD;
         }
         
         getZone().sendZoneLog( ESP_LOG_INFO, TAG, "DHTSensor::read %s got humidity %0.1f", getId(), humidity );
-        zone.setValue( getId(), "humidity", humidity, "percent", threshold );
+        zone.setValue( getUuid(), READING_HUMIDITY, humidity, "percent", threshold );
     }
 
     if( !err ) {
@@ -126,16 +111,16 @@ void DHTSensor::read()
             humidex = round( ( temperature + ( ( e - 10 ) * 5.0 / 9.0 ) ) * 10.0 ) / 10.0;
         }
         
-        const DeviceCalibration *calibration = findCalibration( "humidex" );
-        if( calibration ) {
-            humidex = calibration->adjust( humidex );
-            threshold = calibration->doubleThreshold();
+        DeviceCalibration calibration;
+        if( zone.getCalibration( this, READING_HUMIDEX, calibration ) ) {
+            humidex = calibration.adjust( humidex );
+            threshold = calibration.doubleThreshold();
         } else {
             threshold = DEFAULT_HUMIDEX_THRESHOLD;
         }
         
         getZone().sendZoneLog( ESP_LOG_INFO, TAG, "DHTSensor::read %s got humidex %0.1f", getId(), humidex );
-        zone.setValue( getId(), "humidex", humidex, "", threshold );
+        zone.setValue( getUuid(), READING_HUMIDEX, humidex, "", threshold );
     } else {
         getZone().sendZoneLog( ESP_LOG_ERROR, TAG, "DHTSensor::read %s got error %d: %s", getId(), err, esp_err_to_name( err ) );
     }
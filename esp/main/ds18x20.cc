@@ -1,30 +1,167 @@
 #include "autohome.h"
+#include <algorithm>
 
 static const char *TAG = "sensor";
 static const float DEFAULT_TEMPERATURE_THRESHOLD = 0.2;
 
-static void dsTask( void *arg )
+static const uint32_t FULL_CONVERSION_TIME = 750;
+
+OneWireBus::OneWireBus( gpio_num_t pin )
+    : _pin( pin ), _lock( xSemaphoreCreateMutex() ), _converting( false ), _started( 0 ), _conversion( 0 ),
+      _generation( 0 )
+{
+}
+
+OneWireBus::~OneWireBus()
+{
+    vSemaphoreDelete( _lock );
+}
+
+void OneWireBus::attach( DS18X20Sensor *sensor )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    if( std::find( _sensors.begin(), _sensors.end(), sensor ) == _sensors.end() ) {
+        _sensors.push_back( sensor );
+    }
+    ESP_LOGI( TAG, "%u DS18X20 sensors on pin %d", (unsigned)_sensors.size(), _pin );
+    xSemaphoreGive( _lock );
+}
+
+void OneWireBus::detach( DS18X20Sensor *sensor )
+{
+    // waits for a conversion in progress, which may report to the sensor
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    _sensors.erase( std::remove( _sensors.begin(), _sensors.end(), sensor ), _sensors.end() );
+    xSemaphoreGive( _lock );
+}
+
+TickType_t OneWireBus::conversionTime() const
+{
+    uint32_t time = 0;
+
+    // all of them convert at once, so the slowest decides
+    for( std::vector<DS18X20Sensor*>::const_iterator sensor = _sensors.cbegin(); sensor != _sensors.cend(); ++sensor ) {
+        uint32_t bits = (*sensor)->hasResolution() ? (*sensor)->getResolution() : 12;
+        uint32_t sensorTime = FULL_CONVERSION_TIME >> ( 12 - bits );
+        if( sensorTime > time ) {
+            time = sensorTime;
+        }
+    }
+
+    return pdMS_TO_TICKS( time ) + 1;
+}
+
+void OneWireBus::abandon()
+{
+    if( _converting ) {
+        ESP_LOGW( TAG, "Abandoned the conversion on pin %d", _pin );
+        onewire_depower( _pin );
+        _converting = false;
+        ++_generation;
+    }
+}
+
+int OneWireBus::scan( ds18x20_addr_t *addrs, int count )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    abandon();
+    int found = ds18x20_scan_devices( _pin, addrs, count );
+    xSemaphoreGive( _lock );
+
+    return found;
+}
+
+esp_err_t OneWireBus::configure( ds18x20_addr_t addr, uint8_t resolution )
+{
+    uint8_t scratchpad[9];
+
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    abandon();
+
+    // the alarm limits are written back as they were
+    esp_err_t err = ds18x20_read_scratchpad( _pin, addr, scratchpad );
+    if( err == ESP_OK ) {
+        uint8_t settings[3] = { scratchpad[2], scratchpad[3], (uint8_t)( ( ( resolution - 9 ) << 5 ) | 0x1f ) };
+        err = ds18x20_write_scratchpad( _pin, addr, settings );
+    }
+    xSemaphoreGive( _lock );
+
+    return err;
+}
+
+esp_err_t OneWireBus::start( TickType_t &wait, uint32_t &conversion )
+{
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    TickType_t now = xTaskGetTickCount();
+
+    if( _converting && now - _started < _conversion ) {
+        // a sensor sharing the pin already started one
+        wait = _conversion - ( now - _started );
+    } else {
+        // one nobody finished is stale by now
+        abandon();
+
+        err = ESP_FAIL;
+        for( int retries = 0; err != ESP_OK && retries < 3; ++retries ) {
+            err = ds18x20_measure( _pin, ds18x20_ANY, false );
+        }
+
+        if( err == ESP_OK ) {
+            // parasite powered sensors draw their power from the line while
+            // they convert
+            onewire_power( _pin );
+            _converting = true;
+            _started = now;
+            _conversion = conversionTime();
+            ++_generation;
+            wait = _conversion;
+        }
+    }
+    conversion = _generation;
+
+    xSemaphoreGive( _lock );
+    return err;
+}
+
+esp_err_t OneWireBus::finish( ds18x20_addr_t addr, uint32_t conversion, float &temperature )
 {
-    DS18X20Sensor *sensor = (DS18X20Sensor*)arg;
-    uint32_t notifiedValue = ulTaskNotifyTake( pdFALSE, 0 );
+    xSemaphoreTake( _lock, portMAX_DELAY );
 
-    while( !notifiedValue ) {
-        sensor->read();
-        notifiedValue = ulTaskNotifyTake( pdFALSE, sensor->getInterval() / portTICK_RATE_MS );
+    // abandoned, or followed by another that may still be converting
+    if( conversion != _generation ) {
+        xSemaphoreGive( _lock );
+        return ESP_ERR_INVALID_STATE;
     }
 
-    ESP_LOGI( TAG, "DS18X20 task finished\n" );
-    vTaskDelete( NULL );
+    // the first sensor to finish ends it for all those that joined it
+    if( _converting ) {
+        onewire_depower( _pin );
+        _converting = false;
+    }
+
+    esp_err_t err = ESP_FAIL;
+    for( int retries = 0; err != ESP_OK && retries < 3; ++retries ) {
+        err = ds18x20_read_temperature( _pin, addr, &temperature );
+    }
+
+    xSemaphoreGive( _lock );
+    return err;
 }
 
 DS18X20Sensor::DS18X20Sensor( Zone &zone, const char *id )
-    : Device( zone, id ), _pin( (gpio_num_t)-1 ), _addr( ds18x20_ANY ), _interval( 0 ), _task( NULL )
+    : Device( zone, id ), _pin( (gpio_num_t)-1 ), _addr( ds18x20_ANY ), _interval( 0 ), _bus( NULL ), _conversion( 0 ),
+      _resolution( 0 ), _configured( false )
 {
 }
 
 DS18X20Sensor::~DS18X20Sensor()
 {
     setInterval( 0 );
+    if( _bus ) {
+        _bus->detach( this );
+    }
 }
  
 esp_err_t DS18X20Sensor::init( gpio_num_t pin, ds18x20_addr_t addr )
@@ -33,16 +170,24 @@ esp_err_t DS18X20Sensor::init( gpio_num_t pin, ds18x20_addr_t addr )
     _addr = addr;
     getZone().sendZoneLog( ESP_LOG_INFO, TAG, "DS18X20Sensor::init %d: %llx", _pin, _addr );
 
+    if( _bus ) {
+        _bus->detach( this );
+        _bus = NULL;
+    }
+    _configured = false;
+
     if( !( BIT( _pin ) & VALID_DEVICE_PIN_MASK ) ) {
         getZone().sendZoneLog( ESP_LOG_ERROR, TAG, "Pin not available for device communication" );
         return ESP_FAIL;
     }
 
+    OneWireBus &bus = getZone().getBus( _pin );
+
     esp_err_t ret = ESP_FAIL;
     if( _addr == ds18x20_ANY ) {
         ds18x20_addr_t addrs[8];
         for( int retries = 0; ret != ESP_OK && retries < 3; ++retries ) { 
-            int count = ds18x20_scan_devices( _pin, addrs, 8 );
+            int count = bus.scan( addrs, 8 );
             if( count < 1 ) {
                 getZone().sendZoneLog( ESP_LOG_ERROR, TAG, "Could not find any DS18X20 sensor on pin %d", _pin );
             } else if( count > 1 ) {
@@ -59,24 +204,28 @@ esp_err_t DS18X20Sensor::init( gpio_num_t pin, ds18x20_addr_t addr )
         ret = ESP_OK;
     }
 
+    if( ret == ESP_OK ) {
+        _bus = &bus;
+        _bus->attach( this );
+    }
+
     return ret;
 }
 
 void DS18X20Sensor::setInterval( uint32_t interval )
 {
-    getZone().sendZoneLog( ESP_LOG_INFO, TAG, "DS18X20Sensor::setInterval %d (existing task %p)", interval, _task );
+    getZone().sendZoneLog( ESP_LOG_INFO, TAG, "DS18X20Sensor::setInterval %u (was %u)", interval, _interval );
 
-    if( _task != NULL ) {
-        getZone().sendZoneLog( ESP_LOG_DEBUG, TAG, "Sending notification" );
-        xTaskNotifyGive( _task );
-        getZone().sendZoneLog( ESP_LOG_DEBUG, TAG, "Sent notification" );
-        _task = NULL;
+    // readings already scheduled at this interval keep their deadline
+    if( interval == _interval ) {
+        return;
     }
 
     _interval = interval;
     if( _interval > 0 ) {
-        xTaskCreate( &dsTask, "dsmonitor", 4096, this, 5, &_task );
-        getZone().sendZoneLog( ESP_LOG_INFO, TAG, "DS18X20Sensor::setInterval %d (created task %p)", interval, _task );
+        getZone().getScheduler().add( this, _interval );
+    } else {
+        getZone().getScheduler().remove( this );
     }
 }
 
@@ -85,30 +234,88 @@ uint32_t DS18X20Sensor::getInterval() const
     return _interval;
 }
 
-void DS18X20Sensor::read()
+bool DS18X20Sensor::hasResolution() const
 {
-    float temperature;
-    float threshold = DEFAULT_TEMPERATURE_THRESHOLD;
-    Zone &zone = getZone();
+    // the DS18S20 always converts at its one resolution
+    uint8_t family = _addr & 0xff;
+    return _resolution != 0 && ( family == 0x28 || family == 0x22 );
+}
+
+void DS18X20Sensor::setResolution( uint8_t resolution )
+{
+    if( resolution != 0 && ( resolution < 9 || resolution > 12 ) ) {
+        getZone().sendZoneLog( ESP_LOG_ERROR, TAG, "DS18X20Sensor %s resolution %d is not 9 to 12 bits", getId(), resolution );
+        resolution = 0;
+    }
+
+    if( resolution == _resolution && _configured ) {
+        return;
+    }
+
+    _resolution = resolution;
+    if( _bus == NULL || !hasResolution() ) {
+        return;
+    }
+
+    esp_err_t err = _bus->configure( _addr, _resolution );
+    if( err == ESP_OK ) {
+        getZone().sendZoneLog( ESP_LOG_INFO, TAG, "DS18X20Sensor %s set to %d bits", getId(), _resolution );
+        _configured = true;
+    } else {
+        getZone().sendZoneLog( ESP_LOG_ERROR, TAG, "DS18X20Sensor %s resolution not set: %s", getId(), esp_err_to_name( err ) );
+    }
+}
+
+TickType_t DS18X20Sensor::startRead()
+{
+    if( _bus == NULL ) {
+        getZone().sendZoneLog( ESP_LOG_ERROR, TAG, "DS18X20Sensor::read %s is not on a bus", getId() );
+        return 0;
+    }
 
     getZone().sendZoneLog( ESP_LOG_INFO, TAG, "DS18X20Sensor::read %s starting", getId() );
+    TickType_t wait = 0;
+    esp_err_t err = _bus->start( wait, _conversion );
+    if( err != ESP_OK ) {
+        failed( err );
+    }
 
-    for( int i = 0; i < 3; ++i ) {
-        esp_err_t err = ds18x20_measure_and_read( _pin, _addr, &temperature );
-        if( !err ) {
-            const DeviceCalibration *calibration = findCalibration( "temperature" );
-            if( calibration ) {
-                calibration->adjust( temperature );
-                threshold = calibration->doubleThreshold();
-            }
-        
-            getZone().sendZoneLog( ESP_LOG_INFO, TAG, "DS18X20Sensor::read %s got value %0.1f", getId(), temperature );
+    return wait;
+}
 
-            zone.setValue( getId(), "temperature", temperature, "celsius", threshold );
-            break;
-        } else {
-            getZone().sendZoneLog( ESP_LOG_ERROR, TAG, "DS18X20Sensor::read %s got error %d: %s", getId(), err, esp_err_to_name( err ) );
-        }
+void DS18X20Sensor::finishRead()
+{
+    float temperature;
+
+    if( _bus == NULL ) {
+        return;
+    }
+
+    // reported once the bus is free again, as the zone may act on it
+    esp_err_t err = _bus->finish( _addr, _conversion, temperature );
+    if( err == ESP_OK ) {
+        sampled( temperature );
+    } else {
+        failed( err );
+    }
+}
+
+void DS18X20Sensor::sampled( float temperature )
+{
+    float threshold = DEFAULT_TEMPERATURE_THRESHOLD;
+
+    DeviceCalibration calibration;
+    if( getZone().getCalibration( this, READING_TEMPERATURE, calibration ) ) {
+        temperature = calibration.adjust( temperature );
+        threshold = calibration.doubleThreshold();
     }
+
+    getZone().sendZoneLog( ESP_LOG_INFO, TAG, "DS18X20Sensor::read %s got value %0.1f", getId(), temperature );
+    getZone().setValue( getUuid(), READING_TEMPERATURE, temperature, "celsius", threshold );
+}
+
+void DS18X20Sensor::failed( esp_err_t err )
+{
+    getZone().sendZoneLog( ESP_LOG_ERROR, TAG, "DS18X20Sensor::read %s got error %d: %s", getId(), err, esp_err_to_name( err ) );
 }
 
@@ -0,0 +1,363 @@
+#include "autohome.h"
+#include <string.h>
+#include <math.h>
+
+PayloadWriter::PayloadWriter( void *buffer, size_t size )
+    : _buffer( (uint8_t*)buffer ), _size( size ), _length( 0 ), _overflow( false )
+{
+}
+
+void PayloadWriter::put( const void *data, size_t len )
+{
+    // keep room for a terminating NUL so text payloads can be logged
+    if( _overflow || _length + len >= _size ) {
+        _overflow = true;
+        return;
+    }
+
+    memcpy( _buffer + _length, data, len );
+    _length += len;
+    _buffer[_length] = '\0';
+}
+
+void PayloadWriter::put( uint8_t c )
+{
+    put( &c, 1 );
+}
+
+JSONWriter::JSONWriter( void *buffer, size_t size )
+    : PayloadWriter( buffer, size ), _depth( 0 ), _first( 0 ), _afterKey( false )
+{
+}
+
+void JSONWriter::separate()
+{
+    if( _afterKey ) {
+        _afterKey = false;
+    } else if( _depth > 0 ) {
+        if( _first & BIT( _depth ) ) {
+            _first &= ~BIT( _depth );
+        } else {
+            put( ',' );
+        }
+    }
+}
+
+void JSONWriter::open( char c )
+{
+    separate();
+    put( c );
+    ++_depth;
+    _first |= BIT( _depth );
+}
+
+void JSONWriter::close( char c )
+{
+    put( c );
+    --_depth;
+}
+
+void JSONWriter::beginObject( size_t members )
+{
+    open( '{' );
+}
+
+void JSONWriter::endObject()
+{
+    close( '}' );
+}
+
+void JSONWriter::beginArray( size_t items )
+{
+    open( '[' );
+}
+
+void JSONWriter::endArray()
+{
+    close( ']' );
+}
+
+void JSONWriter::quote( const char *value )
+{
+    put( '"' );
+    for( const char *c = value; *c; ++c ) {
+        if( *c == '"' || *c == '\\' ) {
+            put( '\\' );
+            put( (uint8_t)*c );
+        } else if( (uint8_t)*c < 0x20 ) {
+            char escaped[8];
+            snprintf( escaped, sizeof( escaped ), "\\u%04x", (unsigned)(uint8_t)*c );
+            put( escaped, 6 );
+        } else {
+            put( (uint8_t)*c );
+        }
+    }
+    put( '"' );
+}
+
+void JSONWriter::key( const char *name )
+{
+    separate();
+    quote( name );
+    put( ':' );
+    _afterKey = true;
+}
+
+void JSONWriter::string( const char *value )
+{
+    separate();
+    quote( value );
+}
+
+void JSONWriter::number( double value )
+{
+    char buf[32];
+    separate();
+
+    if( isnan( value ) || isinf( value ) ) {
+        put( "null", 4 );
+    } else {
+        int len = snprintf( buf, sizeof( buf ), "%.15g", value );
+        put( buf, len );
+    }
+}
+
+void JSONWriter::boolean( bool value )
+{
+    separate();
+    if( value ) {
+        put( "true", 4 );
+    } else {
+        put( "false", 5 );
+    }
+}
+
+void JSONWriter::timestamp( time_t time )
+{
+    struct tm gmtime;
+    char buf[ sizeof( "2011-10-08T07:07:09Z" ) ];
+
+    strftime( buf, sizeof( buf ), "%FT%TZ", gmtime_r( &time, &gmtime ) );
+    string( buf );
+}
+
+CBORWriter::CBORWriter( void *buffer, size_t size )
+    : PayloadWriter( buffer, size )
+{
+}
+
+void CBORWriter::header( uint8_t major, uint64_t arg )
+{
+    uint8_t bytes[9];
+    major <<= 5;
+
+    if( arg < 24 ) {
+        put( major | (uint8_t)arg );
+    } else if( arg <= 0xff ) {
+        bytes[0] = major | 24;
+        bytes[1] = (uint8_t)arg;
+        put( bytes, 2 );
+    } else if( arg <= 0xffff ) {
+        bytes[0] = major | 25;
+        bytes[1] = (uint8_t)( arg >> 8 );
+        bytes[2] = (uint8_t)arg;
+        put( bytes, 3 );
+    } else if( arg <= 0xffffffffull ) {
+        bytes[0] = major | 26;
+        for( int i = 0; i < 4; ++i ) {
+            bytes[1 + i] = (uint8_t)( arg >> ( 24 - 8 * i ) );
+        }
+        put( bytes, 5 );
+    } else {
+        bytes[0] = major | 27;
+        for( int i = 0; i < 8; ++i ) {
+            bytes[1 + i] = (uint8_t)( arg >> ( 56 - 8 * i ) );
+        }
+        put( bytes, 9 );
+    }
+}
+
+void CBORWriter::beginObject( size_t members )
+{
+    header( 5, members );
+}
+
+void CBORWriter::endObject()
+{
+}
+
+void CBORWriter::beginArray( size_t items )
+{
+    header( 4, items );
+}
+
+void CBORWriter::endArray()
+{
+}
+
+void CBORWriter::key( const char *name )
+{
+    string( name );
+}
+
+void CBORWriter::string( const char *value )
+{
+    size_t len = strlen( value );
+    header( 3, len );
+    put( value, len );
+}
+
+void CBORWriter::number( double value )
+{
+    uint8_t bytes[9];
+
+    // integers go out in their shortest form, everything else as a float
+    // when that is exact and a double otherwise
+    if( value == floor( value ) && fabs( value ) < 9007199254740992.0 ) {
+        if( value >= 0 ) {
+            header( 0, (uint64_t)value );
+        } else {
+            header( 1, (uint64_t)( -1 - value ) );
+        }
+    } else if( (double)(float)value == value ) {
+        float f = (float)value;
+        uint32_t bits;
+        memcpy( &bits, &f, sizeof( bits ) );
+        bytes[0] = 0xfa;
+        for( int i = 0; i < 4; ++i ) {
+            bytes[1 + i] = (uint8_t)( bits >> ( 24 - 8 * i ) );
+        }
+        put( bytes, 5 );
+    } else {
+        uint64_t bits;
+        memcpy( &bits, &value, sizeof( bits ) );
+        bytes[0] = 0xfb;
+        for( int i = 0; i < 8; ++i ) {
+            bytes[1 + i] = (uint8_t)( bits >> ( 56 - 8 * i ) );
+        }
+        put( bytes, 9 );
+    }
+}
+
+void CBORWriter::boolean( bool value )
+{
+    put( value ? 0xf5 : 0xf4 );
+}
+
+void CBORWriter::timestamp( time_t time )
+{
+    // tag 1: epoch-based date/time
+    header( 6, 1 );
+    number( (double)time );
+}
+
+Reading::Reading()
+    : time( 0 ), hasTarget( false ), hasThreshold( false )
+{
+}
+
+size_t Reading::members() const
+{
+    return 2 + ( hasTarget ? 1 : 0 ) + ( hasThreshold ? 1 : 0 );
+}
+
+void Reading::encodeMembers( PayloadWriter &writer ) const
+{
+    writer.key( "time" );
+    writer.timestamp( time );
+
+    writer.key( "value" );
+    writer.beginObject( 2 );
+    writer.key( "value" );
+    writer.number( value.value.doubleValue );
+    writer.key( "unit" );
+    writer.string( value.unit );
+    writer.endObject();
+
+    if( hasTarget ) {
+        writer.key( "target" );
+        writer.beginObject( 2 );
+        writer.key( "value" );
+        writer.number( target.value.doubleValue );
+        writer.key( "unit" );
+        writer.string( target.unit );
+        writer.endObject();
+    }
+
+    if( hasThreshold ) {
+        writer.key( "threshold" );
+        writer.beginObject( 2 );
+        writer.key( "value" );
+        writer.number( threshold.value.doubleValue );
+        writer.key( "unit" );
+        writer.string( threshold.unit );
+        writer.endObject();
+    }
+}
+
+void Reading::encode( PayloadWriter &writer ) const
+{
+    writer.beginObject( members() );
+    encodeMembers( writer );
+    writer.endObject();
+}
+
+ReadingFrame::ReadingFrame()
+    : _count( 0 )
+{
+}
+
+bool ReadingFrame::add( const Uuid &deviceId, ReadingType type, const Reading &reading )
+{
+    Entry *entry = NULL;
+
+    // a newer reading of the same device and type supersedes the queued one
+    for( size_t i = 0; i < _count && entry == NULL; ++i ) {
+        if( _entries[i].type == type && _entries[i].deviceId == deviceId ) {
+            entry = &_entries[i];
+        }
+    }
+
+    if( entry == NULL ) {
+        if( full() ) {
+            return false;
+        }
+
+        entry = &_entries[_count++];
+        entry->deviceId = deviceId;
+        entry->type = type;
+    }
+
+    entry->reading = reading;
+    return true;
+}
+
+size_t ReadingFrame::encode( PayloadEncoding encoding, size_t size, size_t first, size_t count )
+{
+    time_t now;
+    char deviceId[Uuid::LENGTH + 1];
+    JSONWriter json( _payload, size < sizeof( _payload ) ? size : sizeof( _payload ) );
+    CBORWriter cbor( _payload, size < sizeof( _payload ) ? size : sizeof( _payload ) );
+    PayloadWriter &writer = encoding == ENCODING_CBOR ? (PayloadWriter&)cbor : (PayloadWriter&)json;
+
+    time( &now );
+
+    writer.beginObject( 2 );
+    writer.key( "time" );
+    writer.timestamp( now );
+    writer.key( "readings" );
+    writer.beginArray( count );
+    for( size_t i = first; i < first + count && i < _count; ++i ) {
+        writer.beginObject( 2 + _entries[i].reading.members() );
+        writer.key( "device" );
+        writer.string( _entries[i].deviceId.format( deviceId ) );
+        writer.key( "type" );
+        writer.string( readingTypeName( _entries[i].type ) );
+        _entries[i].reading.encodeMembers( writer );
+        writer.endObject();
+    }
+    writer.endArray();
+    writer.endObject();
+
+    return writer.overflowed() ? 0 : writer.length();
+}
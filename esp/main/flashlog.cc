@@ -0,0 +1,435 @@
+#include "flashlog.h"
+#include <string.h>
+
+static const uint32_t SECTOR_MAGIC = 0x4c4f4841;
+static const uint16_t FREE_RECORD = 0xffff;
+
+// bits are cleared, never set, as a record moves through its states
+static const uint8_t RECORD_UNCOMMITTED = 0x01;
+static const uint8_t RECORD_UNCONSUMED = 0x02;
+
+struct SectorHeader
+{
+    uint32_t magic;
+    uint32_t sequence;
+};
+
+struct RecordHeader
+{
+    uint16_t length;
+    uint8_t flags;
+    uint8_t reserved;
+};
+
+static size_t recordSize( size_t len )
+{
+    // flash is written a word at a time
+    return ( sizeof( RecordHeader ) + len + 3 ) & ~(size_t)3;
+}
+
+FileStorage::FileStorage()
+    : _file( NULL ), _size( 0 ), _sectorSize( 0 )
+{
+}
+
+FileStorage::~FileStorage()
+{
+    close();
+}
+
+bool FileStorage::open( const char *path, size_t size, size_t sectorSize )
+{
+    uint8_t erased[64];
+
+    close();
+
+    _file = fopen( path, "r+b" );
+    if( _file == NULL ) {
+        _file = fopen( path, "w+b" );
+    }
+    if( _file == NULL ) {
+        return false;
+    }
+
+    _size = size - size % sectorSize;
+    _sectorSize = sectorSize;
+
+    // anything past the end of an existing file reads as erased flash
+    fseek( _file, 0, SEEK_END );
+    size_t length = (size_t)ftell( _file );
+    memset( erased, 0xff, sizeof( erased ) );
+    while( length < _size ) {
+        size_t chunk = _size - length < sizeof( erased ) ? _size - length : sizeof( erased );
+        fwrite( erased, 1, chunk, _file );
+        length += chunk;
+    }
+    fflush( _file );
+
+    return true;
+}
+
+void FileStorage::close()
+{
+    if( _file != NULL ) {
+        fclose( _file );
+        _file = NULL;
+    }
+}
+
+bool FileStorage::read( size_t offset, void *data, size_t len )
+{
+    if( _file == NULL || offset + len > _size ) {
+        return false;
+    }
+
+    fseek( _file, (long)offset, SEEK_SET );
+    return fread( data, 1, len, _file ) == len;
+}
+
+bool FileStorage::write( size_t offset, const void *data, size_t len )
+{
+    uint8_t current[64];
+    const uint8_t *bytes = (const uint8_t*)data;
+
+    if( _file == NULL || offset + len > _size ) {
+        return false;
+    }
+
+    while( len > 0 ) {
+        size_t chunk = len < sizeof( current ) ? len : sizeof( current );
+
+        if( !read( offset, current, chunk ) ) {
+            return false;
+        }
+        for( size_t i = 0; i < chunk; ++i ) {
+            current[i] &= bytes[i];
+        }
+
+        fseek( _file, (long)offset, SEEK_SET );
+        if( fwrite( current, 1, chunk, _file ) != chunk ) {
+            return false;
+        }
+
+        offset += chunk;
+        bytes += chunk;
+        len -= chunk;
+    }
+
+    return fflush( _file ) == 0;
+}
+
+bool FileStorage::erase( size_t offset, size_t len )
+{
+    uint8_t erased[64];
+
+    if( _file == NULL || offset % _sectorSize != 0 || len % _sectorSize != 0 || offset + len > _size ) {
+        return false;
+    }
+
+    memset( erased, 0xff, sizeof( erased ) );
+    fseek( _file, (long)offset, SEEK_SET );
+    for( size_t done = 0; done < len; done += sizeof( erased ) ) {
+        size_t chunk = len - done < sizeof( erased ) ? len - done : sizeof( erased );
+        if( fwrite( erased, 1, chunk, _file ) != chunk ) {
+            return false;
+        }
+    }
+
+    return fflush( _file ) == 0;
+}
+
+FlashRingLog::FlashRingLog( LogStorage &storage )
+    : _storage( storage ), _sectors( 0 ), _sectorSize( 0 ), _sequence( 0 ), _head( 0 ), _headOffset( 0 ),
+      _tail( 0 ), _tailOffset( 0 ), _peeked( false ), _peekSector( 0 ), _peekOffset( 0 ), _dropped( 0 ),
+      _mounted( false )
+{
+}
+
+bool FlashRingLog::readSector( size_t sector, uint32_t &sequence )
+{
+    SectorHeader header;
+
+    if( !_storage.read( address( sector, 0 ), &header, sizeof( header ) ) || header.magic != SECTOR_MAGIC ) {
+        return false;
+    }
+
+    sequence = header.sequence;
+    return true;
+}
+
+bool FlashRingLog::startSector( size_t sector )
+{
+    SectorHeader header;
+
+    if( !_storage.erase( address( sector, 0 ), _sectorSize ) ) {
+        return false;
+    }
+
+    header.magic = SECTOR_MAGIC;
+    header.sequence = ++_sequence;
+    return _storage.write( address( sector, 0 ), &header, sizeof( header ) );
+}
+
+bool FlashRingLog::format()
+{
+    _mounted = false;
+    _sectorSize = _storage.sectorSize();
+    _sectors = _sectorSize ? _storage.size() / _sectorSize : 0;
+    if( _sectors < 2 ) {
+        return false;
+    }
+
+    for( size_t sector = 0; sector < _sectors; ++sector ) {
+        if( !_storage.erase( address( sector, 0 ), _sectorSize ) ) {
+            return false;
+        }
+    }
+
+    _sequence = 0;
+    if( !startSector( 0 ) ) {
+        return false;
+    }
+
+    _head = _tail = 0;
+    _headOffset = _tailOffset = sizeof( SectorHeader );
+    _peeked = false;
+    _mounted = true;
+    return true;
+}
+
+bool FlashRingLog::mount()
+{
+    uint32_t sequence;
+    bool found = false;
+
+    _mounted = false;
+    _sectorSize = _storage.sectorSize();
+    _sectors = _sectorSize ? _storage.size() / _sectorSize : 0;
+    if( _sectors < 2 ) {
+        return false;
+    }
+
+    // the newest sector is the one being written
+    for( size_t sector = 0; sector < _sectors; ++sector ) {
+        if( readSector( sector, sequence ) && ( !found || (int32_t)( sequence - _sequence ) > 0 ) ) {
+            _sequence = sequence;
+            _head = sector;
+            found = true;
+        }
+    }
+
+    if( !found ) {
+        return format();
+    }
+
+    _headOffset = sizeof( SectorHeader );
+    while( _headOffset + sizeof( RecordHeader ) <= _sectorSize ) {
+        RecordHeader header;
+        if( !_storage.read( address( _head, _headOffset ), &header, sizeof( header ) ) ) {
+            return false;
+        }
+
+        if( header.length == FREE_RECORD ) {
+            break;
+        }
+        if( recordSize( header.length ) > _sectorSize - _headOffset ) {
+            // garbage; leave the rest of the sector alone
+            _headOffset = _sectorSize;
+            break;
+        }
+        _headOffset += recordSize( header.length );
+    }
+
+    // sectors are filled in order, so the oldest follows the newest
+    _tail = _head;
+    for( size_t step = 1; step < _sectors; ++step ) {
+        size_t sector = ( _head + step ) % _sectors;
+        if( readSector( sector, sequence ) ) {
+            _tail = sector;
+            break;
+        }
+    }
+    _tailOffset = sizeof( SectorHeader );
+    _peeked = false;
+
+    _mounted = true;
+    return true;
+}
+
+bool FlashRingLog::clearFlags( size_t sector, size_t offset, uint8_t flags )
+{
+    RecordHeader header;
+
+    if( !_storage.read( address( sector, offset ), &header, sizeof( header ) ) ) {
+        return false;
+    }
+
+    header.flags &= ~flags;
+    return _storage.write( address( sector, offset ), &header, sizeof( header ) );
+}
+
+void FlashRingLog::dropSector( size_t sector )
+{
+    size_t offset = sector == _tail ? _tailOffset : sizeof( SectorHeader );
+
+    while( offset + sizeof( RecordHeader ) <= _sectorSize ) {
+        RecordHeader header;
+        if( !_storage.read( address( sector, offset ), &header, sizeof( header ) ) ||
+            header.length == FREE_RECORD || recordSize( header.length ) > _sectorSize - offset ) {
+            break;
+        }
+
+        if( !( header.flags & RECORD_UNCOMMITTED ) && ( header.flags & RECORD_UNCONSUMED ) ) {
+            ++_dropped;
+        }
+        offset += recordSize( header.length );
+    }
+
+    _tail = ( sector + 1 ) % _sectors;
+    _tailOffset = sizeof( SectorHeader );
+}
+
+bool FlashRingLog::advanceHead()
+{
+    size_t next = ( _head + 1 ) % _sectors;
+
+    if( next == _tail ) {
+        dropSector( next );
+    }
+    if( _peeked && _peekSector == next ) {
+        _peeked = false;
+    }
+
+    if( !startSector( next ) ) {
+        return false;
+    }
+
+    _head = next;
+    _headOffset = sizeof( SectorHeader );
+    return true;
+}
+
+bool FlashRingLog::append( const void *data, size_t len )
+{
+    RecordHeader header;
+    uint8_t tail[4];
+    size_t whole = len & ~(size_t)3;
+    size_t size = recordSize( len );
+
+    if( !_mounted || len == 0 || len > MAX_RECORD || size > _sectorSize - sizeof( SectorHeader ) ) {
+        return false;
+    }
+
+    if( _headOffset + size > _sectorSize && !advanceHead() ) {
+        return false;
+    }
+
+    size_t offset = _headOffset;
+    // whatever happens, the space is used; a torn record stays uncommitted
+    _headOffset += size;
+
+    header.length = (uint16_t)len;
+    header.flags = 0xff;
+    header.reserved = 0xff;
+    if( !_storage.write( address( _head, offset ), &header, sizeof( header ) ) ) {
+        return false;
+    }
+
+    if( whole > 0 && !_storage.write( address( _head, offset + sizeof( header ) ), data, whole ) ) {
+        return false;
+    }
+    if( whole < len ) {
+        memset( tail, 0xff, sizeof( tail ) );
+        memcpy( tail, (const uint8_t*)data + whole, len - whole );
+        if( !_storage.write( address( _head, offset + sizeof( header ) + whole ), tail, sizeof( tail ) ) ) {
+            return false;
+        }
+    }
+
+    return clearFlags( _head, offset, RECORD_UNCOMMITTED );
+}
+
+bool FlashRingLog::seek( uint16_t &length )
+{
+    while( _mounted ) {
+        RecordHeader header;
+
+        if( _tail == _head && _tailOffset >= _headOffset ) {
+            return false;
+        }
+
+        if( _tailOffset + sizeof( RecordHeader ) > _sectorSize ||
+            !_storage.read( address( _tail, _tailOffset ), &header, sizeof( header ) ) ||
+            header.length == FREE_RECORD || recordSize( header.length ) > _sectorSize - _tailOffset ) {
+            // end of this sector
+            if( _tail == _head ) {
+                _tailOffset = _headOffset;
+                return false;
+            }
+            _tail = ( _tail + 1 ) % _sectors;
+            _tailOffset = sizeof( SectorHeader );
+            continue;
+        }
+
+        if( ( header.flags & RECORD_UNCOMMITTED ) || !( header.flags & RECORD_UNCONSUMED ) ) {
+            _tailOffset += recordSize( header.length );
+            continue;
+        }
+
+        length = header.length;
+        return true;
+    }
+
+    return false;
+}
+
+bool FlashRingLog::empty()
+{
+    uint16_t length;
+    return !seek( length );
+}
+
+int FlashRingLog::peek( void *data, size_t size )
+{
+    uint16_t length;
+
+    while( seek( length ) ) {
+        if( length > size ) {
+            // can never be delivered through this buffer
+            ++_dropped;
+            clearFlags( _tail, _tailOffset, RECORD_UNCONSUMED );
+            _tailOffset += recordSize( length );
+            continue;
+        }
+
+        if( !_storage.read( address( _tail, _tailOffset + sizeof( RecordHeader ) ), data, length ) ) {
+            return -1;
+        }
+
+        _peeked = true;
+        _peekSector = _tail;
+        _peekOffset = _tailOffset;
+        return length;
+    }
+
+    return -1;
+}
+
+bool FlashRingLog::consume()
+{
+    RecordHeader header;
+
+    // the ring may have moved past the record since it was peeked
+    if( !_peeked || _peekSector != _tail || _peekOffset != _tailOffset ) {
+        _peeked = false;
+        return false;
+    }
+    _peeked = false;
+
+    if( !_storage.read( address( _tail, _tailOffset ), &header, sizeof( header ) ) ) {
+        return false;
+    }
+
+    _tailOffset += recordSize( header.length );
+    return clearFlags( _peekSector, _peekOffset, RECORD_UNCONSUMED );
+}
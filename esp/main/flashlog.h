@@ -0,0 +1,97 @@
+#ifndef __FLASHLOG_H__
+#define __FLASHLOG_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Kept free of ESP-IDF headers so the log can be exercised on a host
+// against a FileStorage.
+
+// A region of NOR flash: erasing sets a whole sector to 0xff, writing can
+// only clear bits.
+class LogStorage
+{
+public:
+    virtual ~LogStorage() {}
+
+    virtual size_t size() const = 0;
+    virtual size_t sectorSize() const = 0;
+    virtual bool read( size_t offset, void *data, size_t len ) = 0;
+    virtual bool write( size_t offset, const void *data, size_t len ) = 0;
+    virtual bool erase( size_t offset, size_t len ) = 0;
+};
+
+// Stands in for a flash partition on a host, with the same write semantics.
+class FileStorage : public LogStorage
+{
+    FILE *_file;
+    size_t _size;
+    size_t _sectorSize;
+
+public:
+    FileStorage();
+    ~FileStorage();
+
+    bool open( const char *path, size_t size, size_t sectorSize = 4096 );
+    void close();
+
+    size_t size() const { return _size; }
+    size_t sectorSize() const { return _sectorSize; }
+    bool read( size_t offset, void *data, size_t len );
+    bool write( size_t offset, const void *data, size_t len );
+    bool erase( size_t offset, size_t len );
+};
+
+// Append-only ring of records over whole sectors. Sectors are filled in
+// order and a sector is only erased when the ring comes back around to it,
+// so every sector wears at the same rate. Records are marked committed once
+// fully written and consumed once delivered by clearing bits in place,
+// which keeps the read position across restarts without a separate index.
+// When the ring is full the oldest sector is dropped.
+class FlashRingLog
+{
+    LogStorage &_storage;
+    size_t _sectors;
+    size_t _sectorSize;
+    uint32_t _sequence;
+    size_t _head;
+    size_t _headOffset;
+    size_t _tail;
+    size_t _tailOffset;
+    bool _peeked;
+    size_t _peekSector;
+    size_t _peekOffset;
+    uint32_t _dropped;
+    bool _mounted;
+
+    size_t address( size_t sector, size_t offset ) const { return sector * _sectorSize + offset; }
+    bool readSector( size_t sector, uint32_t &sequence );
+    bool startSector( size_t sector );
+    bool advanceHead();
+    void dropSector( size_t sector );
+    bool clearFlags( size_t sector, size_t offset, uint8_t flags );
+    bool seek( uint16_t &length );
+
+public:
+    static const size_t MAX_RECORD = 1024;
+
+    FlashRingLog( LogStorage &storage );
+
+    // finds the write and read positions, formatting storage that holds no log
+    bool mount();
+    bool format();
+    bool mounted() const { return _mounted; }
+
+    bool append( const void *data, size_t len );
+    bool empty();
+
+    // copies out the oldest undelivered record; returns its length, or -1
+    int peek( void *data, size_t size );
+    // marks the record returned by the last peek as delivered
+    bool consume();
+
+    uint32_t dropped() const { return _dropped; }
+};
+
+#endif
@@ -28,6 +28,9 @@ void app_main()
     flasher.init();
     flasher.setPattern( 500, 500 );
 
+    // back to work with the last config before waiting for the network
+    mqttClient.restore();
+
     network.init();
     network.connect( CONFIG_ESP_WIFI_SSID, CONFIG_ESP_WIFI_PASSWORD, CONFIG_ESP_MAXIMUM_RETRY );
 
@@ -11,8 +11,10 @@ static void event_handler( void* arg, esp_event_base_t event_base, int32_t event
 }
 
 MQTTData::MQTTData()
-    : topic( NULL ), data( NULL ), data_len( 0 )
+    : active( false ), msg_id( 0 ), sequence( 0 ), wanted( false ), data_len( 0 ), total_data_len( 0 ),
+      json( decoder ), cbor( decoder ), stream( &json )
 {
+    topicBuffer[0] = '\0';
 }
 
 MQTTData::~MQTTData()
@@ -22,32 +24,105 @@ MQTTData::~MQTTData()
 
 void MQTTData::reset()
 {
-    if( topic ) {
-        free( topic );
-        topic = NULL;
-    }
+    active = false;
+    topicBuffer[0] = '\0';
+    topic = MQTTTopic();
+    wanted = false;
+    data_len = 0;
+    total_data_len = 0;
+    decoder.reset( topic );
+    json.reset();
+    cbor.reset();
+    stream = &json;
+}
 
-    if( data ) {
-        free( data );
-        data = NULL;
+void MQTTData::begin( esp_mqtt_event_handle_t event )
+{
+    reset();
+    active = true;
+    msg_id = event->msg_id;
+    total_data_len = event->total_data_len;
+
+    // a topic that does not fit can not be one of ours
+    if( event->topic_len < (int)sizeof( topicBuffer ) ) {
+        memcpy( topicBuffer, event->topic, event->topic_len );
+        topicBuffer[event->topic_len] = '\0';
+        topic = MQTTTopic( topicBuffer );
     }
+    decoder.reset( topic );
 
-    data_len = 0;
+    // a CBOR payload starts with a map header, which is never valid JSON
+    if( event->data_len > 0 && ( (uint8_t)event->data[0] >> 5 ) == 5 ) {
+        stream = &cbor;
+    }
 }
 
 void MQTTData::append( esp_mqtt_event_handle_t event )
 {
-    if( !data ) {
-        topic = strndup( event->topic, event->topic_len );
-        data = (char *)malloc( event->total_data_len );
-        data_len = 0;
+    // the payload is decoded as it arrives and never held in full
+    if( wanted && !stream->failed() ) {
+        stream->feed( event->data, event->data_len );
     }
-    memcpy( data + data_len, event->data, event->data_len );
     data_len += event->data_len;
 }
 
+MQTTDataPool::MQTTDataPool()
+    : _sequence( 0 )
+{
+}
+
+MQTTData *MQTTDataPool::acquire( esp_mqtt_event_handle_t event )
+{
+    MQTTData *slot = NULL;
+
+    for( int i = 0; i < CONFIG_AUTOHOME_MQTT_INFLIGHT; ++i ) {
+        if( !_slots[i].active ) {
+            slot = &_slots[i];
+            break;
+        }
+
+        if( slot == NULL || _slots[i].sequence < slot->sequence ) {
+            slot = &_slots[i];
+        }
+    }
+
+    if( slot->active ) {
+        ESP_LOGW( TAG, "No free message slot, abandoning message %d", slot->msg_id );
+    }
+
+    slot->begin( event );
+    slot->sequence = ++_sequence;
+    return slot;
+}
+
+MQTTData *MQTTDataPool::find( esp_mqtt_event_handle_t event )
+{
+    for( int i = 0; i < CONFIG_AUTOHOME_MQTT_INFLIGHT; ++i ) {
+        MQTTData &slot = _slots[i];
+        if( slot.active && slot.msg_id == event->msg_id &&
+            slot.data_len == (size_t)event->current_data_offset &&
+            slot.total_data_len == (size_t)event->total_data_len ) {
+            return &slot;
+        }
+    }
+
+    return NULL;
+}
+
+void MQTTDataPool::release( MQTTData *data )
+{
+    data->reset();
+}
+
+void MQTTDataPool::clear()
+{
+    for( int i = 0; i < CONFIG_AUTOHOME_MQTT_INFLIGHT; ++i ) {
+        _slots[i].reset();
+    }
+}
+
 MQTTClient::MQTTClient( Network &network )
-    : _network( network ), _client( NULL )
+    : _network( network ), _client( NULL ), _connected( false )
 {
 }
 
@@ -58,48 +133,217 @@ MQTTClient::~MQTTClient()
         esp_mqtt_client_stop( _client );
         esp_mqtt_client_destroy( _client );
     }
+
+    for( ZoneList::iterator zone = _zones.begin(); zone != _zones.end(); ++zone ) {
+        delete *zone;
+    }
+    for( std::vector<OneWireBus*>::iterator bus = _buses.begin(); bus != _buses.end(); ++bus ) {
+        delete *bus;
+    }
+}
+
+OneWireBus &MQTTClient::getBus( gpio_num_t pin )
+{
+    std::vector<OneWireBus*>::iterator it = std::find_if(
+        _buses.begin(), _buses.end(),
+        [pin](const OneWireBus *bus) {
+            return bus->getPin() == pin;
+        });
+
+    if( it != _buses.end() ) {
+        return **it;
+    }
+
+    // there are only so many pins, so a bus is kept once it is used
+    _buses.push_back( new OneWireBus( pin ) );
+    return *_buses.back();
 }
 
 void MQTTClient::addZone( const char *homeId, const char *zoneId )
 {
+    Uuid home;
+    Uuid zoneUuid;
+
+    // a zone whose ids are not UUIDs would alias any other such zone
+    if( !home.parseRequired( homeId ) || !zoneUuid.parseRequired( zoneId ) ) {
+        ESP_LOGW( TAG, "Refusing zone %s/%s, its ids are not UUIDs", homeId, zoneId );
+        return;
+    }
+
     ZoneList::iterator it = std::find_if(
         _zones.begin(), _zones.end(),
-        [homeId, zoneId](const Zone &zone) {
-            return zone.matches( (const char*)homeId, (const char*)zoneId );
+        [&home, &zoneUuid](const Zone *zone) {
+            return zone->matches( home, zoneUuid );
         });
 
     if( it == _zones.end() ) {
-        _zones.emplace_front( *this, homeId, zoneId );
+        Zone *zone = new Zone( *this, homeId, zoneId );
+        _zones.push_back( zone );
+        zone->setEncoding( getEncoding( homeId ) );
+        _router.addZone( zone );
 
-        char subscription[128];
-        snprintf( subscription, sizeof( subscription ), "homes/%s/zones/%s/devices/+/config", homeId, zoneId );
-        int msg_id = esp_mqtt_client_subscribe( _client, subscription, 1 );
-        ESP_LOGI( TAG, "sent subscribe successful, msg_id=%d", msg_id );
+        if( _connected ) {
+            subscribeZone( *zone );
+        }
     }
 }
 
 void MQTTClient::removeZone( const char *homeId, const char *zoneId )
 {
+    Uuid home( homeId );
+    Uuid zoneUuid( zoneId );
+
     ZoneList::iterator it = std::find_if(
         _zones.begin(), _zones.end(),
-        [homeId, zoneId](const Zone &zone) {
-            return zone.matches( (const char*)homeId, (const char*)zoneId );
+        [&home, &zoneUuid](const Zone *zone) {
+            return zone->matches( home, zoneUuid );
         });
 
     if( it != _zones.end() ) {
+        _router.removeZone( home, zoneUuid );
+        _snapshot.removeZone( home, zoneUuid );
+        delete *it;
         _zones.erase( it );
+        updateRoutes();
 
-        char subscription[128];
-        snprintf( subscription, sizeof( subscription ), "homes/%s/zones/%s/devices/config", homeId, zoneId );
-        int msg_id = esp_mqtt_client_unsubscribe( _client, subscription );
-        ESP_LOGI( TAG, "sent subscribe successful, msg_id=%d", msg_id );
+        if( _connected ) {
+            char subscription[128];
+            snprintf( subscription, sizeof( subscription ), "homes/%s/zones/%s/devices/+/config", homeId, zoneId );
+            int msg_id = esp_mqtt_client_unsubscribe( _client, subscription );
+            ESP_LOGI( TAG, "sent unsubscribe from %s, msg_id=%d", subscription, msg_id );
+        }
     }
 }
 
-void MQTTClient::publish( const char *topic, const char *message, int qos, bool retain )
+void MQTTClient::subscribeZone( const Zone &zone )
 {
-    ESP_LOGI( TAG, "publish to %s => %s", topic, message );
-    esp_mqtt_client_publish( _client, topic, message, 0, qos, retain ? 1 : 0 );
+    char subscription[128];
+    snprintf( subscription, sizeof( subscription ), "homes/%s/zones/%s/devices/+/config", zone.getHomeId(), zone.getZoneId() );
+    int msg_id = esp_mqtt_client_subscribe( _client, subscription, 1 );
+    ESP_LOGI( TAG, "sent subscribe to %s, msg_id=%d", subscription, msg_id );
+}
+
+void MQTTClient::restore()
+{
+    _snapshot.restore( *this );
+}
+
+Zone *MQTTClient::getZone( const char *homeId, const char *zoneId ) const
+{
+    return _router.findZone( Uuid( homeId ), Uuid( zoneId ) );
+}
+
+void MQTTClient::updateRoutes()
+{
+    _router.rebuildConsumers( _zones );
+    updateSubscriptions();
+}
+
+void MQTTClient::updateSubscriptions()
+{
+    char topic[160];
+    char homeId[Uuid::LENGTH + 1];
+    char zoneId[Uuid::LENGTH + 1];
+    char deviceId[Uuid::LENGTH + 1];
+    int msg_id;
+
+    for( SubscriptionList::iterator it = _subscriptions.begin(); it != _subscriptions.end(); ++it ) {
+        it->wanted = false;
+    }
+
+    // only the remote devices our device changes refer to are of interest;
+    // a zone's own readings are handled before they are published
+    for( ZoneList::const_iterator zone = _zones.cbegin(); zone != _zones.cend(); ++zone ) {
+        const DeviceList &devices = (*zone)->getDevices();
+        for( DeviceList::const_iterator device = devices.cbegin(); device != devices.cend(); ++device ) {
+            const DeviceChangeList &changes = (*device)->getChanges();
+            for( DeviceChangeList::const_iterator change = changes.cbegin(); change != changes.cend(); ++change ) {
+                if( (*zone)->matches( change->getHomeId(), change->getZoneId() ) ) {
+                    continue;
+                }
+
+                snprintf( topic, sizeof( topic ), "homes/%s/zones/%s/devices/%s/+", change->getHomeId().format( homeId ),
+                          change->getZoneId().format( zoneId ), change->getDeviceId().format( deviceId ) );
+
+                SubscriptionList::iterator it = std::find_if(
+                    _subscriptions.begin(), _subscriptions.end(),
+                    [&topic](const Subscription &subscription) {
+                        return strcmp( subscription.topic, topic ) == 0;
+                    });
+
+                if( it == _subscriptions.end() ) {
+                    _subscriptions.emplace_back();
+                    it = _subscriptions.end() - 1;
+                    strcpy( it->topic, topic );
+
+                    if( _connected ) {
+                        msg_id = esp_mqtt_client_subscribe( _client, it->topic, 0 );
+                        ESP_LOGI( TAG, "sent subscribe to %s, msg_id=%d", it->topic, msg_id );
+                    }
+                }
+                it->wanted = true;
+            }
+        }
+    }
+
+    for( SubscriptionList::iterator it = _subscriptions.begin(); it != _subscriptions.end(); ) {
+        if( it->wanted ) {
+            ++it;
+            continue;
+        }
+
+        if( _connected ) {
+            msg_id = esp_mqtt_client_unsubscribe( _client, it->topic );
+            ESP_LOGI( TAG, "sent unsubscribe from %s, msg_id=%d", it->topic, msg_id );
+        }
+        it = _subscriptions.erase( it );
+    }
+}
+
+void MQTTClient::setEncoding( const char *homeId, PayloadEncoding encoding )
+{
+    HomeSettingsList::iterator it = std::find_if(
+        _homes.begin(), _homes.end(),
+        [homeId](const HomeSettings &home) {
+            return strcmp( home.homeId, homeId ) == 0;
+        });
+
+    if( it == _homes.end() ) {
+        _homes.emplace_back();
+        it = _homes.end() - 1;
+        strncpy( it->homeId, homeId, sizeof( it->homeId ) - 1 );
+        it->homeId[sizeof( it->homeId ) - 1] = '\0';
+    }
+    it->encoding = encoding;
+
+    for( ZoneList::iterator zone = _zones.begin(); zone != _zones.end(); ++zone ) {
+        if( strcmp( (*zone)->getHomeId(), homeId ) == 0 ) {
+            (*zone)->setEncoding( encoding );
+        }
+    }
+}
+
+PayloadEncoding MQTTClient::getEncoding( const char *homeId ) const
+{
+    HomeSettingsList::const_iterator it = std::find_if(
+        _homes.cbegin(), _homes.cend(),
+        [homeId](const HomeSettings &home) {
+            return strcmp( home.homeId, homeId ) == 0;
+        });
+
+    return it == _homes.cend() ? ENCODING_JSON : it->encoding;
+}
+
+void MQTTClient::publish( const char *topic, const char *message, int qos, bool retain, PublishPriority priority )
+{
+    publish( topic, message, strlen( message ), qos, retain, priority );
+}
+
+void MQTTClient::publish( const char *topic, const char *data, size_t len, int qos, bool retain, PublishPriority priority )
+{
+    if( !_publisher.enqueue( priority, topic, data, len, qos, retain ) ) {
+        ESP_LOGW( TAG, "unable to queue message for %s", topic );
+    }
 }
     
 void MQTTClient::connect( const char *brokerUrl )
@@ -111,6 +355,8 @@ void MQTTClient::connect( const char *brokerUrl )
     if( _client == NULL ) {
         _client = esp_mqtt_client_init( &_mqtt_config );
         esp_mqtt_client_register_event( _client, (esp_mqtt_event_id_t)ESP_EVENT_ANY_ID, event_handler, this );
+        _publisher.start( _client );
+        _log.start( this );
         esp_mqtt_client_start( _client );
 
     } else {
@@ -123,13 +369,8 @@ void MQTTClient::connect( const char *brokerUrl )
 void MQTTClient::handleEvent( esp_mqtt_event_handle_t event )
 {
     int msg_id;
-    char *topic = NULL;
-    char *data = NULL;
-    char *topicParts[7];
-    size_t numTopicParts = 0;
-    memset( topicParts, 0, sizeof( topicParts ) );
+    MQTTData *data = NULL;
 
-    cJSON *json = NULL;
     // your_context_t *context = event->context;
     switch (event->event_id) {
         case MQTT_EVENT_CONNECTED:
@@ -141,12 +382,30 @@ void MQTTClient::handleEvent( esp_mqtt_event_handle_t event )
             msg_id = esp_mqtt_client_subscribe( _client, "homes/+/zones/+/config", 1 );
             ESP_LOGI(TAG, "sent subscribe to zone config successful, msg_id=%d", msg_id);
 
-            msg_id = esp_mqtt_client_subscribe( _client, "homes/+/zones/+/devices/+/+", 0 );
-            ESP_LOGI(TAG, "sent subscribe to device events successful, msg_id=%d", msg_id);
+            // the broker forgets our subscriptions with the session
+            _connected = true;
+            for( ZoneList::const_iterator zone = _zones.cbegin(); zone != _zones.cend(); ++zone ) {
+                subscribeZone( **zone );
+            }
 
+            for( SubscriptionList::const_iterator it = _subscriptions.cbegin(); it != _subscriptions.cend(); ++it ) {
+                msg_id = esp_mqtt_client_subscribe( _client, it->topic, 0 );
+                ESP_LOGI(TAG, "sent subscribe to %s, msg_id=%d", it->topic, msg_id);
+            }
+
+            _publisher.setConnected( true );
+
+            // queued behind anything kept from the outage, so the broker
+            // ends up retaining the current values
+            for( ZoneList::const_iterator zone = _zones.cbegin(); zone != _zones.cend(); ++zone ) {
+                (*zone)->republish();
+            }
             break;
         case MQTT_EVENT_DISCONNECTED:
             ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+            _connected = false;
+            _publisher.setConnected( false );
+            _inflight.clear();
             break;
         
         case MQTT_EVENT_SUBSCRIBED:
@@ -157,50 +416,59 @@ void MQTTClient::handleEvent( esp_mqtt_event_handle_t event )
             break;
         case MQTT_EVENT_PUBLISHED:
             ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            _publisher.published( event->msg_id );
             break;
         case MQTT_EVENT_DATA:
-            ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-            printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-            printf("DATA=%.*s\r\n", event->data_len, event->data);
+            // payloads may be binary, and are decoded as they arrive
+            ESP_LOGD( TAG, "MQTT_EVENT_DATA %.*s, %d bytes at %d of %d", event->topic_len, event->topic,
+                      event->data_len, event->current_data_offset, event->total_data_len );
 
-            _data.append( event );
-
-            if( _data.data_len == event->total_data_len ) {
-                data = _data.data;
+            if( event->current_data_offset == 0 ) {
+                if( event->total_data_len > CONFIG_AUTOHOME_MQTT_MAX_PAYLOAD ) {
+                    ESP_LOGW( TAG, "Rejecting %d byte message on %.*s", event->total_data_len, event->topic_len, event->topic );
+                    break;
+                }
 
-                if( data != NULL ) {
-                    json = cJSON_Parse( data );
+                data = _inflight.acquire( event );
+                data->wanted = data->topic.kind != MQTTTopic::UNKNOWN && _router.wants( data->topic );
+                if( !data->wanted ) {
+                    ESP_LOGD( TAG, "No route for message, dropping" );
                 }
-            
-                if( json != NULL ) {
-                    ESP_LOGI( TAG, "Received JSON data" );
-
-                    topic = _data.topic;
-                    if( topic != NULL ) {
-                        for( numTopicParts = 0; numTopicParts < 7 && topic != NULL; ++numTopicParts ) {
-                            topicParts[numTopicParts] = strsep( &topic, "/" );
-                        }
+            } else {
+                data = _inflight.find( event );
+                if( data == NULL ) {
+                    ESP_LOGD( TAG, "No message for fragment of %d at %d, dropping", event->msg_id, event->current_data_offset );
+                    break;
+                }
+            }
 
-                        if( numTopicParts == 5 && strcmp( topicParts[0], "homes" ) == 0 &&
-                            strcmp( topicParts[2], "zones" ) == 0 && strcmp( topicParts[4], "config" ) == 0 ) {
-                            cJSON *controller = cJSON_GetObjectItemCaseSensitive( json, "controller" );
-                            ESP_LOGI("CONTROLLER=[%s]", controller->valuestring );
-                            if( controller && cJSON_IsString( controller ) && _network.matchesMacAddress( controller->valuestring ) ) {
-                                ESP_LOGI("Adding zone %s/%s", topicParts[1], topicParts[3] );
-                                addZone( topicParts[1], topicParts[3] );
-                            } else {
-                                ESP_LOGI("Removing zone %s/%s", topicParts[1], topicParts[3] );
-                                removeZone( topicParts[1], topicParts[3] );
-                            }
-                        }
-                        
-                        for( ZoneList::iterator zone = _zones.begin(); zone != _zones.end(); ++zone ) {
-                            zone->configureZoneJSON( (const char **)topicParts, numTopicParts, json );
+            data->append( event );
+
+            if( data->data_len >= data->total_data_len ) {
+                if( data->wanted && data->stream->finish() ) {
+                    data->decoder.finish();
+                    ESP_LOGI( TAG, "Received %s data", data->stream == &data->cbor ? "CBOR" : "JSON" );
+
+                    if( data->topic.kind == MQTTTopic::HOME_CONFIG ) {
+                        const char *encoding = data->decoder.encoding();
+                        ESP_LOGI( TAG, "Home %s uses %s encoding", data->topic.homeId, encoding[0] ? encoding : "json" );
+                        setEncoding( data->topic.homeId, strcmp( encoding, "cbor" ) == 0 ? ENCODING_CBOR : ENCODING_JSON );
+                    } else if( data->topic.kind == MQTTTopic::ZONE_CONFIG ) {
+                        const char *controller = data->decoder.zoneConfig().controller;
+                        if( _network.matchesMacAddress( controller ) ) {
+                            ESP_LOGI( TAG, "Adding zone %s/%s", data->topic.homeId, data->topic.zoneId );
+                            addZone( data->topic.homeId, data->topic.zoneId );
+                        } else {
+                            ESP_LOGI( TAG, "Removing zone %s/%s", data->topic.homeId, data->topic.zoneId );
+                            removeZone( data->topic.homeId, data->topic.zoneId );
                         }
                     }
-                    cJSON_Delete( json );
+
+                    _router.dispatch( data->topic, data->decoder );
+                } else if( data->wanted ) {
+                    ESP_LOGW( TAG, "Failed to decode message" );
                 }
-                _data.reset();
+                _inflight.release( data );
             }
             break;
         case MQTT_EVENT_ERROR:
@@ -0,0 +1,364 @@
+#include "autohome.h"
+#include <string.h>
+
+static const char *TAG = "publisher";
+static const char HISTORY_SUFFIX[] = "/history";
+
+struct PublishHeader
+{
+    uint16_t topicLen;
+    uint16_t messageLen;
+    uint8_t qos;
+    uint8_t retain;
+};
+
+static void publisherTask( void *arg )
+{
+    Publisher *publisher = (Publisher*)arg;
+    publisher->run();
+}
+
+PublishRing::PublishRing( size_t size, bool keepAll )
+    : _buffer( new uint8_t[size] ), _size( size ), _head( 0 ), _used( 0 ), _keepAll( keepAll ), _dropped( 0 )
+{
+}
+
+PublishRing::~PublishRing()
+{
+    delete[] _buffer;
+}
+
+void PublishRing::write( size_t offset, const void *data, size_t len )
+{
+    size_t pos = ( _head + offset ) % _size;
+    size_t first = len < _size - pos ? len : _size - pos;
+
+    memcpy( _buffer + pos, data, first );
+    memcpy( _buffer, (const uint8_t*)data + first, len - first );
+}
+
+void PublishRing::read( size_t offset, void *data, size_t len ) const
+{
+    size_t pos = ( _head + offset ) % _size;
+    size_t first = len < _size - pos ? len : _size - pos;
+
+    memcpy( data, _buffer + pos, first );
+    memcpy( (uint8_t*)data + first, _buffer, len - first );
+}
+
+void PublishRing::dropOldest()
+{
+    PublishHeader header;
+    read( 0, &header, sizeof( header ) );
+
+    size_t len = sizeof( header ) + header.topicLen + header.messageLen;
+    _head = ( _head + len ) % _size;
+    _used -= len;
+    ++_dropped;
+}
+
+bool PublishRing::push( const char *topic, const char *message, size_t messageLen, int qos, bool retain )
+{
+    PublishHeader header;
+    header.topicLen = strlen( topic );
+    header.messageLen = messageLen;
+    header.qos = qos;
+    header.retain = retain ? 1 : 0;
+
+    size_t len = sizeof( header ) + header.topicLen + header.messageLen;
+    if( len > _size || header.topicLen + header.messageLen + 2 > CONFIG_AUTOHOME_PUBLISH_MAX_MESSAGE ||
+        ( _keepAll && _size - _used < len ) ) {
+        ++_dropped;
+        return false;
+    }
+
+    while( _size - _used < len ) {
+        dropOldest();
+    }
+
+    write( _used, &header, sizeof( header ) );
+    write( _used + sizeof( header ), topic, header.topicLen );
+    write( _used + sizeof( header ) + header.topicLen, message, header.messageLen );
+    _used += len;
+    return true;
+}
+
+bool PublishRing::pop( PublishMessage &message )
+{
+    if( _used == 0 ) {
+        return false;
+    }
+
+    PublishHeader header;
+    read( 0, &header, sizeof( header ) );
+
+    message.topic = message.buffer;
+    read( sizeof( header ), message.topic, header.topicLen );
+    message.topic[header.topicLen] = '\0';
+
+    message.message = message.topic + header.topicLen + 1;
+    read( sizeof( header ) + header.topicLen, message.message, header.messageLen );
+    message.message[header.messageLen] = '\0';
+    message.length = header.messageLen;
+
+    message.qos = header.qos;
+    message.retain = header.retain != 0;
+
+    size_t len = sizeof( header ) + header.topicLen + header.messageLen;
+    _head = ( _head + len ) % _size;
+    _used -= len;
+    return true;
+}
+
+Publisher::Publisher()
+    : _client( NULL ), _lock( xSemaphoreCreateMutex() ), _task( NULL ), _connected( false ),
+      _inflight( 0 ), _hasPending( false ), _pendingSpooled( false ),
+      // a switch state is only sent when it changes, so none is ever
+      // dropped for a newer one
+      _actuation( CONFIG_AUTOHOME_PUBLISH_ACTUATION_BUFFER, true ),
+      _telemetry( CONFIG_AUTOHOME_PUBLISH_TELEMETRY_BUFFER ),
+      _logs( CONFIG_AUTOHOME_PUBLISH_LOG_BUFFER ),
+      _spool( _storage ), _lastReplay( 0 )
+{
+    _rings[PUBLISH_ACTUATION] = &_actuation;
+    _rings[PUBLISH_TELEMETRY] = &_telemetry;
+    _rings[PUBLISH_LOG] = &_logs;
+}
+
+Publisher::~Publisher()
+{
+    vSemaphoreDelete( _lock );
+}
+
+void Publisher::start( esp_mqtt_client_handle_t client )
+{
+    _client = client;
+
+    // from here on the spool belongs to the publisher task
+    if( _task == NULL ) {
+        if( _storage.open( CONFIG_AUTOHOME_SPOOL_PARTITION ) && _spool.mount() ) {
+            ESP_LOGI( TAG, "Spooling to partition %s while disconnected", CONFIG_AUTOHOME_SPOOL_PARTITION );
+        } else {
+            ESP_LOGW( TAG, "No spool partition %s, readings are kept in memory only", CONFIG_AUTOHOME_SPOOL_PARTITION );
+        }
+
+        xTaskCreate( &publisherTask, "publisher", 3072, this, 5, &_task );
+    }
+}
+
+bool Publisher::enqueue( PublishPriority priority, const char *topic, const char *message, size_t len, int qos, bool retain )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    bool res = _rings[priority]->push( topic, message, len, qos, retain );
+    uint32_t dropped = _rings[priority]->dropped();
+    xSemaphoreGive( _lock );
+
+    if( !res && priority == PUBLISH_ACTUATION ) {
+        ESP_LOGW( TAG, "Actuation queue full, refused the message for %s (%u refused so far)", topic, dropped );
+    }
+
+    if( _task != NULL ) {
+        xTaskNotifyGive( _task );
+    }
+    return res;
+}
+
+void Publisher::setConnected( bool connected )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    _connected = connected;
+    _inflight = 0;
+    xSemaphoreGive( _lock );
+
+    if( _task != NULL ) {
+        xTaskNotifyGive( _task );
+    }
+}
+
+void Publisher::published( int msg_id )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    if( _inflight > 0 ) {
+        --_inflight;
+    }
+    xSemaphoreGive( _lock );
+
+    if( _task != NULL ) {
+        xTaskNotifyGive( _task );
+    }
+}
+
+bool Publisher::spool( PublishMessage &message )
+{
+    size_t topicLen = strlen( message.topic );
+    size_t recordLen = 2 + topicLen + message.length;
+
+    // the queues hold no more than a buffer, so a record always unspools
+    // into a message
+    if( topicLen > 0xff || recordLen > FlashRingLog::MAX_RECORD ) {
+        return false;
+    }
+
+    // pack in place over the terminators: qos, topic length, topic, payload
+    memmove( message.buffer + 2 + topicLen, message.message, message.length );
+    memmove( message.buffer + 2, message.topic, topicLen );
+    message.buffer[0] = (char)message.qos;
+    message.buffer[1] = (char)topicLen;
+
+    uint32_t dropped = _spool.dropped();
+    bool res = _spool.append( message.buffer, recordLen );
+    if( _spool.dropped() != dropped ) {
+        ESP_LOGW( TAG, "Spool full, dropped %u old messages", _spool.dropped() - dropped );
+    }
+    return res;
+}
+
+void Publisher::spoolOverflow()
+{
+    if( !_spool.mounted() ) {
+        return;
+    }
+
+    while( true ) {
+        bool popped = false;
+
+        // the oldest half of each queue goes to flash, which leaves room for
+        // new messages and keeps the newest ones to publish live on reconnect
+        xSemaphoreTake( _lock, portMAX_DELAY );
+        for( int p = 0; p < PUBLISH_LOG && !_connected && !popped; ++p ) {
+            if( _rings[p]->used() > _rings[p]->size() / 2 ) {
+                popped = _rings[p]->pop( _overflow );
+            }
+        }
+        xSemaphoreGive( _lock );
+
+        if( !popped ) {
+            return;
+        }
+
+        // erasing a sector takes a while, so this is done outside the lock
+        // and on this task, never on the one that queued the message
+        if( !spool( _overflow ) ) {
+            ESP_LOGW( TAG, "Unable to spool a message to flash, it is lost" );
+        }
+    }
+}
+
+bool Publisher::unspool( PublishMessage &message )
+{
+    int len = _spool.peek( message.buffer, sizeof( message.buffer ) );
+    if( len < 2 ) {
+        return false;
+    }
+
+    // unpack in place: qos, topic length, topic, payload
+    int qos = (uint8_t)message.buffer[0];
+    size_t topicLen = (uint8_t)message.buffer[1];
+    if( 2 + topicLen > (size_t)len ) {
+        _spool.consume();
+        return false;
+    }
+    size_t messageLen = len - 2 - topicLen;
+
+    // receivers take whatever arrives on a reading topic as the current
+    // value, so the backlog goes out on a history topic beside it
+    size_t historyLen = topicLen + PublishMessage::HISTORY_LENGTH;
+    memmove( message.buffer + historyLen + 1, message.buffer + 2 + topicLen, messageLen );
+    memmove( message.buffer, message.buffer + 2, topicLen );
+    memcpy( message.buffer + topicLen, HISTORY_SUFFIX, PublishMessage::HISTORY_LENGTH );
+    message.topic = message.buffer;
+    message.topic[historyLen] = '\0';
+    message.message = message.topic + historyLen + 1;
+    message.message[messageLen] = '\0';
+    message.length = messageLen;
+    message.qos = qos;
+    message.retain = false;
+    return true;
+}
+
+TickType_t Publisher::replayDelay()
+{
+    TickType_t delay = portMAX_DELAY;
+
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    bool connected = _connected;
+    xSemaphoreGive( _lock );
+
+    if( connected && _spool.mounted() && !_spool.empty() ) {
+        TickType_t elapsed = xTaskGetTickCount() - _lastReplay;
+        TickType_t interval = pdMS_TO_TICKS( CONFIG_AUTOHOME_SPOOL_REPLAY_INTERVAL );
+        delay = elapsed < interval ? interval - elapsed : 1;
+    }
+
+    return delay;
+}
+
+bool Publisher::next()
+{
+    bool ready = false;
+    bool replay = false;
+
+    // the pending message belongs to this task; the lock covers the queues
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    // only hand esp-mqtt as much as the broker is acknowledging, so its
+    // outbox stays small while the queues absorb a stall
+    if( _connected && _inflight < CONFIG_AUTOHOME_PUBLISH_INFLIGHT ) {
+        if( !_hasPending ) {
+            for( int p = 0; p < PUBLISH_PRIORITIES && !_hasPending; ++p ) {
+                _hasPending = _rings[p]->pop( _pending );
+            }
+        }
+        ready = _hasPending;
+        replay = !_hasPending;
+    }
+    xSemaphoreGive( _lock );
+
+    // the backlog from an outage trickles out behind live traffic
+    TickType_t now = xTaskGetTickCount();
+    if( replay && _spool.mounted() &&
+        now - _lastReplay >= pdMS_TO_TICKS( CONFIG_AUTOHOME_SPOOL_REPLAY_INTERVAL ) ) {
+        _hasPending = _pendingSpooled = unspool( _pending );
+        if( _hasPending ) {
+            _lastReplay = now;
+            ready = true;
+        }
+    }
+
+    return ready;
+}
+
+void Publisher::run()
+{
+    TickType_t wait = portMAX_DELAY;
+
+    while( true ) {
+        ulTaskNotifyTake( pdTRUE, wait );
+
+        spoolOverflow();
+
+        while( next() ) {
+            ESP_LOGI( TAG, "publish %u bytes to %s", (unsigned)_pending.length, _pending.topic );
+            int msg_id = esp_mqtt_client_publish( _client, _pending.topic, _pending.message, _pending.length,
+                                                  _pending.qos, _pending.retain ? 1 : 0 );
+            if( msg_id < 0 ) {
+                // keep the message and try again on the next connect or ack
+                ESP_LOGW( TAG, "publish to %s failed", _pending.topic );
+                break;
+            }
+
+            xSemaphoreTake( _lock, portMAX_DELAY );
+            if( _pending.qos > 0 ) {
+                ++_inflight;
+            }
+            xSemaphoreGive( _lock );
+
+            if( _pendingSpooled ) {
+                _spool.consume();
+                _pendingSpooled = false;
+            }
+            _hasPending = false;
+        }
+
+        wait = replayDelay();
+    }
+}
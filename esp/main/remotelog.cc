@@ -0,0 +1,366 @@
+#include "autohome.h"
+#include <string.h>
+#include <ctype.h>
+
+static const char *TAG = "remotelog";
+
+static void remoteLogTask( void *arg )
+{
+    RemoteLog *log = (RemoteLog*)arg;
+    log->run();
+}
+
+static const char *levelName( esp_log_level_t level )
+{
+    switch( level ) {
+    case ESP_LOG_NONE:
+        return "NONE";
+    case ESP_LOG_ERROR:
+        return "ERROR";
+    case ESP_LOG_WARN:
+        return "WARN";
+    case ESP_LOG_INFO:
+        return "INFO";
+    case ESP_LOG_DEBUG:
+        return "DEBUG";
+    case ESP_LOG_VERBOSE:
+        return "VERBOSE";
+    default:
+        return "UNKNOWN";
+    }
+}
+
+// Binary batches start with a version byte, then each record is
+//   u32 format address, u32 tag address, u32 time, u32 uptime ms,
+//   u8 level, u8 argument length, packed arguments
+// all little endian. tools/decodelog.js turns them back into text.
+static const uint8_t BINARY_LOG_VERSION = 1;
+static const size_t BINARY_RECORD_HEADER = 18;
+
+static char *putWord( char *out, uint32_t value )
+{
+    for( int i = 0; i < 4; ++i ) {
+        *out++ = (char)( value >> ( i * 8 ) );
+    }
+    return out;
+}
+
+static bool putArgument( char *buffer, size_t size, size_t &length, char type, const void *data, size_t len )
+{
+    if( length + 1 + len > size ) {
+        return false;
+    }
+
+    buffer[length++] = type;
+    memcpy( buffer + length, data, len );
+    length += len;
+    return true;
+}
+
+size_t packLogArguments( char *buffer, size_t size, const char *format, va_list args )
+{
+    size_t length = 0;
+
+    // walks the conversions the way printf would, but only to pull each
+    // argument off the list; every argument is tagged with its type so the
+    // host does not have to agree with this parse
+    for( const char *c = format; *c; ++c ) {
+        if( *c != '%' ) {
+            continue;
+        }
+        if( *++c == '%' ) {
+            continue;
+        }
+
+        while( *c && strchr( "-+ #0", *c ) ) {
+            ++c;
+        }
+        for( int field = 0; field < 2; ++field ) {
+            if( *c == '*' ) {
+                int32_t value = va_arg( args, int );
+                if( !putArgument( buffer, size, length, 'i', &value, sizeof( value ) ) ) {
+                    return length;
+                }
+                ++c;
+            }
+            while( isdigit( (unsigned char)*c ) ) {
+                ++c;
+            }
+            if( field == 0 && *c == '.' ) {
+                ++c;
+            } else {
+                break;
+            }
+        }
+
+        int longs = 0;
+        while( *c == 'h' ) {
+            ++c;
+        }
+        while( *c == 'l' ) {
+            ++longs;
+            ++c;
+        }
+        if( *c == 'j' ) {
+            longs = 2;
+            ++c;
+        } else if( *c == 'z' || *c == 't' || *c == 'L' ) {
+            ++c;
+        }
+
+        bool packed = true;
+        switch( *c ) {
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+        case 'c':
+            if( longs >= 2 || ( longs == 1 && sizeof( long ) == 8 ) ) {
+                int64_t value = longs >= 2 ? va_arg( args, long long ) : va_arg( args, long );
+                packed = putArgument( buffer, size, length, 'q', &value, sizeof( value ) );
+            } else {
+                int32_t value = longs == 1 ? va_arg( args, long ) : va_arg( args, int );
+                packed = putArgument( buffer, size, length, 'i', &value, sizeof( value ) );
+            }
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A': {
+            double value = va_arg( args, double );
+            packed = putArgument( buffer, size, length, 'd', &value, sizeof( value ) );
+            break;
+        }
+        case 's': {
+            // the string may not outlive the call, so it goes in by value
+            const char *value = va_arg( args, const char* );
+            if( value == NULL ) {
+                value = "(null)";
+            }
+            size_t len = strlen( value );
+            if( len > 0xff ) {
+                len = 0xff;
+            }
+            if( length + 2 > size ) {
+                return length;
+            }
+            if( length + 2 + len > size ) {
+                len = size - length - 2;
+            }
+            buffer[length++] = 's';
+            buffer[length++] = (char)len;
+            memcpy( buffer + length, value, len );
+            length += len;
+            break;
+        }
+        case 'p': {
+            uint32_t value = (uint32_t)(uintptr_t)va_arg( args, void* );
+            packed = putArgument( buffer, size, length, 'p', &value, sizeof( value ) );
+            break;
+        }
+        case 'n':
+            (void)va_arg( args, void* );
+            break;
+        default:
+            // nothing past a conversion we do not know can be trusted
+            return length;
+        }
+
+        if( !packed ) {
+            return length;
+        }
+    }
+
+    return length;
+}
+
+RemoteLog::RemoteLog()
+    : _enqueue( 0 ), _dequeue( 0 ), _dropped( 0 ), _client( NULL ), _task( NULL ), _batchLength( 0 ),
+      _batchBinary( false )
+{
+    for( uint32_t i = 0; i < SIZE; ++i ) {
+        _cells[i].sequence.store( i, std::memory_order_relaxed );
+    }
+    _topic[0] = '\0';
+}
+
+void RemoteLog::start( MQTTClient *client )
+{
+    _client = client;
+
+    if( _task == NULL ) {
+        xTaskCreate( &remoteLogTask, "remotelog", 3072, this, 4, &_task );
+    }
+}
+
+LogRecord *RemoteLog::reserve( uint32_t &position )
+{
+    uint32_t pos = _enqueue.load( std::memory_order_relaxed );
+
+    while( true ) {
+        Cell &cell = _cells[pos & ( SIZE - 1 )];
+        int32_t diff = (int32_t)( cell.sequence.load( std::memory_order_acquire ) - pos );
+
+        if( diff == 0 ) {
+            if( _enqueue.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) {
+                position = pos;
+                return &cell.record;
+            }
+        } else if( diff < 0 ) {
+            // the flusher has not caught up; logs are the first thing to give
+            _dropped.fetch_add( 1, std::memory_order_relaxed );
+            return NULL;
+        } else {
+            pos = _enqueue.load( std::memory_order_relaxed );
+        }
+    }
+}
+
+void RemoteLog::commit( uint32_t position )
+{
+    _cells[position & ( SIZE - 1 )].sequence.store( position + 1, std::memory_order_release );
+
+    // wake the flusher early rather than let the queue overflow
+    uint32_t queued = _enqueue.load( std::memory_order_relaxed ) - _dequeue.load( std::memory_order_relaxed );
+    if( queued >= SIZE / 2 && _task != NULL ) {
+        xTaskNotifyGive( _task );
+    }
+}
+
+LogRecord *RemoteLog::front( uint32_t &position )
+{
+    uint32_t pos = _dequeue.load( std::memory_order_relaxed );
+
+    while( true ) {
+        Cell &cell = _cells[pos & ( SIZE - 1 )];
+        int32_t diff = (int32_t)( cell.sequence.load( std::memory_order_acquire ) - ( pos + 1 ) );
+
+        if( diff == 0 ) {
+            if( _dequeue.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) ) {
+                position = pos;
+                return &cell.record;
+            }
+        } else if( diff < 0 ) {
+            return NULL;
+        } else {
+            pos = _dequeue.load( std::memory_order_relaxed );
+        }
+    }
+}
+
+void RemoteLog::release( uint32_t position )
+{
+    _cells[position & ( SIZE - 1 )].sequence.store( position + SIZE, std::memory_order_release );
+}
+
+void RemoteLog::publishBatch()
+{
+    if( _batchLength > 0 ) {
+        if( !_batchBinary ) {
+            _batch[_batchLength++] = ']';
+        }
+        _client->publish( _topic, _batch, _batchLength, 0, false, PUBLISH_LOG );
+        _batchLength = 0;
+    }
+}
+
+size_t RemoteLog::encodeText( const LogRecord &record )
+{
+    JSONWriter writer( _entry, sizeof( _entry ) );
+
+    writer.beginObject( 4 );
+    writer.key( "time" );
+    writer.timestamp( record.time );
+    writer.key( "tag" );
+    writer.string( record.tag );
+    writer.key( "level" );
+    writer.string( levelName( record.level ) );
+    writer.key( "message" );
+    writer.string( record.message );
+    writer.endObject();
+
+    if( writer.overflowed() ) {
+        ESP_LOGW( TAG, "Log record from %s too long to send", record.tag );
+        return 0;
+    }
+    return writer.length();
+}
+
+size_t RemoteLog::encodeBinary( const LogRecord &record )
+{
+    char *out = _entry;
+
+    out = putWord( out, (uint32_t)(uintptr_t)record.format );
+    out = putWord( out, (uint32_t)(uintptr_t)record.tagId );
+    out = putWord( out, (uint32_t)record.time );
+    out = putWord( out, record.uptime );
+    *out++ = (char)record.level;
+    *out++ = (char)record.length;
+    memcpy( out, record.message, record.length );
+
+    return BINARY_RECORD_HEADER + record.length;
+}
+
+void RemoteLog::append( const LogRecord &record )
+{
+    char topic[sizeof( _topic )];
+    size_t length = record.binary ? encodeBinary( record ) : encodeText( record );
+
+    if( length == 0 ) {
+        return;
+    }
+
+    snprintf( topic, sizeof( topic ), "homes/%s/zones/%s/%s", record.homeId, record.zoneId, record.binary ? "trace" : "log" );
+
+    // records for one zone go out together, as a JSON array or behind a
+    // version byte, up to what the publish queue takes in one message
+    size_t budget = CONFIG_AUTOHOME_PUBLISH_MAX_MESSAGE - strlen( topic ) - 2;
+    if( _batchLength > 0 && ( strcmp( topic, _topic ) != 0 || _batchLength + 1 + length + 1 > budget ) ) {
+        publishBatch();
+    }
+    if( 1 + length + 1 > budget ) {
+        ESP_LOGW( TAG, "Log record from %s too long to send", record.binary ? "trace" : record.tag );
+        return;
+    }
+
+    strcpy( _topic, topic );
+    if( _batchLength == 0 ) {
+        _batchBinary = record.binary;
+        _batch[_batchLength++] = record.binary ? (char)BINARY_LOG_VERSION : '[';
+    } else if( !_batchBinary ) {
+        _batch[_batchLength++] = ',';
+    }
+    memcpy( _batch + _batchLength, _entry, length );
+    _batchLength += length;
+}
+
+void RemoteLog::flush()
+{
+    LogRecord *record;
+    uint32_t position;
+
+    while( ( record = front( position ) ) != NULL ) {
+        append( *record );
+        release( position );
+    }
+    publishBatch();
+
+    uint32_t dropped = _dropped.exchange( 0, std::memory_order_relaxed );
+    if( dropped > 0 ) {
+        ESP_LOGW( TAG, "Dropped %u log records, queue full", dropped );
+    }
+}
+
+void RemoteLog::run()
+{
+    while( true ) {
+        ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS( CONFIG_AUTOHOME_LOG_FLUSH_INTERVAL ) );
+        flush();
+    }
+}
@@ -0,0 +1,172 @@
+#include "autohome.h"
+#include <string.h>
+
+static const char *TAG = "router";
+
+MQTTTopic::MQTTTopic( char *topic )
+    : kind( UNKNOWN ), homeId( NULL ), zoneId( NULL ), deviceId( NULL ), type( NULL ), reading( READING_OTHER )
+{
+    char *parts[7];
+    size_t numParts = 0;
+
+    for( numParts = 0; numParts < 7 && topic != NULL; ++numParts ) {
+        parts[numParts] = strsep( &topic, "/" );
+    }
+
+    if( topic != NULL || numParts < 3 || strcmp( parts[0], "homes" ) != 0 ) {
+        return;
+    }
+
+    // an id that is not a UUID would alias every other one, so the topic
+    // is not routed at all
+    homeId = parts[1];
+    if( !home.parseRequired( homeId ) ) {
+        return;
+    }
+
+    if( numParts == 3 && strcmp( parts[2], "config" ) == 0 ) {
+        kind = HOME_CONFIG;
+        return;
+    }
+
+    if( numParts < 5 || strcmp( parts[2], "zones" ) != 0 ) {
+        return;
+    }
+
+    zoneId = parts[3];
+    if( !zone.parseRequired( zoneId ) ) {
+        return;
+    }
+
+    if( numParts == 5 && strcmp( parts[4], "config" ) == 0 ) {
+        kind = ZONE_CONFIG;
+    } else if( numParts == 7 && strcmp( parts[4], "devices" ) == 0 ) {
+        deviceId = parts[5];
+        type = parts[6];
+        if( !device.parseRequired( deviceId ) ) {
+            return;
+        }
+        kind = strcmp( type, "config" ) == 0 ? DEVICE_CONFIG : DEVICE_VALUE;
+        reading = readingType( type );
+    }
+}
+
+uint32_t TopicRouter::hashKey( const Uuid &homeId, const Uuid &zoneId, const Uuid *deviceId )
+{
+    uint32_t hash = zoneId.hash( homeId.hash() );
+
+    return deviceId ? deviceId->hash( hash ) : hash;
+}
+
+void TopicRouter::addZone( Zone *zone )
+{
+    if( findZone( zone->getHomeUuid(), zone->getZoneUuid() ) == NULL ) {
+        _zones.emplace( hashKey( zone->getHomeUuid(), zone->getZoneUuid() ), zone );
+    }
+}
+
+void TopicRouter::removeZone( const Uuid &homeId, const Uuid &zoneId )
+{
+    auto range = _zones.equal_range( hashKey( homeId, zoneId ) );
+    for( auto it = range.first; it != range.second; ++it ) {
+        if( it->second->matches( homeId, zoneId ) ) {
+            _zones.erase( it );
+            break;
+        }
+    }
+}
+
+void TopicRouter::rebuildConsumers( ZoneList &zones )
+{
+    _consumers.clear();
+
+    for( ZoneList::iterator zone = zones.begin(); zone != zones.end(); ++zone ) {
+        const DeviceList &devices = (*zone)->getDevices();
+        for( DeviceList::const_iterator device = devices.cbegin(); device != devices.cend(); ++device ) {
+            const DeviceChangeList &changes = (*device)->getChanges();
+            for( DeviceChangeList::const_iterator change = changes.cbegin(); change != changes.cend(); ++change ) {
+                uint32_t key = hashKey( change->getHomeId(), change->getZoneId(), &change->getDeviceId() );
+
+                bool known = false;
+                auto range = _consumers.equal_range( key );
+                for( auto it = range.first; it != range.second && !known; ++it ) {
+                    known = it->second == *zone;
+                }
+
+                if( !known ) {
+                    _consumers.emplace( key, *zone );
+                }
+            }
+        }
+    }
+
+    ESP_LOGI( TAG, "Routing %u zones, %u remote consumers", (unsigned)_zones.size(), (unsigned)_consumers.size() );
+}
+
+Zone *TopicRouter::findZone( const Uuid &homeId, const Uuid &zoneId ) const
+{
+    auto range = _zones.equal_range( hashKey( homeId, zoneId ) );
+    for( auto it = range.first; it != range.second; ++it ) {
+        if( it->second->matches( homeId, zoneId ) ) {
+            return it->second;
+        }
+    }
+
+    return NULL;
+}
+
+bool TopicRouter::wants( const MQTTTopic &topic ) const
+{
+    switch( topic.kind ) {
+    case MQTTTopic::HOME_CONFIG:
+        // the wire encoding is negotiated per home, possibly before any zone
+    case MQTTTopic::ZONE_CONFIG:
+        // the controller field decides whether the zone gets added or removed
+        return true;
+    case MQTTTopic::DEVICE_CONFIG:
+        return findZone( topic.home, topic.zone ) != NULL;
+    case MQTTTopic::DEVICE_VALUE:
+        return _consumers.count( hashKey( topic.home, topic.zone, &topic.device ) ) > 0;
+    default:
+        return false;
+    }
+}
+
+void TopicRouter::dispatch( const MQTTTopic &topic, ConfigDecoder &decoder ) const
+{
+    Zone *zone = NULL;
+
+    switch( topic.kind ) {
+    case MQTTTopic::ZONE_CONFIG:
+        zone = findZone( topic.home, topic.zone );
+        if( zone ) {
+            zone->configureZone( decoder.zoneConfig() );
+        }
+        break;
+    case MQTTTopic::DEVICE_CONFIG:
+        zone = findZone( topic.home, topic.zone );
+        if( zone ) {
+            zone->sendZoneLog( ESP_LOG_INFO, TAG, "Configuring device with id %s", topic.deviceId );
+            zone->configureZoneDevice( topic.deviceId, decoder.deviceConfig() );
+        }
+        break;
+    case MQTTTopic::DEVICE_VALUE: {
+        const DeviceValue *value = decoder.value();
+        if( value == NULL ) {
+            break;
+        }
+
+        auto range = _consumers.equal_range( hashKey( topic.home, topic.zone, &topic.device ) );
+        for( auto it = range.first; it != range.second; ++it ) {
+            // a zone's own readings are handled locally when they are taken
+            if( !it->second->matches( topic.home, topic.zone ) &&
+                it->second->dependsOn( topic.home, topic.zone, topic.device ) ) {
+                it->second->setRemoteValue( topic.home, topic.zone, topic.device, topic.reading, *value, decoder.threshold() );
+            }
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
@@ -0,0 +1,191 @@
+#include "autohome.h"
+#include <algorithm>
+
+static const char *TAG = "scheduler";
+
+static void sensorTask( void *arg )
+{
+    SensorScheduler *scheduler = (SensorScheduler*)arg;
+    scheduler->run();
+}
+
+// deadlines are compared by their distance, so the tick count can wrap
+static bool before( TickType_t first, TickType_t second )
+{
+    return (int32_t)( first - second ) < 0;
+}
+
+SensorScheduler::SensorScheduler()
+    : _lock( xSemaphoreCreateMutex() ), _task( NULL ), _reading( NULL )
+{
+}
+
+SensorScheduler::~SensorScheduler()
+{
+    vSemaphoreDelete( _lock );
+}
+
+bool SensorScheduler::later( const Entry &first, const Entry &second )
+{
+    return before( second.deadline, first.deadline );
+}
+
+TickType_t SensorScheduler::phase( TickType_t now, TickType_t period ) const
+{
+    std::vector<TickType_t> phases;
+
+    for( std::vector<Entry>::const_iterator entry = _heap.cbegin(); entry != _heap.cend(); ++entry ) {
+        if( entry->period == period ) {
+            phases.push_back( ( entry->deadline - now ) % period );
+        }
+    }
+
+    // the first sensor at an interval reads straight away
+    if( phases.empty() ) {
+        return 0;
+    }
+
+    // the others go in the middle of the widest gap between those there
+    std::sort( phases.begin(), phases.end() );
+    TickType_t start = phases.back();
+    TickType_t gap = phases.front() + period - phases.back();
+    for( size_t index = 1; index < phases.size(); ++index ) {
+        if( phases[index] - phases[index - 1] > gap ) {
+            start = phases[index - 1];
+            gap = phases[index] - phases[index - 1];
+        }
+    }
+
+    return ( start + gap / 2 ) % period;
+}
+
+size_t SensorScheduler::unschedule( Device *device )
+{
+    size_t size = _heap.size();
+
+    // its next reading and the rest of a read in progress
+    _heap.erase( std::remove_if( _heap.begin(), _heap.end(),
+        [device](const Entry &entry) {
+            return entry.device == device;
+        }), _heap.end() );
+
+    if( _heap.size() == size ) {
+        return 0;
+    }
+
+    std::make_heap( _heap.begin(), _heap.end(), later );
+    return size - _heap.size();
+}
+
+void SensorScheduler::add( Device *device, uint32_t interval )
+{
+    Entry entry;
+
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    unschedule( device );
+
+    TickType_t now = xTaskGetTickCount();
+    entry.period = pdMS_TO_TICKS( interval ) > 0 ? pdMS_TO_TICKS( interval ) : 1;
+    entry.deadline = now + phase( now, entry.period );
+    entry.device = device;
+    _heap.push_back( entry );
+    std::push_heap( _heap.begin(), _heap.end(), later );
+
+    ESP_LOGI( TAG, "Reading %s every %u ms, first in %u ms, %u sensors", device->getId(), interval,
+              ( entry.deadline - now ) * portTICK_PERIOD_MS, (unsigned)_heap.size() );
+
+    if( _task == NULL ) {
+        xTaskCreate( &sensorTask, "sensors", CONFIG_AUTOHOME_SENSOR_STACK_SIZE, this, 5, &_task );
+    }
+    xSemaphoreGive( _lock );
+
+    // the new deadline may be sooner than the one the task waits for
+    xTaskNotifyGive( _task );
+}
+
+void SensorScheduler::remove( Device *device )
+{
+    xSemaphoreTake( _lock, portMAX_DELAY );
+    size_t removed = unschedule( device );
+
+    // the caller is about to reconfigure or delete the device; a stray
+    // notification only means looking again
+    while( _reading == device && xTaskGetCurrentTaskHandle() != _task ) {
+        _waiters.push_back( xTaskGetCurrentTaskHandle() );
+        xSemaphoreGive( _lock );
+        ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+        xSemaphoreTake( _lock, portMAX_DELAY );
+    }
+
+    // a read that was in progress may have left its second step behind
+    removed += unschedule( device );
+    if( removed > 0 ) {
+        ESP_LOGI( TAG, "No longer reading %s", device->getId() );
+    }
+    xSemaphoreGive( _lock );
+}
+
+void SensorScheduler::run()
+{
+    for( ;; ) {
+        TickType_t wait = portMAX_DELAY;
+        bool finishing = false;
+
+        xSemaphoreTake( _lock, portMAX_DELAY );
+        if( !_heap.empty() ) {
+            TickType_t now = xTaskGetTickCount();
+            Entry &next = _heap.front();
+
+            if( before( now, next.deadline ) ) {
+                wait = next.deadline - now;
+            } else {
+                std::pop_heap( _heap.begin(), _heap.end(), later );
+                Entry &due = _heap.back();
+                _reading = due.device;
+                finishing = due.period == 0;
+
+                if( finishing ) {
+                    _heap.pop_back();
+                } else {
+                    // the next deadline follows from this one, not from when
+                    // the read finishes; readings missed while busy are skipped
+                    due.deadline += due.period;
+                    if( !before( now, due.deadline ) ) {
+                        TickType_t missed = ( now - due.deadline ) / due.period + 1;
+                        ESP_LOGW( TAG, "Sensor %s is %u readings behind", due.device->getId(), missed );
+                        due.deadline += missed * due.period;
+                    }
+                    std::push_heap( _heap.begin(), _heap.end(), later );
+                }
+            }
+        }
+        xSemaphoreGive( _lock );
+
+        if( _reading != NULL ) {
+            TickType_t delay = 0;
+
+            // other sensors are read while one is left to work
+            if( finishing ) {
+                _reading->finishRead();
+            } else {
+                delay = _reading->startRead();
+            }
+
+            xSemaphoreTake( _lock, portMAX_DELAY );
+            if( delay > 0 ) {
+                Entry entry = { xTaskGetTickCount() + delay, 0, _reading };
+                _heap.push_back( entry );
+                std::push_heap( _heap.begin(), _heap.end(), later );
+            }
+            _reading = NULL;
+            for( std::vector<TaskHandle_t>::const_iterator waiter = _waiters.cbegin(); waiter != _waiters.cend(); ++waiter ) {
+                xTaskNotifyGive( *waiter );
+            }
+            _waiters.clear();
+            xSemaphoreGive( _lock );
+            continue;
+        }
+
+        ulTaskNotifyTake( pdTRUE, wait );
+    }
+}
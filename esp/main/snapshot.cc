@@ -0,0 +1,404 @@
+#include "autohome.h"
+#include <string.h>
+#include <algorithm>
+
+static const char *TAG = "snapshot";
+static const char *NAMESPACE = "snapshot";
+
+void SnapshotWriter::put16( uint16_t value )
+{
+    put8( value & 0xff );
+    put8( value >> 8 );
+}
+
+void SnapshotWriter::put32( uint32_t value )
+{
+    put16( value & 0xffff );
+    put16( value >> 16 );
+}
+
+void SnapshotWriter::put64( uint64_t value )
+{
+    put32( value & 0xffffffff );
+    put32( value >> 32 );
+}
+
+void SnapshotWriter::putBytes( const void *data, size_t len )
+{
+    const uint8_t *bytes = (const uint8_t*)data;
+    _data.insert( _data.end(), bytes, bytes + len );
+}
+
+void SnapshotWriter::putString( const char *value )
+{
+    size_t len = strlen( value );
+    if( len > 0xff ) {
+        len = 0xff;
+    }
+
+    put8( len );
+    putBytes( value, len );
+}
+
+SnapshotReader::SnapshotReader( const uint8_t *data, size_t len )
+    : _data( data ), _length( len ), _position( 0 ), _failed( false )
+{
+}
+
+uint8_t SnapshotReader::get8()
+{
+    if( _failed || _position >= _length ) {
+        _failed = true;
+        return 0;
+    }
+
+    return _data[_position++];
+}
+
+uint16_t SnapshotReader::get16()
+{
+    uint16_t low = get8();
+    return low | ( get8() << 8 );
+}
+
+uint32_t SnapshotReader::get32()
+{
+    uint32_t low = get16();
+    return low | ( (uint32_t)get16() << 16 );
+}
+
+uint64_t SnapshotReader::get64()
+{
+    uint64_t low = get32();
+    return low | ( (uint64_t)get32() << 32 );
+}
+
+void SnapshotReader::getBytes( void *data, size_t len )
+{
+    if( _failed || _length - _position < len ) {
+        _failed = true;
+        memset( data, 0, len );
+        return;
+    }
+
+    memcpy( data, _data + _position, len );
+    _position += len;
+}
+
+void SnapshotReader::getString( char *value, size_t size )
+{
+    size_t len = get8();
+    size_t kept = len < size ? len : size - 1;
+
+    getBytes( value, kept );
+    value[kept] = '\0';
+    if( !_failed && _length - _position >= len - kept ) {
+        _position += len - kept;
+    } else {
+        _failed = true;
+    }
+}
+
+size_t SnapshotReader::getCount( size_t itemSize )
+{
+    size_t count = get16();
+
+    if( _failed || count * itemSize > _length - _position ) {
+        _failed = true;
+        return 0;
+    }
+
+    return count;
+}
+
+void DeviceValue::save( SnapshotWriter &writer ) const
+{
+    writer.putBytes( &value, sizeof( value ) );
+    writer.putString( unit );
+}
+
+void DeviceValue::load( SnapshotReader &reader )
+{
+    reader.getBytes( &value, sizeof( value ) );
+    reader.getString( unit, sizeof( unit ) );
+}
+
+ConfigSnapshot::ConfigSnapshot()
+    : _handle( 0 ), _open( false ), _restoring( false )
+{
+}
+
+ConfigSnapshot::~ConfigSnapshot()
+{
+    if( _open ) {
+        nvs_close( _handle );
+    }
+}
+
+bool ConfigSnapshot::open()
+{
+    if( _open ) {
+        return true;
+    }
+
+    esp_err_t err = nvs_open( NAMESPACE, NVS_READWRITE, &_handle );
+    if( err != ESP_OK ) {
+        ESP_LOGW( TAG, "Unable to open NVS namespace %s: %d", NAMESPACE, err );
+        return false;
+    }
+
+    _open = true;
+    loadKeys( "zones", _zones );
+    loadKeys( "devices", _devices );
+    return true;
+}
+
+void ConfigSnapshot::loadKeys( const char *name, std::vector<uint32_t> &keys )
+{
+    size_t len = 0;
+
+    keys.clear();
+    if( nvs_get_blob( _handle, name, NULL, &len ) != ESP_OK || len % sizeof( uint32_t ) != 0 ) {
+        return;
+    }
+
+    keys.resize( len / sizeof( uint32_t ) );
+    if( nvs_get_blob( _handle, name, keys.data(), &len ) != ESP_OK ) {
+        keys.clear();
+    }
+}
+
+void ConfigSnapshot::saveKeys( const char *name, const std::vector<uint32_t> &keys )
+{
+    esp_err_t err = keys.empty()
+        ? nvs_erase_key( _handle, name )
+        : nvs_set_blob( _handle, name, keys.data(), keys.size() * sizeof( uint32_t ) );
+
+    if( err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND ) {
+        ESP_LOGW( TAG, "Unable to save %s snapshot keys: %d", name, err );
+    }
+}
+
+bool ConfigSnapshot::fetch( char prefix, uint32_t key, std::vector<uint8_t> &data )
+{
+    char name[16];
+    size_t len = 0;
+
+    snprintf( name, sizeof( name ), "%c%08x", prefix, key );
+    if( nvs_get_blob( _handle, name, NULL, &len ) != ESP_OK ) {
+        return false;
+    }
+
+    data.resize( len );
+    return nvs_get_blob( _handle, name, data.data(), &len ) == ESP_OK;
+}
+
+void ConfigSnapshot::store( char prefix, std::vector<uint32_t> &keys, uint32_t key )
+{
+    std::vector<uint8_t> current;
+    char name[16];
+
+    // retained config comes back on every reconnect; flash is only written
+    // when it differs
+    if( fetch( prefix, key, current ) && current.size() == _writer.length() &&
+        memcmp( current.data(), _writer.data(), current.size() ) == 0 ) {
+        return;
+    }
+
+    if( _writer.length() > CONFIG_AUTOHOME_SNAPSHOT_MAX_SIZE ) {
+        ESP_LOGW( TAG, "Snapshot of %u bytes is too large to keep", (unsigned)_writer.length() );
+        erase( prefix, keys, key );
+        return;
+    }
+
+    snprintf( name, sizeof( name ), "%c%08x", prefix, key );
+    esp_err_t err = nvs_set_blob( _handle, name, _writer.data(), _writer.length() );
+    if( err != ESP_OK ) {
+        ESP_LOGW( TAG, "Unable to save snapshot %s: %d", name, err );
+        return;
+    }
+
+    if( std::find( keys.begin(), keys.end(), key ) == keys.end() ) {
+        keys.push_back( key );
+        saveKeys( prefix == 'z' ? "zones" : "devices", keys );
+    }
+
+    nvs_commit( _handle );
+    ESP_LOGI( TAG, "Saved snapshot %s, %u bytes", name, (unsigned)_writer.length() );
+}
+
+void ConfigSnapshot::erase( char prefix, std::vector<uint32_t> &keys, uint32_t key )
+{
+    std::vector<uint32_t>::iterator it = std::find( keys.begin(), keys.end(), key );
+    char name[16];
+
+    if( it == keys.end() ) {
+        return;
+    }
+
+    snprintf( name, sizeof( name ), "%c%08x", prefix, key );
+    nvs_erase_key( _handle, name );
+    keys.erase( it );
+    saveKeys( prefix == 'z' ? "zones" : "devices", keys );
+    nvs_commit( _handle );
+}
+
+void ConfigSnapshot::saveZone( const Zone &zone )
+{
+    if( _restoring || !open() ) {
+        return;
+    }
+
+    _writer.clear();
+    _writer.put8( VERSION );
+    _writer.put8( ZONE );
+    zone.getHomeUuid().save( _writer );
+    zone.getZoneUuid().save( _writer );
+    zone.save( _writer );
+
+    store( 'z', _zones, TopicRouter::hashKey( zone.getHomeUuid(), zone.getZoneUuid() ) );
+}
+
+void ConfigSnapshot::saveDevice( const Zone &zone, const Device &device )
+{
+    if( _restoring || !open() ) {
+        return;
+    }
+
+    _writer.clear();
+    _writer.put8( VERSION );
+    _writer.put8( DEVICE );
+    zone.getHomeUuid().save( _writer );
+    zone.getZoneUuid().save( _writer );
+    device.getUuid().save( _writer );
+    device.save( _writer );
+
+    store( 'd', _devices, TopicRouter::hashKey( zone.getHomeUuid(), zone.getZoneUuid(), &device.getUuid() ) );
+}
+
+void ConfigSnapshot::removeZone( const Uuid &homeId, const Uuid &zoneId )
+{
+    std::vector<uint8_t> data;
+
+    if( _restoring || !open() ) {
+        return;
+    }
+
+    erase( 'z', _zones, TopicRouter::hashKey( homeId, zoneId ) );
+
+    // the devices of the zone go with it
+    for( size_t index = _devices.size(); index-- > 0; ) {
+        Uuid home;
+        Uuid zone;
+
+        if( fetch( 'd', _devices[index], data ) ) {
+            SnapshotReader reader( data.data(), data.size() );
+            reader.get8();
+            reader.get8();
+            home.load( reader );
+            zone.load( reader );
+            if( home != homeId || zone != zoneId ) {
+                continue;
+            }
+        }
+
+        erase( 'd', _devices, _devices[index] );
+    }
+}
+
+void ConfigSnapshot::removeDevice( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId )
+{
+    if( _restoring || !open() ) {
+        return;
+    }
+
+    erase( 'd', _devices, TopicRouter::hashKey( homeId, zoneId, &deviceId ) );
+}
+
+void ConfigSnapshot::restoreZone( MQTTClient &client, uint32_t key, std::vector<uint8_t> &data )
+{
+    char homeId[Uuid::LENGTH + 1];
+    char zoneId[Uuid::LENGTH + 1];
+    Uuid home;
+    Uuid zone;
+    ZoneConfig config;
+
+    SnapshotReader reader( data.data(), data.size() );
+    if( reader.get8() != VERSION || reader.get8() != ZONE ) {
+        ESP_LOGW( TAG, "Discarding zone snapshot %08x of another version", key );
+        return;
+    }
+
+    home.load( reader );
+    zone.load( reader );
+    if( !config.load( reader ) ) {
+        ESP_LOGW( TAG, "Discarding damaged zone snapshot %08x", key );
+        return;
+    }
+
+    home.format( homeId );
+    zone.format( zoneId );
+    client.addZone( homeId, zoneId );
+
+    Zone *restored = client.getZone( homeId, zoneId );
+    if( restored ) {
+        ESP_LOGI( TAG, "Restoring zone %s/%s", homeId, zoneId );
+        restored->configureZone( config );
+    }
+}
+
+void ConfigSnapshot::restoreDevice( MQTTClient &client, uint32_t key, std::vector<uint8_t> &data )
+{
+    char homeId[Uuid::LENGTH + 1];
+    char zoneId[Uuid::LENGTH + 1];
+    char deviceId[Uuid::LENGTH + 1];
+    Uuid home;
+    Uuid zone;
+    Uuid device;
+    DeviceConfig config;
+
+    SnapshotReader reader( data.data(), data.size() );
+    if( reader.get8() != VERSION || reader.get8() != DEVICE ) {
+        ESP_LOGW( TAG, "Discarding device snapshot %08x of another version", key );
+        return;
+    }
+
+    home.load( reader );
+    zone.load( reader );
+    device.load( reader );
+    if( !config.load( reader ) ) {
+        ESP_LOGW( TAG, "Discarding damaged device snapshot %08x", key );
+        return;
+    }
+
+    Zone *restored = client.getZone( home.format( homeId ), zone.format( zoneId ) );
+    if( restored ) {
+        ESP_LOGI( TAG, "Restoring device %s", device.format( deviceId ) );
+        restored->configureZoneDevice( deviceId, config );
+    }
+}
+
+void ConfigSnapshot::restore( MQTTClient &client )
+{
+    std::vector<uint8_t> data;
+
+    if( !open() ) {
+        return;
+    }
+
+    ESP_LOGI( TAG, "Restoring %u zones and %u devices", (unsigned)_zones.size(), (unsigned)_devices.size() );
+
+    // applying the config must not save it straight back
+    _restoring = true;
+    for( size_t index = 0; index < _zones.size(); ++index ) {
+        if( fetch( 'z', _zones[index], data ) ) {
+            restoreZone( client, _zones[index], data );
+        }
+    }
+    for( size_t index = 0; index < _devices.size(); ++index ) {
+        if( fetch( 'd', _devices[index], data ) ) {
+            restoreDevice( client, _devices[index], data );
+        }
+    }
+    _restoring = false;
+}
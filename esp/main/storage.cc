@@ -0,0 +1,35 @@
+#include "autohome.h"
+
+static const char *TAG = "storage";
+
+PartitionStorage::PartitionStorage()
+    : _partition( NULL )
+{
+}
+
+bool PartitionStorage::open( const char *label )
+{
+    _partition = esp_partition_find_first( ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label );
+    if( _partition == NULL ) {
+        ESP_LOGW( TAG, "Partition %s not found", label );
+        return false;
+    }
+
+    ESP_LOGI( TAG, "Partition %s: %u bytes at 0x%x", label, _partition->size, _partition->address );
+    return true;
+}
+
+bool PartitionStorage::read( size_t offset, void *data, size_t len )
+{
+    return _partition != NULL && esp_partition_read( _partition, offset, data, len ) == ESP_OK;
+}
+
+bool PartitionStorage::write( size_t offset, const void *data, size_t len )
+{
+    return _partition != NULL && esp_partition_write( _partition, offset, data, len ) == ESP_OK;
+}
+
+bool PartitionStorage::erase( size_t offset, size_t len )
+{
+    return _partition != NULL && esp_partition_erase_range( _partition, offset, len ) == ESP_OK;
+}
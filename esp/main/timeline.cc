@@ -0,0 +1,288 @@
+#include "autohome.h"
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+
+static const char *TAG = "timeline";
+
+static const uint32_t MINUTES_PER_DAY = 24 * 60;
+static const uint32_t MINUTES_PER_WEEK = 7 * MINUTES_PER_DAY;
+
+static uint32_t rankOf( uint32_t index, uint32_t position )
+{
+    return ( ( index + 1 ) << 16 ) | std::min<uint32_t>( position, 0xffff );
+}
+
+static bool compareOverride( const Override &first, const Override &second )
+{
+    return first.getStart() < second.getStart() || (
+        first.getStart() == second.getStart() && first.getEnd() < second.getEnd() );
+}
+
+void OverrideIndex::assign( OverrideList &overrides )
+{
+    _overrides.swap( overrides );
+    overrides.clear();
+
+    // stable, so that of two overrides for the same time the later still wins
+    std::stable_sort( _overrides.begin(), _overrides.end(), compareOverride );
+}
+
+size_t OverrideIndex::prune( time_t now )
+{
+    size_t size = _overrides.size();
+
+    _overrides.erase( std::remove_if( _overrides.begin(), _overrides.end(),
+        [now](const Override &o) {
+            return o.getEnd() <= now;
+        }), _overrides.end() );
+
+    return size - _overrides.size();
+}
+
+size_t OverrideIndex::started( time_t now ) const
+{
+    return std::upper_bound( _overrides.cbegin(), _overrides.cend(), now,
+        [](time_t t, const Override &o) {
+            return t < o.getStart();
+        }) - _overrides.cbegin();
+}
+
+bool OverrideIndex::nextBoundary( time_t now, time_t &next ) const
+{
+    size_t first = started( now );
+    bool found = first < _overrides.size();
+
+    if( found ) {
+        next = _overrides[first].getStart();
+    }
+
+    for( size_t index = 0; index < first; ++index ) {
+        time_t end = _overrides[index].getEnd();
+        if( end > now && ( !found || end < next ) ) {
+            next = end;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+TargetTimeline::TargetTimeline()
+    : _schedules( NULL ), _overrides( NULL ), _segment( 0 ), _validFrom( 0 ), _validUntil( 0 )
+{
+}
+
+size_t TargetTimeline::addKey( const DeviceTarget &target )
+{
+    uint32_t hash = TopicRouter::hashKey( target.getHomeId(), target.getZoneId(), &target.getDeviceId() );
+
+    auto range = _index.equal_range( hash );
+    for( auto it = range.first; it != range.second; ++it ) {
+        if( _keys[it->second]->sameKey( target ) ) {
+            return it->second;
+        }
+    }
+
+    _keys.push_back( &target );
+    _index.emplace( hash, _keys.size() - 1 );
+    return _keys.size() - 1;
+}
+
+bool TargetTimeline::findKey( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type, size_t &key ) const
+{
+    auto range = _index.equal_range( TopicRouter::hashKey( homeId, zoneId, &deviceId ) );
+    for( auto it = range.first; it != range.second; ++it ) {
+        const DeviceTarget *target = _keys[it->second];
+        if( target->getType() == type && target->getDeviceId() == deviceId &&
+            target->getZoneId() == zoneId && target->getHomeId() == homeId ) {
+            key = it->second;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void TargetTimeline::compile( const ScheduleList &schedules, const OverrideIndex &overrides )
+{
+    _schedules = &schedules;
+    _overrides = &overrides;
+
+    _keys.clear();
+    _index.clear();
+    _segments.clear();
+    _scheduleSlots.clear();
+    _overrideSlots.clear();
+
+    for( ScheduleList::const_iterator s = schedules.cbegin(); s != schedules.cend(); ++s ) {
+        const DeviceTargetList &targets = s->getTargets();
+        for( DeviceTargetList::const_iterator t = targets.cbegin(); t != targets.cend(); ++t ) {
+            addKey( *t );
+        }
+    }
+    for( OverrideIndex::const_iterator o = overrides.cbegin(); o != overrides.cend(); ++o ) {
+        const DeviceTargetList &targets = o->getTargets();
+        for( DeviceTargetList::const_iterator t = targets.cbegin(); t != targets.cend(); ++t ) {
+            addKey( *t );
+        }
+    }
+
+    for( int day = 0; day < 7; ++day ) {
+        compileDay( day );
+    }
+
+    // the next lookup works out where in the week it is
+    _validFrom = _validUntil = 0;
+
+    ESP_LOGD( TAG, "Compiled %u targets into %u segments", (unsigned)_keys.size(), (unsigned)_segments.size() );
+}
+
+void TargetTimeline::compileDay( int day )
+{
+    Segment segment;
+    Slot empty = { NULL, 0 };
+    uint32_t index = 0;
+
+    // a schedule lasts until the end of its day at most
+    segment.minute = day * MINUTES_PER_DAY;
+    segment.slots = _scheduleSlots.size();
+    _segments.push_back( segment );
+    _scheduleSlots.resize( _scheduleSlots.size() + _keys.size(), empty );
+
+    // schedules are kept in order of their start time
+    for( ScheduleList::const_iterator s = _schedules->cbegin(); s != _schedules->cend(); ++s, ++index ) {
+        uint32_t minute = s->getHour() * 60 + s->getMinute();
+        if( !( s->getDays() & BIT( day ) ) || minute >= MINUTES_PER_DAY ) {
+            continue;
+        }
+
+        minute += day * MINUTES_PER_DAY;
+        if( minute != _segments.back().minute ) {
+            size_t previous = _segments.back().slots;
+
+            segment.minute = minute;
+            segment.slots = _scheduleSlots.size();
+            _segments.push_back( segment );
+            _scheduleSlots.resize( _scheduleSlots.size() + _keys.size() );
+            std::copy( _scheduleSlots.begin() + previous, _scheduleSlots.begin() + previous + _keys.size(),
+                       _scheduleSlots.begin() + segment.slots );
+        }
+
+        Slot *slots = &_scheduleSlots[_segments.back().slots];
+        const DeviceTargetList &targets = s->getTargets();
+        uint32_t position = 0;
+        for( DeviceTargetList::const_iterator t = targets.cbegin(); t != targets.cend(); ++t, ++position ) {
+            size_t key = addKey( *t );
+            uint32_t rank = rankOf( index, position );
+            if( rank > slots[key].rank ) {
+                slots[key].target = &(*t);
+                slots[key].rank = rank;
+            }
+        }
+    }
+}
+
+void TargetTimeline::refresh( time_t now )
+{
+    struct tm tmnow;
+    Slot empty = { NULL, 0 };
+
+    localtime_r( &now, &tmnow );
+    uint32_t minute = tmnow.tm_wday * MINUTES_PER_DAY + tmnow.tm_hour * 60 + tmnow.tm_min;
+    time_t minuteStart = now - tmnow.tm_sec;
+
+    _segment = 0;
+    while( _segment + 1 < _segments.size() && _segments[_segment + 1].minute <= minute ) {
+        ++_segment;
+    }
+
+    uint32_t nextMinute = _segment + 1 < _segments.size() ? _segments[_segment + 1].minute : MINUTES_PER_WEEK;
+    _validFrom = now;
+    _validUntil = minuteStart + ( nextMinute - minute ) * 60;
+
+    // local time can jump, so what it will be more than an hour from now is
+    // not worked out in advance
+    time_t hour = minuteStart - tmnow.tm_min * 60 + 3600;
+    if( hour < _validUntil ) {
+        _validUntil = hour;
+    }
+
+    _overrideSlots.assign( _keys.size(), empty );
+    size_t started = _overrides->started( now );
+    for( size_t index = 0; index < started; ++index ) {
+        const Override &o = (*_overrides)[index];
+        if( o.getEnd() <= now ) {
+            continue;
+        }
+
+        const DeviceTargetList &targets = o.getTargets();
+        uint32_t position = 0;
+        for( DeviceTargetList::const_iterator t = targets.cbegin(); t != targets.cend(); ++t, ++position ) {
+            size_t key;
+            findKey( t->getHomeId(), t->getZoneId(), t->getDeviceId(), t->getType(), key );
+            uint32_t rank = rankOf( index, position );
+            if( rank > _overrideSlots[key].rank ) {
+                _overrideSlots[key].target = &(*t);
+                _overrideSlots[key].rank = rank;
+            }
+        }
+    }
+
+    time_t next;
+    if( _overrides->nextBoundary( now, next ) && next < _validUntil ) {
+        _validUntil = next;
+    }
+
+    ESP_LOGD( TAG, "Targets from segment %u valid until %ld", (unsigned)_segment, _validUntil );
+}
+
+const DeviceTarget *TargetTimeline::best( const Slot *slots, bool hasExact, size_t exact, bool hasAny, size_t any ) const
+{
+    const Slot *slot = hasExact ? &slots[exact] : NULL;
+
+    // a target without a type applies to every type of the device
+    if( hasAny && slots[any].target && ( !slot || !slot->target || slots[any].rank > slot->rank ) ) {
+        slot = &slots[any];
+    }
+
+    return slot ? slot->target : NULL;
+}
+
+time_t TargetTimeline::nextBoundary( time_t now )
+{
+    if( now < _validFrom || now >= _validUntil ) {
+        refresh( now );
+    }
+
+    return _validUntil;
+}
+
+const DeviceTarget *TargetTimeline::find( time_t now, const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type )
+{
+    size_t exact = 0;
+    size_t any = 0;
+
+    if( _keys.empty() ) {
+        return NULL;
+    }
+
+    // a type we do not know only matches targets without one
+    bool hasExact = type != READING_OTHER && type != READING_ANY && findKey( homeId, zoneId, deviceId, type, exact );
+    bool hasAny = findKey( homeId, zoneId, deviceId, READING_ANY, any );
+    if( !hasExact && !hasAny ) {
+        return NULL;
+    }
+
+    if( now < _validFrom || now >= _validUntil ) {
+        refresh( now );
+    }
+
+    // any override in effect beats the schedules
+    const DeviceTarget *target = best( _overrideSlots.data(), hasExact, exact, hasAny, any );
+    if( !target ) {
+        target = best( &_scheduleSlots[_segments[_segment].slots], hasExact, exact, hasAny, any );
+    }
+
+    return target;
+}
@@ -115,7 +115,8 @@ uint32_t Flasher::nextDelay()
 }
 
 Switch::Switch( Zone &zone, const char *id )
-    : Device( zone, id ), _toggle( (gpio_num_t)-1 )
+    : Device( zone, id ), _toggle( (gpio_num_t)-1 ), _changed( false ), _lastChange( 0 ),
+      _hasPending( false ), _pending( false ), _suppressed( 0 )
 {
 }
 
@@ -128,16 +129,111 @@ esp_err_t Switch::init( gpio_num_t pin )
     return _toggle.init( pin );
 }
 
-void Switch::on()
+bool Switch::on()
 {
-    getZone().sendZoneLog( ESP_LOG_DEBUG, TAG, "Switch::on %d", getId() );
-    _toggle.on();
-    getZone().setValue( getId(), "switch", true );
+    return request( true );
 }
 
-void Switch::off()
+bool Switch::off()
 {
-    getZone().sendZoneLog( ESP_LOG_DEBUG, TAG, "Switch::off %d", getId() );
-    _toggle.off();
-    getZone().setValue( getId(), "switch", false );
+    return request( false );
+}
+
+TickType_t Switch::holdTime()
+{
+    TickType_t now = xTaskGetTickCount();
+    TickType_t wait = 0;
+
+    // stay in the current state for at least its minimum time
+    if( _changed ) {
+        TickType_t dwell = pdMS_TO_TICKS( _toggle.isOn() ? _limits.minOnTime : _limits.minOffTime );
+        if( now - _lastChange < dwell ) {
+            wait = dwell - ( now - _lastChange );
+        }
+    }
+
+    if( _limits.maxPerHour > 0 ) {
+        TickType_t hour = pdMS_TO_TICKS( 3600000 );
+        while( !_history.empty() && now - _history.front() >= hour ) {
+            _history.erase( _history.begin() );
+        }
+
+        if( _history.size() >= _limits.maxPerHour ) {
+            TickType_t oldest = _history[_history.size() - _limits.maxPerHour];
+            TickType_t until = hour - ( now - oldest );
+            if( until > wait ) {
+                wait = until;
+            }
+        }
+    }
+
+    return wait;
+}
+
+bool Switch::request( bool on )
+{
+    if( on == _toggle.isOn() ) {
+        // the reading came back before the held change could be made
+        if( _hasPending ) {
+            getZone().sendZoneLog( ESP_LOG_INFO, TAG, "Switch %s no longer needs to turn %s", getId(), on ? "OFF" : "ON" );
+            _hasPending = false;
+        }
+        return false;
+    }
+
+    TickType_t wait = holdTime();
+    if( wait == 0 ) {
+        _hasPending = false;
+        return apply( on );
+    }
+
+    // published once for each change held back, not for every reading that
+    // asks for it again while it is
+    if( !_hasPending || _pending != on ) {
+        ++_suppressed;
+        getZone().sendZoneLog( ESP_LOG_WARN, TAG, "Switch %s held %s for %u ms more, %u changes held back so far",
+                               getId(), on ? "OFF" : "ON", wait * portTICK_PERIOD_MS, _suppressed );
+    }
+    _hasPending = true;
+    _pending = on;
+    getZone().scheduleActuation();
+    return false;
+}
+
+bool Switch::apply( bool on )
+{
+    getZone().sendZoneLog( ESP_LOG_DEBUG, TAG, "Switch::%s %s", on ? "on" : "off", getId() );
+
+    _changed = true;
+    _lastChange = xTaskGetTickCount();
+    if( _limits.maxPerHour > 0 ) {
+        _history.push_back( _lastChange );
+        if( _history.size() > _limits.maxPerHour ) {
+            _history.erase( _history.begin() );
+        }
+    }
+
+    // the pin is only driven, and the state only reported, when it changes
+    if( on ) {
+        _toggle.on();
+    } else {
+        _toggle.off();
+    }
+    getZone().setValue( getUuid(), READING_SWITCH, on );
+    return true;
+}
+
+TickType_t Switch::pendingDelay()
+{
+    return _hasPending ? holdTime() : portMAX_DELAY;
+}
+
+bool Switch::applyPending()
+{
+    if( !_hasPending || holdTime() > 0 ) {
+        return false;
+    }
+
+    _hasPending = false;
+    return apply( _pending );
 }
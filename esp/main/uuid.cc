@@ -0,0 +1,125 @@
+#include "autohome.h"
+#include <string.h>
+
+static const char *TAG = "uuid";
+
+static const char *readingTypes[] = { "", "temperature", "humidity", "humidex", "switch" };
+
+static int hexValue( char c )
+{
+    if( c >= '0' && c <= '9' ) {
+        return c - '0';
+    } else if( c >= 'a' && c <= 'f' ) {
+        return c - 'a' + 10;
+    } else if( c >= 'A' && c <= 'F' ) {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+bool Uuid::parse( const char *id )
+{
+    bool upper = false;
+    bool lower = false;
+    size_t nibble = 0;
+
+    memset( _words, 0, sizeof( _words ) );
+    _upper = false;
+
+    if( id == NULL || *id == '\0' ) {
+        return true;
+    }
+
+    for( size_t i = 0; i < LENGTH; ++i ) {
+        if( i == 8 || i == 13 || i == 18 || i == 23 ) {
+            if( id[i] != '-' ) {
+                break;
+            }
+            continue;
+        }
+
+        int value = hexValue( id[i] );
+        if( value < 0 ) {
+            break;
+        }
+        upper = upper || ( id[i] >= 'A' && id[i] <= 'F' );
+        lower = lower || ( id[i] >= 'a' && id[i] <= 'f' );
+
+        _words[nibble / 8] |= (uint32_t)value << ( 28 - ( nibble % 8 ) * 4 );
+        ++nibble;
+    }
+
+    if( nibble != 32 || id[LENGTH] != '\0' ) {
+        ESP_LOGW( TAG, "Id %s is not a UUID", id );
+        memset( _words, 0, sizeof( _words ) );
+        return false;
+    }
+
+    _upper = upper && !lower;
+    return true;
+}
+
+const char *Uuid::format( char *buffer ) const
+{
+    const char *digits = _upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char *out = buffer;
+
+    if( isNil() ) {
+        buffer[0] = '\0';
+        return buffer;
+    }
+
+    for( size_t nibble = 0; nibble < 32; ++nibble ) {
+        if( nibble == 8 || nibble == 12 || nibble == 16 || nibble == 20 ) {
+            *out++ = '-';
+        }
+        *out++ = digits[( _words[nibble / 8] >> ( 28 - ( nibble % 8 ) * 4 ) ) & 0xf];
+    }
+    *out = '\0';
+
+    return buffer;
+}
+
+void Uuid::save( SnapshotWriter &writer ) const
+{
+    for( int i = 0; i < 4; ++i ) {
+        writer.put32( _words[i] );
+    }
+    writer.put8( _upper );
+}
+
+void Uuid::load( SnapshotReader &reader )
+{
+    for( int i = 0; i < 4; ++i ) {
+        _words[i] = reader.get32();
+    }
+    _upper = reader.get8() != 0;
+}
+
+uint32_t Uuid::hash( uint32_t hash ) const
+{
+    // FNV-1a, a byte at a time
+    for( int i = 0; i < 4; ++i ) {
+        for( int shift = 24; shift >= 0; shift -= 8 ) {
+            hash = ( hash ^ ( ( _words[i] >> shift ) & 0xff ) ) * 16777619u;
+        }
+    }
+
+    return hash;
+}
+
+ReadingType readingType( const char *type )
+{
+    for( size_t i = 0; i < sizeof( readingTypes ) / sizeof( readingTypes[0] ); ++i ) {
+        if( strcmp( type, readingTypes[i] ) == 0 ) {
+            return (ReadingType)i;
+        }
+    }
+
+    return READING_OTHER;
+}
+
+const char *readingTypeName( ReadingType type )
+{
+    return type < READING_OTHER ? readingTypes[type] : "other";
+}
@@ -3,12 +3,57 @@
 #include <stdlib.h>
 #include <time.h>
 #include <ctime>
+#include <math.h>
 #include <algorithm>
 
 static const char *TAG = "zone";
 
+static void frameTimerCallback( TimerHandle_t timer )
+{
+    Zone *zone = (Zone*)pvTimerGetTimerID( timer );
+    zone->flushReadings();
+}
+
+// restored config can be applied before SNTP has set the clock, when it is
+// still early 1970 and no schedule says anything about the time
+static const time_t CLOCK_SET = 1577836800;
+static const uint32_t CLOCK_POLL_INTERVAL = 5000;
+
+static void transitionTimerCallback( TimerHandle_t timer )
+{
+    Zone *zone = (Zone*)pvTimerGetTimerID( timer );
+    zone->applyTransitions();
+}
+
+static void actuationTimerCallback( TimerHandle_t timer )
+{
+    Zone *zone = (Zone*)pvTimerGetTimerID( timer );
+    zone->applyActuations();
+}
+
+static void syncTimerCallback( TimerHandle_t timer )
+{
+    xSemaphoreGive( (SemaphoreHandle_t)pvTimerGetTimerID( timer ) );
+}
+
+// Returns once the timer task has worked through every command queued
+// before the call, and so has also finished any callback it was running.
+static void syncTimerTask()
+{
+    SemaphoreHandle_t done = xSemaphoreCreateBinary();
+    TimerHandle_t timer = xTimerCreate( "sync", 1, pdFALSE, done, &syncTimerCallback );
+
+    xTimerStart( timer, portMAX_DELAY );
+    xSemaphoreTake( done, portMAX_DELAY );
+    xTimerDelete( timer, portMAX_DELAY );
+    vSemaphoreDelete( done );
+}
+
 Zone::Zone( MQTTClient &client, const char *homeId, const char *zoneId )
-    : _client( client )
+    : _client( client ), _heldChanged( false ), _encoding( ENCODING_JSON ), _logLevel( (esp_log_level_t)CONFIG_AUTOHOME_REMOTE_LOG_LEVEL ),
+      _logBinary( false ), _aggregate( AGGREGATE_NONE ), _frame( NULL ),
+      _frameTimer( NULL ), _frameLock( xSemaphoreCreateMutex() ), _transitionTimer( NULL ),
+      _actuationTimer( NULL ), _lock( xSemaphoreCreateRecursiveMutex() ), _closing( false )
 {
     if( homeId ) {
         strncpy( _homeId, homeId, sizeof( _homeId ) - 1 );
@@ -23,6 +68,10 @@ Zone::Zone( MQTTClient &client, const char *homeId, const char *zoneId )
     } else {
         _zoneId[0] = '\0';
     }
+
+    _homeUuid.parse( _homeId );
+    _zoneUuid.parse( _zoneId );
+    _remote.reserve( CONFIG_AUTOHOME_REMOTE_READINGS );
     
     sendZoneLog( ESP_LOG_DEBUG, TAG, "Created zone with home %s and zone %s", _homeId, _zoneId );
 }
@@ -30,13 +79,43 @@ Zone::Zone( MQTTClient &client, const char *homeId, const char *zoneId )
 Zone::~Zone()
 {
     clearDevices();
+
+    // a callback that starts from here on leaves the timers alone; one that
+    // already holds a lock has queued whatever it does to them by the time
+    // the lock is given back
+    xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
+    xSemaphoreTake( _frameLock, portMAX_DELAY );
+    _closing = true;
+    xSemaphoreGive( _frameLock );
+    xSemaphoreGiveRecursive( _lock );
+
+    if( _frameTimer ) {
+        xTimerDelete( _frameTimer, portMAX_DELAY );
+    }
+    if( _transitionTimer ) {
+        xTimerDelete( _transitionTimer, portMAX_DELAY );
+    }
+    if( _actuationTimer ) {
+        xTimerDelete( _actuationTimer, portMAX_DELAY );
+    }
+
+    // a callback may still be running, or due, until the timer task has
+    // dealt with the deletes
+    syncTimerTask();
+
+    delete _frame;
+    vSemaphoreDelete( _frameLock );
+    vSemaphoreDelete( _lock );
 }
 
 void Zone::addDevice( Device *device )
 {
+    xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
     if( findDevice( device->getId() ) == NULL ) {
-        _devices.push_front( device );
+        _devices.push_back( device );
+        indexActuators();
     }
+    xSemaphoreGiveRecursive( _lock );
 }
 
 void Zone::removeDevice( const char *deviceId )
@@ -48,8 +127,26 @@ void Zone::removeDevice( const char *deviceId )
         });
 
     if( it != _devices.end() ) {
-        delete *it;
+        Device *device = *it;
+
+        // readings on other tasks must not find it in the index once it is gone
+        xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
         _devices.erase( it );
+        indexActuators();
+        xSemaphoreGiveRecursive( _lock );
+
+        // a sensor waits for a reading in progress, which takes the lock
+        delete device;
+    }
+}
+
+void Zone::discardDevice( Device *device )
+{
+    // a device that failed to re-initialize may already be in the list
+    if( findDevice( device->getId() ) == device ) {
+        removeDevice( device->getId() );
+    } else {
+        delete device;
     }
 }
 
@@ -68,12 +165,45 @@ Device *Zone::findDevice( const char *deviceId )
     return NULL;
 }
 
+Device *Zone::findDevice( const Uuid &deviceId )
+{
+    DeviceList::iterator it = std::find_if(
+        _devices.begin(), _devices.end(),
+        [&deviceId](const Device *device) {
+            return device->getUuid() == deviceId;
+        });
+
+    if( it != _devices.end() ) {
+        return *it;
+    }
+
+    return NULL;
+}
+
+bool Zone::getCalibration( Device *device, ReadingType type, DeviceCalibration &calibration )
+{
+    xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
+    const DeviceCalibration *found = device->findCalibration( type );
+    if( found ) {
+        calibration = *found;
+    }
+    xSemaphoreGiveRecursive( _lock );
+
+    return found != NULL;
+}
+
 void Zone::clearDevices()
 {
-    for( DeviceList::iterator device = _devices.begin(); device != _devices.end(); ++device ) {
+    DeviceList devices;
+
+    xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
+    _devices.swap( devices );
+    indexActuators();
+    xSemaphoreGiveRecursive( _lock );
+
+    for( DeviceList::iterator device = devices.begin(); device != devices.end(); ++device ) {
         delete *device;
     }
-    _devices.clear();
 }
 
 bool compareSchedule( const Schedule &first, const Schedule &second )
@@ -82,32 +212,34 @@ bool compareSchedule( const Schedule &first, const Schedule &second )
         first.getHour() == second.getHour() && first.getMinute() < second.getMinute() );
 }
 
-void Zone::addSchedule( cJSON *json )
+void Zone::setSchedules( ScheduleList &schedules )
 {
-    _schedules.emplace_front( json, _homeId, _zoneId );
-    _schedules.sort( compareSchedule );
+    _schedules.swap( schedules );
+    // stable, so that of two schedules for the same time the later still wins
+    std::stable_sort( _schedules.begin(), _schedules.end(), compareSchedule );
+    _timeline.compile( _schedules, _overrides );
 }
 
 void Zone::clearSchedules()
 {
     _schedules.clear();
+    _timeline.compile( _schedules, _overrides );
 }
 
-bool compareOverride( const Override &first, const Override &second )
+void Zone::setOverrides( OverrideList &overrides )
 {
-    return first.getStart() < second.getStart() || (
-        first.getStart() == second.getStart() && first.getEnd() < second.getEnd() );
-}
+    time_t now;
+    time( &now );
 
-void Zone::addOverride( cJSON *json )
-{
-    _overrides.emplace_front( json, _homeId, _zoneId );
-    _overrides.sort( compareOverride );
+    _overrides.assign( overrides );
+    _overrides.prune( now );
+    _timeline.compile( _schedules, _overrides );
 }
 
 void Zone::clearOverrides()
 {
     _overrides.clear();
+    _timeline.compile( _schedules, _overrides );
 }
 
 Device* Zone::getDevice( const char *deviceId )
@@ -124,607 +256,1185 @@ Device* Zone::getDevice( const char *deviceId )
     return NULL;
 }
 
-bool Zone::matches( const char *home, const char *zone ) const
+bool Zone::matches( const Uuid &home, const Uuid &zone ) const
 {
-    return( strcmp( home, _homeId ) == 0 && strcmp( zone, _zoneId ) == 0 );
+    return( home == _homeUuid && zone == _zoneUuid );
 }
 
-bool Zone::matchesZone( const char **path, size_t pathlen )
+bool Zone::dependsOn( const Uuid &home, const Uuid &zone, const Uuid &deviceId ) const
 {
-    if( pathlen < 4 ) {
-        return false;
+    for( DeviceList::const_iterator device = _devices.cbegin(); device != _devices.cend(); ++device ) {
+        const DeviceChangeList &changes = (*device)->getChanges();
+        for( DeviceChangeList::const_iterator change = changes.cbegin(); change != changes.cend(); ++change ) {
+            if( change->getHomeId() == home && change->getZoneId() == zone && change->getDeviceId() == deviceId ) {
+                return true;
+            }
+        }
     }
 
-    return( strcmp( path[0], "homes" ) == 0 && strcmp( path[1], _homeId ) == 0 &&
-            strcmp( path[2], "zones" ) == 0 && strcmp( path[3], _zoneId ) == 0 );
+    return false;
 }
 
-void Zone::configureZoneDeviceJSON( const char *deviceId, cJSON *json )
+void Zone::configureZoneDevice( const char *deviceId, DeviceConfig &config )
 {
-    cJSON *interface = cJSON_GetObjectItemCaseSensitive( json, "interface" );
-    if( !interface ) {
-        removeDevice( deviceId );
-        return;
-    }
+    Uuid deviceUuid;
 
-    cJSON *interfaceType = cJSON_GetObjectItemCaseSensitive( interface, "type" );
-    if( !interfaceType ) {
-        removeDevice( deviceId );
+    // a device whose id is not a UUID would alias any other such device
+    if( !deviceUuid.parseRequired( deviceId ) ) {
+        sendZoneLog( ESP_LOG_ERROR, TAG, "Refusing device %s, its id is not a UUID", deviceId );
         return;
     }
 
-    cJSON *interfaceAddress = cJSON_GetObjectItemCaseSensitive( interface, "address" );
-    if( !interfaceAddress ) {
+    if( config.type[0] == '\0' || config.address[0] == '\0' ) {
         removeDevice( deviceId );
+        _client.getSnapshot().removeDevice( _homeUuid, _zoneUuid, deviceUuid );
+        _client.updateRoutes();
         return;
     }
 
-    cJSON *interval = cJSON_GetObjectItemCaseSensitive( interface, "interval" );
-
     Device *device = findDevice( deviceId );
-    if( device && !device->is( interfaceType->valuestring ) ) {
+    bool existed = device != NULL;
+    bool replaced = false;
+    if( device && !device->is( config.type ) ) {
         removeDevice( deviceId );
         device = NULL;
+        replaced = true;
     }
+
+    // retained config arrives again on every reconnect; a device on the same
+    // hardware keeps its task and its state
+    bool reinit = device == NULL || !device->hasInterface( config.type, config.address );
     
-    if( strcmp( interfaceType->valuestring, "dht11" ) == 0 ) {
+    if( strcmp( config.type, "dht11" ) == 0 ) {
         if( !device ) {
             sendZoneLog( ESP_LOG_INFO, TAG, "Creating new DHT11 sensor" );
             device = new DHTSensor( *this, deviceId );
         }
-        sendZoneLog( ESP_LOG_INFO, TAG, "Initializing DHT11 sensor" );
-        esp_err_t res = ((DHTSensor*)device)->init( (gpio_num_t)atoi( interfaceAddress->valuestring ), DHT_TYPE_DHT11, false );
-        if( res != ESP_OK ) {
-            sendZoneLog( ESP_LOG_ERROR, TAG, "Failed to initialize device %s: %d", deviceId, res );
-            delete device;
-            device = NULL;
+        if( reinit ) {
+            sendZoneLog( ESP_LOG_INFO, TAG, "Initializing DHT11 sensor" );
+            esp_err_t res = ((DHTSensor*)device)->init( (gpio_num_t)atoi( config.address ), DHT_TYPE_DHT11, false );
+            if( res != ESP_OK ) {
+                sendZoneLog( ESP_LOG_ERROR, TAG, "Failed to initialize device %s: %d", deviceId, res );
+                discardDevice( device );
+                device = NULL;
+            }
         }
-    } else if( strcmp( interfaceType->valuestring, "dht22" ) == 0 ) {
+    } else if( strcmp( config.type, "dht22" ) == 0 ) {
         if( !device ) {
             sendZoneLog( ESP_LOG_INFO, TAG, "Creating new DHT22 sensor" );
             device = new DHTSensor( *this, deviceId );
         }
-        sendZoneLog( ESP_LOG_INFO, TAG, "Initializing DHT22 sensor" );
-        esp_err_t res = ((DHTSensor*)device)->init( (gpio_num_t)atoi( interfaceAddress->valuestring ), DHT_TYPE_AM2301, false );
-        if( res != ESP_OK ) {
-            sendZoneLog( ESP_LOG_ERROR, TAG, "Failed to initialize device %s: %d", deviceId, res );
-            delete device;
-            device = NULL;
+        if( reinit ) {
+            sendZoneLog( ESP_LOG_INFO, TAG, "Initializing DHT22 sensor" );
+            esp_err_t res = ((DHTSensor*)device)->init( (gpio_num_t)atoi( config.address ), DHT_TYPE_AM2301, false );
+            if( res != ESP_OK ) {
+                sendZoneLog( ESP_LOG_ERROR, TAG, "Failed to initialize device %s: %d", deviceId, res );
+                discardDevice( device );
+                device = NULL;
+            }
         }
-    } else if( strcmp( interfaceType->valuestring, "ds18x20" ) == 0 ) {
-        char *address = strdup( interfaceAddress->valuestring );
-
-        char *part = strsep( &address, ":" );
+    } else if( strcmp( config.type, "ds18x20" ) == 0 ) {
+        const char *addressPart = strchr( config.address, ':' );
 
-        gpio_num_t pin = (gpio_num_t)atoi( part );
+        gpio_num_t pin = (gpio_num_t)atoi( config.address );
         ds18x20_addr_t dsAddr = ds18x20_ANY;
 
-        part = strsep( &address, ":" );
-        if( part ) {
-            dsAddr = strtoull( part, NULL, 16 );
+        if( addressPart ) {
+            dsAddr = strtoull( addressPart + 1, NULL, 16 );
         }
 
         if( !device ) {
             sendZoneLog( ESP_LOG_INFO, TAG, "Creating new DS18x20 sensor" );
             device = new DS18X20Sensor( *this, deviceId );
-        } else {
+        } else if( reinit ) {
             ((DS18X20Sensor*)device)->setInterval( 0 );
         }
 
-        sendZoneLog( ESP_LOG_INFO, TAG, "Initializing DS18x20 sensor" );
-        esp_err_t res = ((DS18X20Sensor*)device)->init( pin, dsAddr );
-        if( res != ESP_OK ) {
-            sendZoneLog( ESP_LOG_ERROR, TAG, "Failed to initialize device %s: %d", deviceId, res );
-            delete device;
-            device = NULL;
+        if( reinit ) {
+            sendZoneLog( ESP_LOG_INFO, TAG, "Initializing DS18x20 sensor" );
+            esp_err_t res = ((DS18X20Sensor*)device)->init( pin, dsAddr );
+            if( res != ESP_OK ) {
+                sendZoneLog( ESP_LOG_ERROR, TAG, "Failed to initialize device %s: %d", deviceId, res );
+                discardDevice( device );
+                device = NULL;
+            }
         }
 
-        free( address );
-    } else if( strcmp( interfaceType->valuestring, "gpio" ) == 0 ) {
+        if( device != NULL ) {
+            ((DS18X20Sensor*)device)->setResolution( config.resolution );
+        }
+    } else if( strcmp( config.type, "gpio" ) == 0 ) {
         if( !device ) {
             sendZoneLog( ESP_LOG_INFO, TAG, "Creating new switch" );
             device = new Switch( *this, deviceId );
         }
-        sendZoneLog( ESP_LOG_INFO, TAG, "Initializing switch" );
-        esp_err_t res = ((Switch*)device)->init( (gpio_num_t)atoi( interfaceAddress->valuestring ) );
-        if( res != ESP_OK ) {
-            sendZoneLog( ESP_LOG_ERROR, TAG, "Failed to initialize device %s: %d", deviceId, res );
-            delete device;
-            device = NULL;
+        if( reinit ) {
+            sendZoneLog( ESP_LOG_INFO, TAG, "Initializing switch" );
+            esp_err_t res = ((Switch*)device)->init( (gpio_num_t)atoi( config.address ) );
+            if( res != ESP_OK ) {
+                sendZoneLog( ESP_LOG_ERROR, TAG, "Failed to initialize device %s: %d", deviceId, res );
+                discardDevice( device );
+                device = NULL;
+            }
         }
     } else {
-        sendZoneLog( ESP_LOG_WARN, TAG, "Unknown device type %s", interfaceType->valuestring );
+        sendZoneLog( ESP_LOG_WARN, TAG, "Unknown device type %s", config.type );
     }
 
-    if( device != NULL ) {
-        cJSON *changes = cJSON_GetObjectItemCaseSensitive( json, "changes" );
-        if( changes != NULL && cJSON_IsArray( changes ) ) {
-            device->clearChanges();
-            sendZoneLog( ESP_LOG_INFO, TAG, "Adding changes" );
-            int numChanges = cJSON_GetArraySize( changes );
-            for( int i = 0; i < numChanges; ++i ) {
-                sendZoneLog( ESP_LOG_INFO, TAG, "Adding change %d of %d", i, numChanges );
-                device->addChange( cJSON_GetArrayItem( changes, i ) );
-            }
+    if( device != NULL && reinit ) {
+        device->setInterface( config.type, config.address );
+    }
+
+    bool rerouted = !existed || replaced || device == NULL;
+
+    if( device != NULL && config.hasChanges ) {
+        xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
+        if( device->setChanges( config.changes ) ) {
+            sendZoneLog( ESP_LOG_INFO, TAG, "Set %u changes", (unsigned)device->getChanges().size() );
+            indexActuators();
+            rerouted = true;
         }
+        xSemaphoreGiveRecursive( _lock );
     }
 
-    if( device != NULL ) {
-        cJSON *calibrations = cJSON_GetObjectItemCaseSensitive( json, "calibrations" );
-        if( calibrations != NULL && cJSON_IsArray( calibrations ) ) {
-            device->clearCalibrations();
-            sendZoneLog( ESP_LOG_INFO, TAG, "Adding calibrations" );
-            int numCalibrations = cJSON_GetArraySize( calibrations );
-            for( int i = 0; i < numCalibrations; ++i ) {
-                sendZoneLog( ESP_LOG_INFO, TAG, "Adding calibration %d of %d", i, numCalibrations );
-                device->addCalibration( cJSON_GetArrayItem( calibrations, i ) );
-            }
+    if( device != NULL && config.hasCalibrations ) {
+        xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
+        if( device->setCalibrations( config.calibrations ) ) {
+            sendZoneLog( ESP_LOG_INFO, TAG, "Set %u calibrations", (unsigned)device->getCalibrations().size() );
         }
+        xSemaphoreGiveRecursive( _lock );
     }
 
     if( device != NULL ) {
-        if( interval != NULL && cJSON_IsNumber( interval ) ) {
-            sendZoneLog( ESP_LOG_INFO, TAG, "Setting update interval for device %s to %d", deviceId, interval->valueint );
-            device->setInterval( interval->valueint );
+        if( config.hasInterval ) {
+            device->setInterval( config.interval );
         } else {
-            sendZoneLog( ESP_LOG_INFO, TAG, "Setting update interval for device %s to default", deviceId );
             device->setInterval( 60000 );
         }
+        device->setLimits( config.limits );
     }
 
     if( device != NULL ) {
         addDevice( device );
+        _client.getSnapshot().saveDevice( *this, *device );
+    } else {
+        _client.getSnapshot().removeDevice( _homeUuid, _zoneUuid, deviceUuid );
     }
+
+    if( !rerouted ) {
+        sendZoneLog( ESP_LOG_DEBUG, TAG, "Device %s is unchanged", deviceId );
+        return;
+    }
+
+    _client.updateRoutes();
+
+    xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
+    evaluateRemoteValues();
+    xSemaphoreGiveRecursive( _lock );
+}
+
+void Zone::configureZone( ZoneConfig &config )
+{
+    sendZoneLog( ESP_LOG_INFO, TAG, "Configuring zone details for %s", _zoneId );
+
+    xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
+
+    if( config.hasLogLevel ) {
+        setLogLevel( config.logLevel );
+    }
+
+    if( config.hasLogFormat ) {
+        setLogBinary( config.logBinary );
+    }
+
+    if( config.hasAggregate ) {
+        setAggregation( config.aggregate );
+    }
+
+    if( config.hasSchedules ) {
+        setSchedules( config.schedules );
+    }
+
+    if( config.hasOverrides ) {
+        setOverrides( config.overrides );
+    }
+
+    if( config.hasHeld ) {
+        _held.swap( config.held );
+    }
+
+    // new targets apply to the remote readings we already hold
+    evaluateRemoteValues();
+
+    if( config.hasSchedules || config.hasOverrides ) {
+        scheduleTransition();
+    }
+
+    _heldChanged = false;
+    _client.getSnapshot().saveZone( *this );
+
+    xSemaphoreGiveRecursive( _lock );
+}
+
+void Zone::setRemoteValue( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type, const DeviceValue &value, double threshold )
+{
+    char device[Uuid::LENGTH + 1];
+    sendZoneLog( ESP_LOG_DEBUG, TAG, "Processing remote %s value %0.1f for device %s", readingTypeName( type ), value.value.doubleValue, deviceId.format( device ) );
+
+    xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
+    evaluateRemoteValue( cacheRemoteValue( homeId, zoneId, deviceId, type, value, threshold ) );
+    xSemaphoreGiveRecursive( _lock );
 }
 
-void Zone::configureZoneJSON( const char **path, size_t pathlen, cJSON *json )
+RemoteReading &Zone::cacheRemoteValue( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type, const DeviceValue &value, double threshold )
 {
-    bool local = matchesZone( path, pathlen );
+    TickType_t now = xTaskGetTickCount();
 
-    if( pathlen == 7 && strcmp( path[4], "devices" ) == 0 && path[5] != NULL && path[6] != NULL ) {
-        const char *deviceId = path[5];
-        const char *type = path[6];
-        bool isConfig = strcmp( type, "config" ) == 0;
+    RemoteReadingList::iterator it = std::find_if(
+        _remote.begin(), _remote.end(),
+        [&homeId, &zoneId, &deviceId, type](const RemoteReading &reading) {
+            return reading.matches( homeId, zoneId, deviceId, type );
+        });
 
-        if( local && isConfig ) {
-            sendZoneLog( ESP_LOG_INFO, TAG, "Configuring device with id %s", deviceId );
-            configureZoneDeviceJSON( deviceId, json );
-        } else if( !local && !isConfig ) {
-            setRemoteValueJSON( path[1], path[3], deviceId, type, json );
+    if( it == _remote.end() ) {
+        _remote.erase( std::remove_if( _remote.begin(), _remote.end(),
+                                       [now](const RemoteReading &reading) { return reading.stale( now ); } ),
+                       _remote.end() );
+
+        if( _remote.size() < CONFIG_AUTOHOME_REMOTE_READINGS ) {
+            _remote.emplace_back();
+            it = _remote.end() - 1;
+        } else {
+            // the reading updated longest ago makes way
+            it = std::min_element(
+                _remote.begin(), _remote.end(),
+                [now](const RemoteReading &first, const RemoteReading &second) {
+                    return now - first.time > now - second.time;
+                });
+
+            char device[Uuid::LENGTH + 1];
+            sendZoneLog( ESP_LOG_WARN, TAG, "Remote reading cache full, forgetting %s of device %s",
+                         readingTypeName( it->type ), it->deviceId.format( device ) );
         }
-    } else if( local && pathlen == 5 && strcmp( path[4], "config" ) == 0 ) {
-        sendZoneLog( ESP_LOG_INFO, TAG, "Configuring zone details for %s", _zoneId );
-        cJSON *schedules = cJSON_GetObjectItem( json, "schedules" );
-        if( schedules && cJSON_IsArray( schedules ) ) {
-            clearSchedules();
-            int numSchedules = cJSON_GetArraySize( schedules );
-            for( int i = 0; i < numSchedules; ++i ) {
-                addSchedule( cJSON_GetArrayItem( schedules, i ) );
-            }
+
+        it->homeId = homeId;
+        it->zoneId = zoneId;
+        it->deviceId = deviceId;
+        it->type = type;
+    }
+
+    it->value = value;
+    it->threshold = threshold;
+    it->time = now;
+    return *it;
+}
+
+const RemoteReading *Zone::findRemoteValue( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type ) const
+{
+    RemoteReadingList::const_iterator it = std::find_if(
+        _remote.cbegin(), _remote.cend(),
+        [&homeId, &zoneId, &deviceId, type](const RemoteReading &reading) {
+            return reading.matches( homeId, zoneId, deviceId, type );
+        });
+
+    if( it == _remote.cend() || it->stale( xTaskGetTickCount() ) ) {
+        return NULL;
+    }
+
+    return &(*it);
+}
+
+void Zone::evaluateRemoteValue( const RemoteReading &reading )
+{
+    const DeviceTarget *target = findDeviceTarget( reading.homeId, reading.zoneId, reading.deviceId, reading.type );
+
+    if( target ) {
+        takeAction( reading.homeId, reading.zoneId, reading.deviceId, reading.type, reading.value.value.doubleValue,
+                    reading.value.unit, target->doubleValue(), target->unit(), reading.threshold );
+    }
+}
+
+void Zone::evaluateRemoteValues()
+{
+    TickType_t now = xTaskGetTickCount();
+
+    for( RemoteReadingList::const_iterator it = _remote.cbegin(); it != _remote.cend(); ++it ) {
+        // a reading that stopped arriving no longer says anything about the room
+        if( !it->stale( now ) ) {
+            evaluateRemoteValue( *it );
         }
+    }
+}
 
-        cJSON *overrides = cJSON_GetObjectItem( json, "overrides" );
-        if( overrides && cJSON_IsArray( overrides ) ) {
-            clearOverrides();
-            int numOverrides = cJSON_GetArraySize( overrides );
-            for( int i = 0; i < numOverrides; ++i ) {
-                addOverride( cJSON_GetArrayItem( overrides, i ) );
-            }
+void Zone::sendDeviceReading( const Uuid &deviceId, ReadingType type, const Reading &reading )
+{
+    char topic[160];
+    char device[Uuid::LENGTH + 1];
+    uint8_t payload[256];
+    bool actuation = type == READING_SWITCH;
+
+    // switch states are what the rest of the system acts on, so they are
+    // never held back for a frame
+    if( !actuation && _aggregate != AGGREGATE_NONE ) {
+        queueReading( deviceId, type, reading );
+        if( _aggregate == AGGREGATE_ONLY ) {
+            return;
         }
     }
+
+    JSONWriter json( payload, sizeof( payload ) );
+    CBORWriter cbor( payload, sizeof( payload ) );
+    PayloadWriter &writer = _encoding == ENCODING_CBOR ? (PayloadWriter&)cbor : (PayloadWriter&)json;
+
+    reading.encode( writer );
+    if( writer.overflowed() ) {
+        ESP_LOGW( TAG, "%s reading for device %s does not fit in %u bytes", readingTypeName( type ), deviceId.format( device ), (unsigned)sizeof( payload ) );
+        return;
+    }
+
+    snprintf( topic, sizeof( topic ), "homes/%s/zones/%s/devices/%s/%s", _homeId, _zoneId, deviceId.format( device ), readingTypeName( type ) );
+
+    // switch states go ahead of telemetry in the publish queues too
+    _client.publish( topic, writer.data(), writer.length(), 1, true,
+                     actuation ? PUBLISH_ACTUATION : PUBLISH_TELEMETRY );
 }
 
-void Zone::setRemoteValueJSON( const char *homeId, const char *zoneId, const char *deviceId, const char *type, cJSON *json )
+void Zone::setAggregation( ReadingAggregation aggregate )
 {
-    sendZoneLog( ESP_LOG_DEBUG, TAG, "Processing remote %s value for home %s zone %s device %s", type, homeId, zoneId, deviceId );
+    xSemaphoreTake( _frameLock, portMAX_DELAY );
+
+    if( aggregate != AGGREGATE_NONE && _frame == NULL ) {
+        _frame = new ReadingFrame();
+        _frameTimer = xTimerCreate( "frame", pdMS_TO_TICKS( CONFIG_AUTOHOME_READING_FRAME_WINDOW ), pdFALSE, this, &frameTimerCallback );
+    } else if( aggregate == AGGREGATE_NONE && _frame != NULL ) {
+        publishFrame();
+        xTimerDelete( _frameTimer, portMAX_DELAY );
+        _frameTimer = NULL;
+        delete _frame;
+        _frame = NULL;
+    }
+    _aggregate = aggregate;
+
+    xSemaphoreGive( _frameLock );
 }
 
-void Zone::sendDeviceReadingJSON( const char *deviceId, const char *type, cJSON *value, cJSON *target, cJSON *threshold )
+void Zone::queueReading( const Uuid &deviceId, ReadingType type, const Reading &reading )
 {
-    time_t now;
-    struct tm gmnow;
-    char buf[ sizeof( "2011-10-08T07:07:09Z" ) ];
+    xSemaphoreTake( _frameLock, portMAX_DELAY );
 
-    time( &now );
-    strftime( buf, sizeof( buf ), "%FT%TZ", gmtime_r( &now, &gmnow ) );
-    
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddStringToObject( root, "time", buf );
+    if( _frame ) {
+        if( !_frame->add( deviceId, type, reading ) ) {
+            publishFrame();
+            _frame->add( deviceId, type, reading );
+        }
 
-    if( value ) {
-        cJSON_AddItemToObject( root, "value", value );
+        // the window opens with the first reading, later ones do not extend it
+        if( _frame->count() == 1 ) {
+            xTimerReset( _frameTimer, 0 );
+        }
     }
 
-    if( target ) {
-        cJSON_AddItemToObject( root, "target", target );
+    xSemaphoreGive( _frameLock );
+}
+
+void Zone::flushReadings()
+{
+    xSemaphoreTake( _frameLock, portMAX_DELAY );
+    if( _frame && !_closing ) {
+        publishFrame();
     }
+    xSemaphoreGive( _frameLock );
+}
+
+void Zone::publishFrame()
+{
+    char topic[128];
+    size_t first = 0;
 
-    if( threshold ) {
-        cJSON_AddItemToObject( root, "threshold", threshold );
+    snprintf( topic, sizeof( topic ), "homes/%s/zones/%s/readings", _homeId, _zoneId );
+    // the publish queue takes topic and payload, each with a terminator
+    size_t budget = CONFIG_AUTOHOME_PUBLISH_MAX_MESSAGE - strlen( topic ) - 1;
+
+    while( first < _frame->count() ) {
+        size_t count = _frame->count() - first;
+        size_t len = 0;
+
+        // split the frame when the readings do not fit in one message
+        while( count > 0 && ( len = _frame->encode( _encoding, budget, first, count ) ) == 0 ) {
+            --count;
+        }
+
+        if( count == 0 ) {
+            ESP_LOGW( TAG, "Reading %u does not fit in a frame, dropping", (unsigned)first );
+            ++first;
+            continue;
+        }
+
+        _client.publish( topic, _frame->payload(), len, 1, false, PUBLISH_TELEMETRY );
+        first += count;
     }
 
-    char *message = cJSON_PrintUnformatted( root );
-    cJSON_Delete( root );
+    _frame->clear();
+}
 
-    char *topic = (char*)malloc( 256 );
-    if( topic != NULL ) {
-        snprintf( topic, 255, "homes/%s/zones/%s/devices/%s/%s", _homeId, _zoneId, deviceId, type );
-        topic[255] = '\0';
+void Zone::save( SnapshotWriter &writer ) const
+{
+    writer.put8( _aggregate );
+    writer.put8( _logLevel );
+    writer.put8( _logBinary );
 
-        _client.publish( topic, message );
-        free( topic );
+    writer.put16( _schedules.size() );
+    for( ScheduleList::const_iterator schedule = _schedules.cbegin(); schedule != _schedules.cend(); ++schedule ) {
+        schedule->save( writer );
+    }
+
+    writer.put16( _overrides.size() );
+    for( OverrideIndex::const_iterator o = _overrides.cbegin(); o != _overrides.cend(); ++o ) {
+        o->save( writer );
+    }
+
+    writer.put16( _held.size() );
+    for( DeviceTargetList::const_iterator target = _held.cbegin(); target != _held.cend(); ++target ) {
+        target->save( writer );
     }
-    
-    free( message );
+}
+
+void Zone::setLogLevel( esp_log_level_t level )
+{
+    // the build decides what can ever be sent
+    _logLevel = level > CONFIG_AUTOHOME_REMOTE_LOG_LEVEL ? (esp_log_level_t)CONFIG_AUTOHOME_REMOTE_LOG_LEVEL : level;
 }
 
 void Zone::sendZoneLog( esp_log_level_t level, const char *tag, const char *format... ) const
 {
-    time_t now;
-    struct tm gmnow;
-    char timebuf[ sizeof( "2011-10-08T07:07:09Z" ) ];
+    bool local = level <= LOG_LOCAL_LEVEL;
+    bool remote = level <= CONFIG_AUTOHOME_REMOTE_LOG_LEVEL && level <= _logLevel;
+    char buffer[CONFIG_AUTOHOME_LOG_MESSAGE_SIZE];
+    uint32_t position = 0;
+    LogRecord *record = NULL;
     va_list args;
 
-    time( &now );
-    strftime( timebuf, sizeof( timebuf ), "%FT%TZ", gmtime_r( &now, &gmnow ) );
-    
-    cJSON *root = cJSON_CreateObject();
-    cJSON_AddStringToObject( root, "time", timebuf );
-    cJSON_AddStringToObject( root, "tag", tag );
-
-    switch( level ) {
-    case ESP_LOG_NONE:
-        cJSON_AddStringToObject( root, "level", "NONE" );
-        break;
-    case ESP_LOG_ERROR:
-        cJSON_AddStringToObject( root, "level", "ERROR" );
-        break;
-    case ESP_LOG_WARN:
-        cJSON_AddStringToObject( root, "level", "WARN" );
-        break;
-    case ESP_LOG_INFO:
-        cJSON_AddStringToObject( root, "level", "INFO" );
-        break;
-    case ESP_LOG_DEBUG:
-        cJSON_AddStringToObject( root, "level", "DEBUG" );
-        break;
-    case ESP_LOG_VERBOSE:
-        cJSON_AddStringToObject( root, "level", "VERBOSE" );
-        break;
-    default:
-        cJSON_AddStringToObject( root, "level", "UNKNOWN" );
-    };
+    if( !local && !remote ) {
+        return;
+    }
+
+    if( remote ) {
+        record = _client.getLog().reserve( position );
+    }
 
-    char *buffer = (char*)malloc( 512 );
-    if( buffer != NULL ) {
+    if( record && _logBinary ) {
+        // leave the formatting to the host
         va_start( args, format );
-        vsnprintf( buffer, 512, format, args );
+        record->length = packLogArguments( record->message, sizeof( record->message ), format, args );
         va_end( args );
+        record->binary = true;
+        record->format = format;
+        record->tagId = tag;
+    } else if( record ) {
+        va_start( args, format );
+        vsnprintf( record->message, sizeof( record->message ), format, args );
+        va_end( args );
+        record->binary = false;
+        strncpy( record->tag, tag, sizeof( record->tag ) - 1 );
+        record->tag[sizeof( record->tag ) - 1] = '\0';
+    }
 
-        esp_log_write( level, tag, buffer );
+    if( local ) {
+        const char *message = buffer;
+        if( record && !record->binary ) {
+            message = record->message;
+        } else {
+            va_start( args, format );
+            vsnprintf( buffer, sizeof( buffer ), format, args );
+            va_end( args );
+        }
+        esp_log_write( level, tag, "%s", message );
+    }
 
-        cJSON_AddStringToObject( root, "message", buffer );
-        free( buffer );
+    if( record ) {
+        time( &record->time );
+        record->uptime = esp_log_timestamp();
+        record->level = level;
+        strcpy( record->homeId, _homeId );
+        strcpy( record->zoneId, _zoneId );
+        _client.getLog().commit( position );
+    }
+}
+
+const DeviceTarget* Zone::findDeviceTarget( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type ) const
+{
+    char device[Uuid::LENGTH + 1];
+    time_t now;
+    time( &now );
+
+    if( now < CLOCK_SET ) {
+        // the schedules mean nothing yet, so keep to what they last said
+        DeviceTargetList::const_iterator it = std::find_if(
+            _held.cbegin(), _held.cend(),
+            [&homeId, &zoneId, &deviceId, type](const DeviceTarget &held) {
+                return held.getType() == type && held.getDeviceId() == deviceId &&
+                       held.getZoneId() == zoneId && held.getHomeId() == homeId;
+            });
+
+        sendZoneLog( ESP_LOG_DEBUG, TAG, "Clock not set, %s held target for %s of device %s", it != _held.cend() ? "using" : "no",
+                     readingTypeName( type ), deviceId.format( device ) );
+        return it != _held.cend() ? &(*it) : NULL;
+    }
+
+    const DeviceTarget *target = _timeline.find( now, homeId, zoneId, deviceId, type );
+    sendZoneLog( ESP_LOG_DEBUG, TAG, "%s target for %s of device %s at %ld", target ? "Found" : "No", readingTypeName( type ), deviceId.format( device ), now );
+    holdTarget( homeId, zoneId, deviceId, type, target );
+
+    return target;
+}
+
+void Zone::holdTarget( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type, const DeviceTarget *target ) const
+{
+    DeviceTargetList::iterator it = std::find_if(
+        _held.begin(), _held.end(),
+        [&homeId, &zoneId, &deviceId, type](const DeviceTarget &held) {
+            return held.getType() == type && held.getDeviceId() == deviceId &&
+                   held.getZoneId() == zoneId && held.getHomeId() == homeId;
+        });
+
+    if( !target ) {
+        if( it != _held.end() ) {
+            _held.erase( it );
+            _heldChanged = true;
+        }
+        return;
+    }
+
+    if( it != _held.end() && it->value() == target->value() ) {
+        return;
+    }
+
+    if( it == _held.end() ) {
+        _held.push_back( *target );
+        it = _held.end() - 1;
     } else {
-       cJSON_AddStringToObject( root, "message", "INSUFFICIENT MEMORY" );
+        *it = *target;
     }
 
-    char *message = cJSON_PrintUnformatted( root );
-    cJSON_Delete( root );
+    // a target without a type is held for the reading it was found for
+    it->setType( type );
+    _heldChanged = true;
+}
 
-    char *topic = (char*)malloc( 256 );
-    if( topic != NULL ) {
-        snprintf( topic, 255, "homes/%s/zones/%s/log", _homeId, _zoneId );
-        topic[255] = '\0';
+ReportedValue &Zone::lastReading( const Uuid &deviceId, ReadingType type )
+{
+    ReportedValueList::iterator it = std::find_if(
+        _reported.begin(), _reported.end(),
+        [&deviceId, type](const ReportedValue &reported) {
+            return reported.deviceId == deviceId && reported.type == type;
+        });
 
-        _client.publish( topic, message, 0, false );
-        free( topic );
+    if( it == _reported.end() ) {
+        _reported.emplace_back();
+        it = _reported.end() - 1;
+        it->deviceId = deviceId;
+        it->type = type;
+        it->reported = false;
     }
-    
-    free( message );
+
+    return *it;
 }
 
-const DeviceTarget* Zone::findDeviceTarget( const char *deviceId, const char *type ) const
+bool Zone::shouldReport( ReportedValue &last, double value, const DeviceTarget *target )
 {
-    time_t now;
-    time( &now );
+    TickType_t now = xTaskGetTickCount();
+    double targetValue = target ? target->doubleValue() : 0;
+
+    if( last.reported ) {
+        double deadband = 0;
+        Device *device = findDevice( last.deviceId );
+        const DeviceCalibration *calibration = device ? device->findCalibration( last.type ) : NULL;
+        if( calibration ) {
+            deadband = calibration->deadband();
+        }
 
-    sendZoneLog( ESP_LOG_DEBUG, TAG, "Looking for override for time %ld", now );
-    
-    const DeviceTarget *target = NULL;
-
-    for( OverrideList::const_iterator s = _overrides.cbegin(); s != _overrides.cend(); ++s ) {
-        sendZoneLog( ESP_LOG_DEBUG, TAG, "Checking override for %ld -> %ld", s->getStart(), s->getEnd() );
-        if( s->getStart() <= now && s->getEnd() > now ) {
-            sendZoneLog( ESP_LOG_DEBUG, TAG, "Checking if override matches device" );
-            const DeviceTarget *maybeTarget = s->getTarget( _homeId, _zoneId, deviceId, type );
-            if( maybeTarget ) {
-                sendZoneLog( ESP_LOG_DEBUG, TAG, "Override matches device" );
-                target = maybeTarget;
-            }
+        bool moved = fabs( value - last.value ) > deadband;
+        bool retargeted = last.hasTarget != ( target != NULL ) || ( target && last.target != targetValue );
+        bool expired = ( now - last.time ) * portTICK_PERIOD_MS >= CONFIG_AUTOHOME_READING_HEARTBEAT;
+
+        if( !moved && !retargeted && !expired ) {
+            return false;
         }
     }
 
-    if( !target ) {
-        struct tm tmnow;
-        localtime_r( &now, &tmnow );
-        sendZoneLog( ESP_LOG_DEBUG, TAG, "Looking for schedule for day %d hour %d minute %d", tmnow.tm_wday, tmnow.tm_hour, tmnow.tm_min );
-        for( ScheduleList::const_iterator s = _schedules.cbegin(); s != _schedules.cend(); ++s ) {
-            sendZoneLog( ESP_LOG_DEBUG, TAG, "Checking schedule hour %d minute %d against hour %d minute %d", s->getHour(), s->getMinute(), tmnow.tm_hour, tmnow.tm_min );
-            if( s->getDays() & BIT( tmnow.tm_wday ) &&
-                ( s->getHour() < tmnow.tm_hour || (
-                    s->getHour() == tmnow.tm_hour  &&
-                    s->getMinute() <= tmnow.tm_min ) ) ) {
-                sendZoneLog( ESP_LOG_DEBUG, TAG, "Schedule matches!" );
-                const DeviceTarget *maybeTarget = s->getTarget( _homeId, _zoneId, deviceId, type );
-                if( maybeTarget ) {
-                    target = maybeTarget;
-                }
-            }
+    last.reported = true;
+    last.value = value;
+    last.hasTarget = target != NULL;
+    last.target = targetValue;
+    last.time = now;
+    return true;
+}
+
+void Zone::setValue( const Uuid &deviceId, ReadingType type, double value, const char *unit, double threshold )
+{
+    xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
+
+    const DeviceTarget *target = findDeviceTarget( _homeUuid, _zoneUuid, deviceId, type );
+    ReportedValue &last = lastReading( deviceId, type );
+    last.kind = VALUE_DOUBLE;
+    last.latest.value.doubleValue = value;
+    last.latest.setUnit( unit );
+    last.threshold = threshold;
+
+    if( shouldReport( last, value, target ) ) {
+        Reading reading;
+        time( &reading.time );
+        reading.value.value.doubleValue = value;
+        reading.value.setUnit( unit );
+
+        if( target ) {
+            reading.hasTarget = true;
+            reading.target.value.doubleValue = target->doubleValue();
+            reading.target.setUnit( target->unit() );
         }
+
+        reading.hasThreshold = true;
+        reading.threshold.value.doubleValue = threshold;
+        reading.threshold.setUnit( unit );
+
+        sendDeviceReading( deviceId, type, reading );
     }
 
-    return target;
+    if( target ) {
+        takeAction( _homeUuid, _zoneUuid, deviceId, type, value, unit, target->doubleValue(), target->unit(), threshold );
+    }
+
+    xSemaphoreGiveRecursive( _lock );
 }
 
-void Zone::setValue( const char *deviceId, const char *type, double value, const char *unit, double threshold )
+void Zone::setValue( const Uuid &deviceId, ReadingType type, int value, const char *unit, int threshold )
 {
-    cJSON *valueJSON = cJSON_CreateObject();
-    cJSON *thresholdJSON = cJSON_CreateObject();
-    cJSON *targetJSON = NULL;
+    xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
+
+    const DeviceTarget *target = findDeviceTarget( _homeUuid, _zoneUuid, deviceId, type );
+    ReportedValue &last = lastReading( deviceId, type );
+    last.kind = VALUE_INT;
+    last.latest.value.intValue = value;
+    last.latest.setUnit( unit );
+    last.threshold = threshold;
+
+    if( shouldReport( last, value, target ) ) {
+        Reading reading;
+        time( &reading.time );
+        reading.value.value.doubleValue = value;
+        reading.value.setUnit( unit );
+
+        if( target ) {
+            reading.hasTarget = true;
+            reading.target.value.doubleValue = target->intValue();
+            reading.target.setUnit( target->unit() );
+        }
+
+        reading.hasThreshold = true;
+        reading.threshold.value.doubleValue = threshold;
+        reading.threshold.setUnit( unit );
+
+        sendDeviceReading( deviceId, type, reading );
+    }
 
-    const DeviceTarget *target = findDeviceTarget( deviceId, type );
     if( target ) {
-        targetJSON = cJSON_CreateObject();
-        cJSON_AddNumberToObject( targetJSON, "value", target->doubleValue() );
-        cJSON_AddStringToObject( targetJSON, "unit", target->unit() );
+        takeAction( _homeUuid, _zoneUuid, deviceId, type, value, unit, target->intValue(), target->unit(), threshold );
     }
 
-    cJSON_AddNumberToObject( valueJSON, "value", value );
-    cJSON_AddStringToObject( valueJSON, "unit", unit );
+    xSemaphoreGiveRecursive( _lock );
+}
 
-    cJSON_AddNumberToObject( thresholdJSON, "value", threshold );
-    cJSON_AddStringToObject( thresholdJSON, "unit", unit );
+void Zone::setValue( const Uuid &deviceId, ReadingType type, bool value )
+{
+    xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
+
+    const DeviceTarget *target = findDeviceTarget( _homeUuid, _zoneUuid, deviceId, type );
+    ReportedValue &last = lastReading( deviceId, type );
+    last.kind = VALUE_BOOL;
+    last.latest.value.boolValue = value;
+    last.latest.setUnit( "" );
+    last.threshold = 0;
+
+    if( shouldReport( last, value ? 1 : 0, target ) ) {
+        Reading reading;
+        time( &reading.time );
+        reading.value.value.doubleValue = value ? 1 : 0;
+        reading.value.setUnit( "" );
+
+        if( target ) {
+            reading.hasTarget = true;
+            reading.target.value.doubleValue = target->boolValue() ? 1 : 0;
+            reading.target.setUnit( target->unit() );
+        }
 
-    sendDeviceReadingJSON( deviceId, type, valueJSON, targetJSON, thresholdJSON );
+        sendDeviceReading( deviceId, type, reading );
+    }
 
     if( target ) {
-        takeAction( _homeId, _zoneId, deviceId, type, value, unit, target->doubleValue(), target->unit(), threshold );
+        takeAction( _homeUuid, _zoneUuid, deviceId, type, value, target->boolValue() );
     }
+
+    xSemaphoreGiveRecursive( _lock );
 }
 
-void Zone::setValue( const char *deviceId, const char *type, int value, const char *unit, int threshold )
+void Zone::republish()
 {
-    cJSON *valueJSON = cJSON_CreateObject();
-    cJSON *targetJSON = NULL;
-    cJSON *thresholdJSON = cJSON_CreateObject();
+    xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
 
-    const DeviceTarget *target = findDeviceTarget( deviceId, type );
-    if( target ) {
-        targetJSON = cJSON_CreateObject();
-        cJSON_AddNumberToObject( targetJSON, "value", target->intValue() );
-        cJSON_AddStringToObject( targetJSON, "unit", target->unit() );
+    // readings are published by exception and switches only when they turn,
+    // so a value retained from before an outage could otherwise stay there
+    for( ReportedValueList::iterator it = _reported.begin(); it != _reported.end(); ++it ) {
+        if( !it->reported ) {
+            continue;
+        }
+
+        const DeviceTarget *target = findDeviceTarget( _homeUuid, _zoneUuid, it->deviceId, it->type );
+        double value = 0;
+        double targetValue = 0;
+
+        switch( it->kind ) {
+        case VALUE_DOUBLE:
+            value = it->latest.value.doubleValue;
+            targetValue = target ? target->doubleValue() : 0;
+            break;
+        case VALUE_INT:
+            value = it->latest.value.intValue;
+            targetValue = target ? target->intValue() : 0;
+            break;
+        case VALUE_BOOL:
+            value = it->latest.value.boolValue ? 1 : 0;
+            targetValue = target && target->boolValue() ? 1 : 0;
+            break;
+        }
+
+        Reading reading;
+        time( &reading.time );
+        reading.value.value.doubleValue = value;
+        reading.value.setUnit( it->latest.unit );
+
+        if( target ) {
+            reading.hasTarget = true;
+            reading.target.value.doubleValue = targetValue;
+            reading.target.setUnit( target->unit() );
+        }
+
+        if( it->kind != VALUE_BOOL ) {
+            reading.hasThreshold = true;
+            reading.threshold.value.doubleValue = it->threshold;
+            reading.threshold.setUnit( it->latest.unit );
+        }
+
+        // the heartbeat starts over from this report
+        it->reported = false;
+        shouldReport( *it, value, target );
+        sendDeviceReading( it->deviceId, it->type, reading );
     }
 
-    cJSON_AddNumberToObject( valueJSON, "value", value );
-    cJSON_AddStringToObject( valueJSON, "unit", unit );
+    xSemaphoreGiveRecursive( _lock );
+}
 
-    cJSON_AddNumberToObject( thresholdJSON, "value", threshold );
-    cJSON_AddStringToObject( thresholdJSON, "unit", unit );
+void Zone::scheduleTransition()
+{
+    time_t now;
 
-    sendDeviceReadingJSON( deviceId, type, valueJSON, targetJSON, thresholdJSON );
+    if( _timeline.empty() ) {
+        if( _transitionTimer ) {
+            xTimerStop( _transitionTimer, 0 );
+        }
+        return;
+    }
 
-    if( target ) {
-        takeAction( _homeId, _zoneId, deviceId, type, value, unit, target->intValue(), target->unit(), threshold );
+    time( &now );
+    // until the clock is set, check back for it instead
+    TickType_t delay = now < CLOCK_SET
+        ? pdMS_TO_TICKS( CLOCK_POLL_INTERVAL )
+        : pdMS_TO_TICKS( ( _timeline.nextBoundary( now ) - now ) * 1000 );
+    if( delay == 0 ) {
+        delay = 1;
     }
+
+    if( _transitionTimer == NULL ) {
+        _transitionTimer = xTimerCreate( "transition", delay, pdFALSE, this, &transitionTimerCallback );
+    }
+    // also starts the timer; never blocks, as this runs on the timer task too
+    xTimerChangePeriod( _transitionTimer, delay, 0 );
 }
 
-void Zone::setValue( const char *deviceId, const char *type, bool value )
+void Zone::applyTransitions()
 {
-    cJSON *valueJSON = cJSON_CreateObject();
-    cJSON *targetJSON = NULL;
+    xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
+    if( _closing ) {
+        xSemaphoreGiveRecursive( _lock );
+        return;
+    }
 
-    const DeviceTarget *target = findDeviceTarget( deviceId, type );
-    if( target ) {
-        targetJSON = cJSON_CreateObject();
-        cJSON_AddNumberToObject( targetJSON, "value", target->boolValue() );
-        cJSON_AddStringToObject( targetJSON, "unit", target->unit() );
+    sendZoneLog( ESP_LOG_DEBUG, TAG, "Targets may have changed, acting on the latest readings" );
+
+    time_t now;
+    time( &now );
+    size_t ended = _overrides.prune( now );
+    if( ended > 0 ) {
+        sendZoneLog( ESP_LOG_DEBUG, TAG, "Dropped %u ended overrides", (unsigned)ended );
+        _timeline.compile( _schedules, _overrides );
     }
 
-    cJSON_AddNumberToObject( valueJSON, "value", value ? 1 : 0 );
-    cJSON_AddStringToObject( valueJSON, "unit", "" );
+    // the readings themselves have not changed, so nothing is reported; a
+    // switch turned by this reports its own state, which can add to the
+    // readings, so each is copied before it is acted on
+    for( size_t i = 0; i < _reported.size(); ++i ) {
+        const ReportedValue reported = _reported[i];
+        const ReportedValue *it = &reported;
+        const DeviceTarget *target = findDeviceTarget( _homeUuid, _zoneUuid, it->deviceId, it->type );
+        if( !target ) {
+            continue;
+        }
 
-    sendDeviceReadingJSON( deviceId, type, valueJSON, targetJSON );
+        switch( it->kind ) {
+        case VALUE_DOUBLE:
+            takeAction( _homeUuid, _zoneUuid, it->deviceId, it->type, it->latest.value.doubleValue, it->latest.unit,
+                        target->doubleValue(), target->unit(), it->threshold );
+            break;
+        case VALUE_INT:
+            takeAction( _homeUuid, _zoneUuid, it->deviceId, it->type, it->latest.value.intValue, it->latest.unit,
+                        target->intValue(), target->unit(), (int)it->threshold );
+            break;
+        case VALUE_BOOL:
+            takeAction( _homeUuid, _zoneUuid, it->deviceId, it->type, it->latest.value.boolValue, target->boolValue() );
+            break;
+        }
+    }
 
-    if( target ) {
-        takeAction( _homeId, _zoneId, deviceId, type, value, target->boolValue() );
+    evaluateRemoteValues();
+    scheduleTransition();
+
+    // held targets are kept for the next boot that finds no clock; they only
+    // change at a boundary, so this is as often as they are written
+    if( _heldChanged ) {
+        _heldChanged = false;
+        _client.getSnapshot().saveZone( *this );
     }
+
+    xSemaphoreGiveRecursive( _lock );
 }
 
-void Zone::takeAction( const char *homeId, const char *zoneId, const char *deviceId, const char *type, double value, const char *unit, double targetValue, const char *targetUnit, double threshold )
+void Zone::scheduleActuation()
 {
-    sendZoneLog( ESP_LOG_INFO, TAG, "Taking action for %s value for home %s zone %s device %s", type, homeId, zoneId, deviceId );
-    if( value >= ( targetValue - threshold ) && value <= ( targetValue + threshold ) ) {
-        sendZoneLog( ESP_LOG_INFO, TAG, "%s value for home %s zone %s device %s is within threshold", type, homeId, zoneId, deviceId );
+    TickType_t delay = portMAX_DELAY;
+
+    for( DeviceList::const_iterator device = _devices.cbegin(); device != _devices.cend(); ++device ) {
+        TickType_t wait = (*device)->pendingDelay();
+        if( wait < delay ) {
+            delay = wait;
+        }
+    }
+
+    if( delay == portMAX_DELAY ) {
+        if( _actuationTimer ) {
+            xTimerStop( _actuationTimer, 0 );
+        }
+        return;
+    }
+
+    if( delay == 0 ) {
+        delay = 1;
+    }
+
+    if( _actuationTimer == NULL ) {
+        _actuationTimer = xTimerCreate( "actuation", delay, pdFALSE, this, &actuationTimerCallback );
+    }
+    xTimerChangePeriod( _actuationTimer, delay, 0 );
+}
+
+void Zone::applyActuations()
+{
+    xSemaphoreTakeRecursive( _lock, portMAX_DELAY );
+    if( _closing ) {
+        xSemaphoreGiveRecursive( _lock );
         return;
     }
 
     for( DeviceList::iterator device = _devices.begin(); device != _devices.end(); ++device ) {
-        sendZoneLog( ESP_LOG_INFO, TAG, "Checking device %s", (*device)->getId() );
-        const DeviceChangeList &changes = (*device)->getChanges();
-        for( DeviceChangeList::const_iterator change = changes.cbegin(); change != changes.cend(); ++change ) {
-            if( change->matches( homeId, zoneId, deviceId, type ) ) {
-                if( ( change->getDirection() > 0 ) == ( value < targetValue ) ) {
-                    sendZoneLog( ESP_LOG_INFO, TAG, "device %s turning ON", (*device)->getId() );
-                    (*device)->on();
-                } else {
-                    sendZoneLog( ESP_LOG_INFO, TAG, "device %s turning OFF", (*device)->getId() );
-                    (*device)->off();
-                }
-            }
+        if( (*device)->applyPending() ) {
+            sendZoneLog( ESP_LOG_INFO, TAG, "device %s made its held change", (*device)->getId() );
         }
     }
+    scheduleActuation();
+
+    xSemaphoreGiveRecursive( _lock );
 }
 
-void Zone::takeAction( const char *homeId, const char *zoneId, const char *deviceId, const char *type, int value, const char *unit, int targetValue, const char *targetUnit, int threshold )
+void Zone::takeAction( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type, double value, const char *unit, double targetValue, const char *targetUnit, double threshold )
 {
-    sendZoneLog( ESP_LOG_INFO, TAG, "Taking action for %s value for home %s zone %s device %s", type, homeId, zoneId, deviceId );
+    char device[Uuid::LENGTH + 1];
+    sendZoneLog( ESP_LOG_INFO, TAG, "Taking action for %s value of device %s", readingTypeName( type ), deviceId.format( device ) );
     if( value >= ( targetValue - threshold ) && value <= ( targetValue + threshold ) ) {
-        sendZoneLog( ESP_LOG_INFO, TAG, "%s value for home %s zone %s device %s is within threshold", type, homeId, zoneId, deviceId );
+        sendZoneLog( ESP_LOG_INFO, TAG, "%s value of device %s is within threshold", readingTypeName( type ), device );
         return;
     }
 
-    for( DeviceList::iterator device = _devices.begin(); device != _devices.end(); ++device ) {
-        const DeviceChangeList &changes = (*device)->getChanges();
-        for( DeviceChangeList::const_iterator change = changes.cbegin(); change != changes.cend(); ++change ) {
-            if( change->matches( homeId, zoneId, deviceId, type ) ) {
-                if( ( change->getDirection() > 0 ) == ( value < targetValue ) ) {
-                    sendZoneLog( ESP_LOG_INFO, TAG, "device %s turning ON", (*device)->getId() );
-                    (*device)->on();
-                } else {
-                    sendZoneLog( ESP_LOG_INFO, TAG, "device %s turning OFF", (*device)->getId() );
-                    (*device)->off();
-                }
-            }
-        }
+    driveActuators( homeId, zoneId, deviceId, type, value < targetValue );
+}
+
+void Zone::takeAction( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type, int value, const char *unit, int targetValue, const char *targetUnit, int threshold )
+{
+    char device[Uuid::LENGTH + 1];
+    sendZoneLog( ESP_LOG_INFO, TAG, "Taking action for %s value of device %s", readingTypeName( type ), deviceId.format( device ) );
+    if( value >= ( targetValue - threshold ) && value <= ( targetValue + threshold ) ) {
+        sendZoneLog( ESP_LOG_INFO, TAG, "%s value of device %s is within threshold", readingTypeName( type ), device );
+        return;
     }
+
+    driveActuators( homeId, zoneId, deviceId, type, value < targetValue );
 }
 
-void Zone::takeAction( const char *homeId, const char *zoneId, const char *deviceId, const char *type, bool value, bool targetValue )
+void Zone::takeAction( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type, bool value, bool targetValue )
 {
-    sendZoneLog( ESP_LOG_INFO, TAG, "Taking action for %s value for home %s zone %s device %s", type, homeId, zoneId, deviceId );
+    char device[Uuid::LENGTH + 1];
+    sendZoneLog( ESP_LOG_INFO, TAG, "Taking action for %s value of device %s", readingTypeName( type ), deviceId.format( device ) );
     if( value == targetValue ) {
-        sendZoneLog( ESP_LOG_INFO, TAG, "%s value for home %s zone %s device %s matches target", type, homeId, zoneId, deviceId );
+        sendZoneLog( ESP_LOG_INFO, TAG, "%s value of device %s matches target", readingTypeName( type ), device );
         return;
     }
 
-    for( DeviceList::iterator device = _devices.begin(); device != _devices.end(); ++device ) {
-        const DeviceChangeList &changes = (*device)->getChanges();
-        for( DeviceChangeList::const_iterator change = changes.cbegin(); change != changes.cend(); ++change ) {
-            if( change->matches( homeId, zoneId, deviceId, type ) ) {
-                if( ( change->getDirection() > 0 ) == ( value < targetValue ) ) {
-                    sendZoneLog( ESP_LOG_INFO, TAG, "device %s turning ON", (*device)->getId() );
-                    (*device)->on();
-                } else {
-                    sendZoneLog( ESP_LOG_INFO, TAG, "device %s turning OFF", (*device)->getId() );
-                    (*device)->off();
-                }
-            }
-        }
-    }
+    driveActuators( homeId, zoneId, deviceId, type, value < targetValue );
 }
 
-Schedule::Schedule( cJSON *json, const char *defaultHomeId, const char *defaultZoneId )
-    : _days( 0 ), _hour( 0 ), _minute( 0 )
+void Zone::indexActuators()
+{
+    _actuators.rebuild( _devices );
+    sendZoneLog( ESP_LOG_DEBUG, TAG, "Indexed %u actuator changes", (unsigned)_actuators.size() );
+}
+
+void Zone::driveActuators( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type, bool belowTarget )
 {
+    struct Decision
     {
-        cJSON *days = cJSON_GetObjectItem( json, "days" );
-        if( days && cJSON_IsArray( days ) ) {
-            int numDays = cJSON_GetArraySize( days );
-            for( int i = 0; i < numDays; ++i ) {
-                cJSON *day = cJSON_GetArrayItem( days, i );
-                _days |= BIT( day->valueint );
-            }
+        Device *device;
+        bool on;
+    };
+    // local, as a switch that changes reports its state and can bring us
+    // back here for the actuators that depend on it
+    std::vector<Decision> decisions;
+
+    // first settle what each actuator should do about this reading
+    auto range = _actuators.find( homeId, zoneId, deviceId );
+    for( auto it = range.first; it != range.second; ++it ) {
+        const ActuatorIndex::Actuator &actuator = it->second;
+        if( !actuator.change->matches( homeId, zoneId, deviceId, type ) ) {
+            continue;
+        }
+
+        bool on = ( actuator.change->getDirection() > 0 ) == belowTarget;
+        std::vector<Decision>::iterator decision = std::find_if(
+            decisions.begin(), decisions.end(),
+            [&actuator](const Decision &d) {
+                return d.device == actuator.device;
+            });
+
+        if( decision == decisions.end() ) {
+            Decision d = { actuator.device, on };
+            decisions.push_back( d );
+        } else if( decision->on != on ) {
+            // changes that disagree about the same reading leave it off
+            sendZoneLog( ESP_LOG_INFO, TAG, "Changes of device %s disagree, keeping it off", actuator.device->getId() );
+            decision->on = false;
         }
     }
 
-    {
-        cJSON *start = cJSON_GetObjectItem( json, "start" );
-        if( start && cJSON_IsString( start ) ) {
-            char *startstr = strdup( start->valuestring );
-            char *origstartstr = startstr;
-            char *part = strsep( &startstr, ":" );
-            if( part ) {
-                _hour = (uint8_t)atoi( part );
-                part = strsep( &startstr, ":" );
-            }
-            if( part ) {
-                _minute = (uint8_t)atoi( part );
-            }
-            free( origstartstr );
+    // then apply each once; only an actual change touches the output
+    for( std::vector<Decision>::const_iterator decision = decisions.cbegin(); decision != decisions.cend(); ++decision ) {
+        if( decision->on ? decision->device->on() : decision->device->off() ) {
+            sendZoneLog( ESP_LOG_INFO, TAG, "device %s turned %s", decision->device->getId(), decision->on ? "ON" : "OFF" );
         }
     }
+}
 
-    {
-        cJSON *changes = cJSON_GetObjectItem( json, "changes" );
-        if( changes && cJSON_IsArray( changes ) ) {
-            int numChanges = cJSON_GetArraySize( changes );
-            for( int i = 0; i < numChanges; ++i ) {
-                _targets.emplace_front( cJSON_GetArrayItem( changes, i ), defaultHomeId, defaultZoneId );
-            }
+void ActuatorIndex::rebuild( const DeviceList &devices )
+{
+    _index.clear();
+
+    for( DeviceList::const_iterator device = devices.cbegin(); device != devices.cend(); ++device ) {
+        const DeviceChangeList &changes = (*device)->getChanges();
+        for( DeviceChangeList::const_iterator change = changes.cbegin(); change != changes.cend(); ++change ) {
+            Actuator actuator = { *device, &(*change) };
+            _index.emplace( TopicRouter::hashKey( change->getHomeId(), change->getZoneId(), &change->getDeviceId() ), actuator );
         }
     }
+}
 
-    ESP_LOGD( TAG, "Created schedule for days %x starting at %02d:%02d", _days, _hour, _minute ); 
+std::pair<ActuatorIndex::const_iterator, ActuatorIndex::const_iterator> ActuatorIndex::find( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId ) const
+{
+    return _index.equal_range( TopicRouter::hashKey( homeId, zoneId, &deviceId ) );
+}
+
+bool RemoteReading::matches( const Uuid &home, const Uuid &zone, const Uuid &device, ReadingType t ) const
+{
+    return type == t && deviceId == device && zoneId == zone && homeId == home;
+}
+
+bool RemoteReading::stale( TickType_t now ) const
+{
+    return ( now - time ) * portTICK_PERIOD_MS >= CONFIG_AUTOHOME_REMOTE_READING_TTL;
+}
+
+Schedule::Schedule()
+    : _days( 0 ), _hour( 0 ), _minute( 0 )
+{
 }
 
 Schedule::~Schedule()
 {
 }
 
-const DeviceTarget* Schedule::getTarget( const char *homeId, const char *zoneId, const char *deviceId, const char *type ) const
+void Schedule::addDay( int day )
+{
+    _days |= BIT( day );
+}
+
+void Schedule::setStart( const char *start )
+{
+    const char *minute = strchr( start, ':' );
+
+    _hour = (uint8_t)atoi( start );
+    _minute = minute ? (uint8_t)atoi( minute + 1 ) : 0;
+}
+
+static void saveTargets( SnapshotWriter &writer, const DeviceTargetList &targets )
+{
+    writer.put16( targets.size() );
+    for( DeviceTargetList::const_iterator target = targets.cbegin(); target != targets.cend(); ++target ) {
+        target->save( writer );
+    }
+}
+
+static void loadTargets( SnapshotReader &reader, DeviceTargetList &targets )
+{
+    targets.resize( reader.getCount( 3 * 17 ) );
+    for( DeviceTargetList::iterator target = targets.begin(); target != targets.end(); ++target ) {
+        target->load( reader );
+    }
+}
+
+void Schedule::save( SnapshotWriter &writer ) const
+{
+    writer.put8( _days );
+    writer.put8( _hour );
+    writer.put8( _minute );
+    saveTargets( writer, _targets );
+}
+
+void Schedule::load( SnapshotReader &reader )
+{
+    _days = reader.get8();
+    _hour = reader.get8();
+    _minute = reader.get8();
+    loadTargets( reader, _targets );
+}
+
+DeviceTarget &Schedule::addTarget( const Uuid &defaultHomeId, const Uuid &defaultZoneId )
 {
-    DeviceTargetList::const_iterator it = std::find_if(
-        _targets.begin(), _targets.end(),
-        [homeId, zoneId, deviceId, type](const DeviceTarget &target) {
-            return target.matches( (const char *)homeId, (const char *)zoneId, (const char *)deviceId, (const char *)type );
+    _targets.emplace_back( defaultHomeId, defaultZoneId );
+    return _targets.back();
+}
+
+size_t Schedule::pruneTargets()
+{
+    size_t size = _targets.size();
+
+    _targets.erase( std::remove_if( _targets.begin(), _targets.end(),
+        [](const DeviceTarget &target) {
+            return !target.valid();
+        }), _targets.end() );
+
+    return size - _targets.size();
+}
+
+const DeviceTarget* Schedule::getTarget( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type ) const
+{
+    // the last matching target wins
+    DeviceTargetList::const_reverse_iterator it = std::find_if(
+        _targets.rbegin(), _targets.rend(),
+        [&homeId, &zoneId, &deviceId, type](const DeviceTarget &target) {
+            return target.matches( homeId, zoneId, deviceId, type );
         });
 
-    if( it != _targets.end() ) {
+    if( it != _targets.rend() ) {
         return &(*it);
     }
 
     return NULL;
 }
 
-Override::Override( cJSON *json, const char *defaultHomeId, const char *defaultZoneId )
+Override::Override()
     : _start( 0 ), _end( 0 )
 {
-    {
-        cJSON *start = cJSON_GetObjectItem( json, "start" );
-        if( start && cJSON_IsString( start ) ) {
-            struct tm tmstart;
-            strptime( start->valuestring, "%FT%TZ", &tmstart );
-            _start = mktime( &tmstart ) - _timezone;
-            _end = _start;
-        }
-    }
+}
 
-    {
-        cJSON *end = cJSON_GetObjectItem( json, "end" );
-        if( end && cJSON_IsString( end ) ) {
-            struct tm tmend;
-            strptime( end->valuestring, "%FT%TZ", &tmend );
-            _end = mktime( &tmend ) - _timezone;
-        }
-    }
+Override::~Override()
+{
+}
 
-    {
-        cJSON *changes = cJSON_GetObjectItem( json, "changes" );
-        if( changes && cJSON_IsArray( changes ) ) {
-            int numChanges = cJSON_GetArraySize( changes );
-            for( int i = 0; i < numChanges; ++i ) {
-                _targets.emplace_front( cJSON_GetArrayItem( changes, i ), defaultHomeId, defaultZoneId );
-            }
-        }
+void Override::setStart( const char *start )
+{
+    struct tm tmstart;
+    memset( &tmstart, 0, sizeof( tmstart ) );
+    strptime( start, "%FT%TZ", &tmstart );
+    _start = mktime( &tmstart ) - _timezone;
+    if( _end < _start ) {
+        _end = _start;
     }
+}
 
-    ESP_LOGD( TAG, "Created override for %ld to %ld", _start, _end );
+void Override::setEnd( const char *end )
+{
+    struct tm tmend;
+    memset( &tmend, 0, sizeof( tmend ) );
+    strptime( end, "%FT%TZ", &tmend );
+    _end = mktime( &tmend ) - _timezone;
 }
 
-Override::~Override()
+void Override::save( SnapshotWriter &writer ) const
 {
+    writer.put64( _start );
+    writer.put64( _end );
+    saveTargets( writer, _targets );
 }
 
-const DeviceTarget* Override::getTarget( const char *homeId, const char *zoneId, const char *deviceId, const char *type ) const
+void Override::load( SnapshotReader &reader )
 {
-    DeviceTargetList::const_iterator it = std::find_if(
-        _targets.begin(), _targets.end(),
-        [homeId, zoneId, deviceId, type](const DeviceTarget &target) {
-            return target.matches( (const char *)homeId, (const char *)zoneId, (const char *)deviceId, (const char *)type );
+    _start = (time_t)reader.get64();
+    _end = (time_t)reader.get64();
+    loadTargets( reader, _targets );
+}
+
+DeviceTarget &Override::addTarget( const Uuid &defaultHomeId, const Uuid &defaultZoneId )
+{
+    _targets.emplace_back( defaultHomeId, defaultZoneId );
+    return _targets.back();
+}
+
+size_t Override::pruneTargets()
+{
+    size_t size = _targets.size();
+
+    _targets.erase( std::remove_if( _targets.begin(), _targets.end(),
+        [](const DeviceTarget &target) {
+            return !target.valid();
+        }), _targets.end() );
+
+    return size - _targets.size();
+}
+
+const DeviceTarget* Override::getTarget( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type ) const
+{
+    // the last matching target wins
+    DeviceTargetList::const_reverse_iterator it = std::find_if(
+        _targets.rbegin(), _targets.rend(),
+        [&homeId, &zoneId, &deviceId, type](const DeviceTarget &target) {
+            return target.matches( homeId, zoneId, deviceId, type );
         });
 
-    if( it != _targets.end() ) {
+    if( it != _targets.rend() ) {
         return &(*it);
     }
 
@@ -733,77 +1443,49 @@ const DeviceTarget* Override::getTarget( const char *homeId, const char *zoneId,
 
 
 
-DeviceTarget::DeviceTarget( cJSON *json, const char *defaultHomeId, const char *defaultZoneId )
+DeviceTarget::DeviceTarget( const Uuid &defaultHomeId, const Uuid &defaultZoneId )
+    : _homeId( defaultHomeId ), _zoneId( defaultZoneId ), _type( READING_ANY ), _valid( true )
 {
-    {
-        cJSON *homeId = cJSON_GetObjectItem( json, "home" );
-        if( homeId && cJSON_IsString( homeId ) ) {
-            strncpy( _homeId, homeId->valuestring, sizeof( _homeId ) - 1 );
-            _homeId[sizeof( _homeId ) - 1] = '\0';
-        } else if( defaultHomeId ) {
-            strncpy( _homeId, defaultHomeId, sizeof( _homeId ) - 1 );
-            _homeId[sizeof( _homeId ) - 1] = '\0';
-        } else {
-            _homeId[0] = '\0';
-        }
-    }
-    {
-        cJSON *zoneId = cJSON_GetObjectItem( json, "zone" );
-        if( zoneId && cJSON_IsString( zoneId ) ) {
-            strncpy( _zoneId, zoneId->valuestring, sizeof( _zoneId ) - 1 );
-            _zoneId[sizeof( _zoneId ) - 1] = '\0';
-        } else if( defaultZoneId ) {
-            strncpy( _zoneId, defaultZoneId, sizeof( _zoneId ) - 1 );
-            _zoneId[sizeof( _zoneId ) - 1] = '\0';
-        } else {
-            _zoneId[0] = '\0';
-        }
-    }
-    {
-        cJSON *deviceId = cJSON_GetObjectItem( json, "device" );
-        if( deviceId && cJSON_IsString( deviceId ) ) {
-            strncpy( _deviceId, deviceId->valuestring, sizeof( _deviceId ) - 1 );
-            _deviceId[sizeof( _deviceId ) - 1] = '\0';
-        } else {
-            _deviceId[0] = '\0';
-        }
-    }
-    {
-        cJSON *type = cJSON_GetObjectItem( json, "type" );
-        if( type && cJSON_IsString( type ) ) {
-            strncpy( _type, type->valuestring, sizeof( _type ) - 1 );
-            _type[sizeof( _type ) - 1] = '\0';
-        } else {
-            _type[0] = '\0';
-        }
-    }
-    {
-        cJSON *value = cJSON_GetObjectItem( json, "value" );
-        if( value && cJSON_IsObject( value ) ) {
-            cJSON *v = cJSON_GetObjectItem( value, "value" );
-            if( v && cJSON_IsBool( v ) ) {
-                _value.value.boolValue = v->valueint != 0;
-            } else if( v && cJSON_IsNumber( v ) ) {
-                _value.value.doubleValue = v->valuedouble;
-            } else {
-                _value.value.doubleValue = 0;
-            }
+}
 
-            cJSON *u = cJSON_GetObjectItem( value, "unit" );
-            if( u && cJSON_IsString( u ) ) {
-                strncpy( _value.unit, u->valuestring, sizeof( _value.unit ) - 1 );
-                _value.unit[sizeof( _value.unit ) - 1] = '\0';
-            } else {
-                _value.unit[0] = '\0';
-            }
-        }
+void DeviceTarget::setField( const char *field, const char *value )
+{
+    if( strcmp( field, "home" ) == 0 ) {
+        _valid = _homeId.parseRequired( value ) && _valid;
+    } else if( strcmp( field, "zone" ) == 0 ) {
+        _valid = _zoneId.parseRequired( value ) && _valid;
+    } else if( strcmp( field, "device" ) == 0 ) {
+        _valid = _deviceId.parseRequired( value ) && _valid;
+    } else if( strcmp( field, "type" ) == 0 ) {
+        _type = readingType( value );
     }
 }
 
-bool DeviceTarget::matches( const char *homeId, const char *zoneId, const char *deviceId, const char *type ) const
+bool DeviceTarget::matches( const Uuid &homeId, const Uuid &zoneId, const Uuid &deviceId, ReadingType type ) const
 {
-    ESP_LOGD( TAG, "Checking %s == %s && %s == %s && %s == %s && %s == %s", _homeId, homeId, _zoneId, zoneId, _deviceId, deviceId, _type, type );
-    return( strcmp( _homeId, homeId ) == 0 && strcmp( _zoneId, zoneId ) == 0 &&
-            strcmp( _deviceId, deviceId ) == 0 && ( _type[0] == '\0' || strcmp( _type, type ) == 0 ) );
+    return( _deviceId == deviceId && _zoneId == zoneId && _homeId == homeId && readingTypeMatches( _type, type ) );
 }
 
+bool DeviceTarget::sameKey( const DeviceTarget &other ) const
+{
+    return( _type == other._type && _deviceId == other._deviceId &&
+            _zoneId == other._zoneId && _homeId == other._homeId );
+}
+
+void DeviceTarget::save( SnapshotWriter &writer ) const
+{
+    _homeId.save( writer );
+    _zoneId.save( writer );
+    _deviceId.save( writer );
+    writer.put8( _type );
+    _value.save( writer );
+}
+
+void DeviceTarget::load( SnapshotReader &reader )
+{
+    _homeId.load( reader );
+    _zoneId.load( reader );
+    _deviceId.load( reader );
+    _type = (ReadingType)reader.get8();
+    _value.load( reader );
+}
@@ -0,0 +1,101 @@
+#include "autohome.h"
+
+static const char *HOME = "8f3c2a10-4b5d-4e6f-8a7b-9c0d1e2f3a4b";
+static const char *ZONE = "1a2b3c4d-5e6f-4a8b-9c0d-e1f2a3b4c5d6";
+static const char *DEVICE = "c0ffee00-1234-4567-89ab-cdef01234567";
+
+static int failures = 0;
+
+#define CHECK( condition ) \
+    do { \
+        if( !( condition ) ) { \
+            printf( "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition ); \
+            ++failures; \
+        } \
+    } while( 0 )
+
+// hands the client a whole message, as the MQTT client would
+static void deliver( MQTTClient &client, const char *topic, const char *payload )
+{
+    char topicBuffer[160];
+    char data[512];
+    esp_mqtt_event_t event;
+
+    snprintf( topicBuffer, sizeof( topicBuffer ), "%s", topic );
+    snprintf( data, sizeof( data ), "%s", payload );
+
+    memset( &event, 0, sizeof( event ) );
+    event.event_id = MQTT_EVENT_DATA;
+    event.msg_id = 1;
+    event.topic = topicBuffer;
+    event.topic_len = strlen( topicBuffer );
+    event.data = data;
+    event.data_len = strlen( data );
+    event.total_data_len = event.data_len;
+    event.current_data_offset = 0;
+
+    client.handleEvent( &event );
+}
+
+static void testSwitchLimitsReachSwitch()
+{
+    Flasher flasher( GPIO_NUM_2 );
+    Network network( flasher );
+    MQTTClient client( network );
+    char topic[160];
+
+    client.addZone( HOME, ZONE );
+    Zone *zone = client.getZone( HOME, ZONE );
+    CHECK( zone != NULL );
+    if( zone == NULL ) {
+        return;
+    }
+
+    snprintf( topic, sizeof( topic ), "homes/%s/zones/%s/devices/%s/config", HOME, ZONE, DEVICE );
+    deliver( client, topic,
+             "{\"interface\":{\"type\":\"gpio\",\"address\":\"4\","
+             "\"minOnTime\":60000,\"minOffTime\":30000,\"maxSwitchesPerHour\":4}}" );
+
+    Device *device = zone->findDevice( DEVICE );
+    CHECK( device != NULL && device->is( "gpio" ) );
+    if( device == NULL ) {
+        return;
+    }
+
+    SwitchLimits limits = device->getLimits();
+    CHECK( limits.minOnTime == 60000 );
+    CHECK( limits.minOffTime == 30000 );
+    CHECK( limits.maxPerHour == 4 );
+}
+
+static void testLongKeyMatchesNothing()
+{
+    ConfigPath path;
+    char key[64];
+
+    path.push();
+    path.setKey( "maxSwitchesPerHour" );
+    CHECK( path.is( "maxSwitchesPerHour" ) );
+
+    // one past what fits; cut short it would read as the key it starts with
+    memset( key, 'x', sizeof( key ) );
+    key[sizeof( key ) - 1] = '\0';
+    path.setKey( key );
+    key[31] = '\0';
+    CHECK( !path.is( key ) );
+    CHECK( !path.is( "maxSwitchesPerHour" ) );
+}
+
+int main()
+{
+    testSwitchLimitsReachSwitch();
+    testLongKeyMatchesNothing();
+
+    if( failures ) {
+        printf( "decoder: %d checks failed\n", failures );
+        return 1;
+    }
+
+    printf( "decoder: all checks passed\n" );
+    return 0;
+}
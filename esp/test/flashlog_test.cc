@@ -0,0 +1,176 @@
+#include "flashlog.h"
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static const size_t SECTOR_SIZE = 256;
+static const size_t SECTORS = 4;
+// a 4 byte record takes 8 bytes after the 8 byte sector header
+static const uint32_t RECORDS_PER_SECTOR = ( SECTOR_SIZE - 8 ) / 8;
+
+static int failures = 0;
+
+#define CHECK( condition ) \
+    do { \
+        if( !( condition ) ) { \
+            printf( "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition ); \
+            ++failures; \
+        } \
+    } while( 0 )
+
+static void tempPath( char *path, size_t size )
+{
+    snprintf( path, size, "/tmp/flashlog_testXXXXXX" );
+    int fd = mkstemp( path );
+    if( fd >= 0 ) {
+        close( fd );
+    }
+}
+
+static bool append( FlashRingLog &log, uint32_t value )
+{
+    return log.append( &value, sizeof( value ) );
+}
+
+// the oldest undelivered record, or -1
+static int64_t next( FlashRingLog &log )
+{
+    uint32_t value;
+    return log.peek( &value, sizeof( value ) ) == sizeof( value ) ? value : -1;
+}
+
+static void testWrapDropsOldestSector()
+{
+    char path[64];
+    FileStorage storage;
+    FlashRingLog log( storage );
+
+    tempPath( path, sizeof( path ) );
+    CHECK( storage.open( path, SECTORS * SECTOR_SIZE, SECTOR_SIZE ) );
+    CHECK( log.format() );
+
+    // one sector more than fits, so the ring comes back around to the first
+    uint32_t total = RECORDS_PER_SECTOR * SECTORS + 5;
+    for( uint32_t i = 0; i < total; ++i ) {
+        CHECK( append( log, i ) );
+    }
+    CHECK( log.dropped() == RECORDS_PER_SECTOR );
+
+    for( uint32_t i = RECORDS_PER_SECTOR; i < total; ++i ) {
+        CHECK( next( log ) == i );
+        CHECK( log.consume() );
+    }
+    CHECK( log.empty() );
+
+    unlink( path );
+}
+
+static void testRemountKeepsConsumedPosition()
+{
+    char path[64];
+    uint32_t total = RECORDS_PER_SECTOR * 2 + 3;
+
+    tempPath( path, sizeof( path ) );
+    {
+        FileStorage storage;
+        FlashRingLog log( storage );
+
+        CHECK( storage.open( path, SECTORS * SECTOR_SIZE, SECTOR_SIZE ) );
+        CHECK( log.format() );
+        for( uint32_t i = 0; i < total; ++i ) {
+            CHECK( append( log, i ) );
+        }
+
+        // into the second sector
+        for( uint32_t i = 0; i < RECORDS_PER_SECTOR + 2; ++i ) {
+            CHECK( next( log ) == i );
+            CHECK( log.consume() );
+        }
+
+        // peeked but not consumed, so it is delivered again
+        CHECK( next( log ) == RECORDS_PER_SECTOR + 2 );
+    }
+
+    FileStorage storage;
+    FlashRingLog log( storage );
+
+    CHECK( storage.open( path, SECTORS * SECTOR_SIZE, SECTOR_SIZE ) );
+    CHECK( log.mount() );
+    for( uint32_t i = RECORDS_PER_SECTOR + 2; i < total; ++i ) {
+        CHECK( next( log ) == i );
+        CHECK( log.consume() );
+    }
+    CHECK( log.empty() );
+
+    // appending carries on where the log left off
+    CHECK( append( log, 1000 ) );
+    CHECK( next( log ) == 1000 );
+
+    unlink( path );
+}
+
+static void testTornHeaderIsSkipped()
+{
+    char path[64];
+    // a record whose header made it to flash but nothing after it
+    uint8_t torn[4] = { 4, 0, 0xff, 0xff };
+    // a header that was still being written: no sane length
+    uint8_t garbage[4] = { 0xfe, 0x7f, 0xff, 0xff };
+
+    tempPath( path, sizeof( path ) );
+    {
+        FileStorage storage;
+        FlashRingLog log( storage );
+
+        CHECK( storage.open( path, SECTORS * SECTOR_SIZE, SECTOR_SIZE ) );
+        CHECK( log.format() );
+        CHECK( append( log, 1 ) );
+
+        // the power fails during the next append, after the first record
+        CHECK( storage.write( 16, torn, sizeof( torn ) ) );
+    }
+
+    {
+        FileStorage storage;
+        FlashRingLog log( storage );
+
+        CHECK( storage.open( path, SECTORS * SECTOR_SIZE, SECTOR_SIZE ) );
+        CHECK( log.mount() );
+        CHECK( append( log, 2 ) );
+
+        // and again, leaving a header that cannot be walked past
+        CHECK( storage.write( 32, garbage, sizeof( garbage ) ) );
+    }
+
+    FileStorage storage;
+    FlashRingLog log( storage );
+
+    CHECK( storage.open( path, SECTORS * SECTOR_SIZE, SECTOR_SIZE ) );
+    CHECK( log.mount() );
+    CHECK( append( log, 3 ) );
+
+    CHECK( next( log ) == 1 );
+    CHECK( log.consume() );
+    CHECK( next( log ) == 2 );
+    CHECK( log.consume() );
+    CHECK( next( log ) == 3 );
+    CHECK( log.consume() );
+    CHECK( log.empty() );
+
+    unlink( path );
+}
+
+int main()
+{
+    testWrapDropsOldestSector();
+    testRemountKeepsConsumedPosition();
+    testTornHeaderIsSkipped();
+
+    if( failures > 0 ) {
+        printf( "%d checks failed\n", failures );
+        return 1;
+    }
+
+    printf( "flashlog: all checks passed\n" );
+    return 0;
+}
@@ -0,0 +1 @@
+#include "../sdk.h"
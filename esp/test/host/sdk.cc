@@ -0,0 +1,441 @@
+#include "sdk.h"
+
+// Locks are never contended and never block, since nothing else runs; a
+// timer or task is only remembered for as long as the firmware holds it.
+
+struct HostTimer
+{
+    void *id;
+    TimerCallbackFunction_t callback;
+};
+
+static TickType_t ticks = 0;
+// anything that is not NULL serves as a handle
+static int handle;
+
+esp_event_base_t WIFI_EVENT = "WIFI_EVENT";
+esp_event_base_t IP_EVENT = "IP_EVENT";
+
+long _timezone = 0;
+
+const char *esp_err_to_name( esp_err_t code )
+{
+    return code == ESP_OK ? "ESP_OK" : "ERROR";
+}
+
+void esp_log_write( esp_log_level_t level, const char *tag, const char *format, ... )
+{
+    va_list args;
+
+    printf( "%c (%s) ", "NEWIDV"[level], tag );
+    va_start( args, format );
+    vprintf( format, args );
+    va_end( args );
+}
+
+uint32_t esp_log_timestamp( void )
+{
+    return ticks;
+}
+
+BaseType_t xTaskCreate( TaskFunction_t task, const char *name, uint32_t stack, void *arg, UBaseType_t priority, TaskHandle_t *handle_ )
+{
+    if( handle_ ) {
+        *handle_ = &handle;
+    }
+    return pdPASS;
+}
+
+void vTaskDelete( TaskHandle_t task )
+{
+}
+
+void vTaskDelay( TickType_t delay )
+{
+    ticks += delay;
+}
+
+uint32_t ulTaskNotifyTake( BaseType_t clear, TickType_t wait )
+{
+    return 0;
+}
+
+BaseType_t xTaskNotifyGive( TaskHandle_t task )
+{
+    return pdPASS;
+}
+
+TickType_t xTaskGetTickCount( void )
+{
+    return ticks;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle( void )
+{
+    return &handle;
+}
+
+QueueHandle_t xQueueCreate( UBaseType_t length, UBaseType_t itemSize )
+{
+    return &handle;
+}
+
+BaseType_t xQueueSend( QueueHandle_t queue, const void *item, TickType_t wait )
+{
+    return pdPASS;
+}
+
+BaseType_t xQueueSendToBack( QueueHandle_t queue, const void *item, TickType_t wait )
+{
+    return pdPASS;
+}
+
+BaseType_t xQueueReceive( QueueHandle_t queue, void *item, TickType_t wait )
+{
+    return pdFALSE;
+}
+
+UBaseType_t uxQueueMessagesWaiting( QueueHandle_t queue )
+{
+    return 0;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex( void )
+{
+    return &handle;
+}
+
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex( void )
+{
+    return &handle;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary( void )
+{
+    return &handle;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting( UBaseType_t max, UBaseType_t initial )
+{
+    return &handle;
+}
+
+BaseType_t xSemaphoreTake( SemaphoreHandle_t semaphore, TickType_t wait )
+{
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive( SemaphoreHandle_t semaphore )
+{
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreTakeRecursive( SemaphoreHandle_t semaphore, TickType_t wait )
+{
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveRecursive( SemaphoreHandle_t semaphore )
+{
+    return pdTRUE;
+}
+
+void vSemaphoreDelete( SemaphoreHandle_t semaphore )
+{
+}
+
+EventGroupHandle_t xEventGroupCreate( void )
+{
+    return &handle;
+}
+
+void vEventGroupDelete( EventGroupHandle_t group )
+{
+}
+
+EventBits_t xEventGroupWaitBits( EventGroupHandle_t group, EventBits_t bits, BaseType_t clear, BaseType_t all, TickType_t wait )
+{
+    return 0;
+}
+
+EventBits_t xEventGroupSetBits( EventGroupHandle_t group, EventBits_t bits )
+{
+    return bits;
+}
+
+TimerHandle_t xTimerCreate( const char *name, TickType_t period, UBaseType_t reload, void *id, TimerCallbackFunction_t callback )
+{
+    HostTimer *timer = new HostTimer;
+    timer->id = id;
+    timer->callback = callback;
+    return timer;
+}
+
+void *pvTimerGetTimerID( TimerHandle_t timer )
+{
+    return ((HostTimer*)timer)->id;
+}
+
+BaseType_t xTimerStart( TimerHandle_t timer, TickType_t wait )
+{
+    return pdPASS;
+}
+
+BaseType_t xTimerStop( TimerHandle_t timer, TickType_t wait )
+{
+    return pdPASS;
+}
+
+BaseType_t xTimerReset( TimerHandle_t timer, TickType_t wait )
+{
+    return pdPASS;
+}
+
+BaseType_t xTimerDelete( TimerHandle_t timer, TickType_t wait )
+{
+    delete (HostTimer*)timer;
+    return pdPASS;
+}
+
+BaseType_t xTimerChangePeriod( TimerHandle_t timer, TickType_t period, TickType_t wait )
+{
+    return pdPASS;
+}
+
+BaseType_t xTimerIsTimerActive( TimerHandle_t timer )
+{
+    return pdFALSE;
+}
+
+esp_err_t esp_base_mac_addr_get( uint8_t *mac )
+{
+    return ESP_ERR_INVALID_MAC;
+}
+
+esp_err_t esp_efuse_mac_get_default( uint8_t *mac )
+{
+    memset( mac, 0, 6 );
+    return ESP_OK;
+}
+
+void tcpip_adapter_init( void )
+{
+}
+
+esp_err_t esp_event_loop_create_default( void )
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_register( esp_event_base_t base, int32_t id, esp_event_handler_t handler, void *arg )
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_event_handler_unregister( esp_event_base_t base, int32_t id, esp_event_handler_t handler )
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_init( const wifi_init_config_t *config )
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_mode( wifi_mode_t mode )
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_set_config( esp_interface_t interface, wifi_config_t *config )
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_start( void )
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_wifi_connect( void )
+{
+    return ESP_OK;
+}
+
+char *ip4addr_ntoa( const ip4_addr_t *addr )
+{
+    static char text[16];
+    const uint8_t *bytes = (const uint8_t*)&addr->addr;
+
+    snprintf( text, sizeof( text ), "%d.%d.%d.%d", bytes[0], bytes[1], bytes[2], bytes[3] );
+    return text;
+}
+
+void sntp_setoperatingmode( uint8_t mode )
+{
+}
+
+void sntp_setservername( uint8_t index, const char *server )
+{
+}
+
+void sntp_init( void )
+{
+}
+
+esp_err_t nvs_flash_init( void )
+{
+    return ESP_OK;
+}
+
+esp_err_t nvs_open( const char *name, nvs_open_mode_t mode, nvs_handle_t *handle_ )
+{
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+void nvs_close( nvs_handle_t handle_ )
+{
+}
+
+esp_err_t nvs_get_blob( nvs_handle_t handle_, const char *key, void *value, size_t *length )
+{
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_set_blob( nvs_handle_t handle_, const char *key, const void *value, size_t length )
+{
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_erase_key( nvs_handle_t handle_, const char *key )
+{
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+esp_err_t nvs_commit( nvs_handle_t handle_ )
+{
+    return ESP_ERR_NVS_NOT_FOUND;
+}
+
+const esp_partition_t *esp_partition_find_first( esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label )
+{
+    return NULL;
+}
+
+esp_err_t esp_partition_read( const esp_partition_t *partition, size_t offset, void *dst, size_t size )
+{
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t esp_partition_write( const esp_partition_t *partition, size_t offset, const void *src, size_t size )
+{
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t esp_partition_erase_range( const esp_partition_t *partition, size_t offset, size_t size )
+{
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t gpio_config( const gpio_config_t *config )
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_level( gpio_num_t pin, uint32_t level )
+{
+    return ESP_OK;
+}
+
+esp_mqtt_client_handle_t esp_mqtt_client_init( const esp_mqtt_client_config_t *config )
+{
+    return NULL;
+}
+
+esp_err_t esp_mqtt_client_register_event( esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event, esp_event_handler_t handler, void *arg )
+{
+    return ESP_FAIL;
+}
+
+esp_err_t esp_mqtt_client_start( esp_mqtt_client_handle_t client )
+{
+    return ESP_FAIL;
+}
+
+esp_err_t esp_mqtt_client_reconnect( esp_mqtt_client_handle_t client )
+{
+    return ESP_FAIL;
+}
+
+esp_err_t esp_mqtt_client_disconnect( esp_mqtt_client_handle_t client )
+{
+    return ESP_FAIL;
+}
+
+esp_err_t esp_mqtt_client_stop( esp_mqtt_client_handle_t client )
+{
+    return ESP_FAIL;
+}
+
+esp_err_t esp_mqtt_client_destroy( esp_mqtt_client_handle_t client )
+{
+    return ESP_FAIL;
+}
+
+int esp_mqtt_client_subscribe( esp_mqtt_client_handle_t client, const char *topic, int qos )
+{
+    return -1;
+}
+
+int esp_mqtt_client_unsubscribe( esp_mqtt_client_handle_t client, const char *topic )
+{
+    return -1;
+}
+
+int esp_mqtt_client_publish( esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain )
+{
+    return -1;
+}
+
+esp_err_t dht_read_float_data( dht_sensor_type_t type, gpio_num_t pin, float *humidity, float *temperature )
+{
+    return ESP_ERR_TIMEOUT;
+}
+
+void onewire_power( gpio_num_t pin )
+{
+}
+
+void onewire_depower( gpio_num_t pin )
+{
+}
+
+int ds18x20_scan_devices( gpio_num_t pin, ds18x20_addr_t *addrs, int count )
+{
+    return 0;
+}
+
+esp_err_t ds18x20_measure( gpio_num_t pin, ds18x20_addr_t addr, bool wait )
+{
+    return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t ds18x20_read_temperature( gpio_num_t pin, ds18x20_addr_t addr, float *temperature )
+{
+    return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t ds18x20_read_scratchpad( gpio_num_t pin, ds18x20_addr_t addr, uint8_t *buffer )
+{
+    return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t ds18x20_write_scratchpad( gpio_num_t pin, ds18x20_addr_t addr, uint8_t *buffer )
+{
+    return ESP_ERR_TIMEOUT;
+}
+
+esp_err_t ds18x20_copy_scratchpad( gpio_num_t pin, ds18x20_addr_t addr )
+{
+    return ESP_ERR_TIMEOUT;
+}
@@ -0,0 +1,400 @@
+#ifndef __HOST_SDK_H__
+#define __HOST_SDK_H__
+
+// Just enough of the ESP8266 RTOS SDK for the firmware sources to build and
+// run on the host. Tasks and timers never run, locks never block, NVS and
+// flash partitions are missing, and MQTT publishes go nowhere; every
+// header the firmware includes from the SDK resolves to this one.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sdkconfig.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int esp_err_t;
+
+#define ESP_OK                  0
+#define ESP_FAIL                -1
+#define ESP_ERR_NO_MEM          0x101
+#define ESP_ERR_INVALID_ARG     0x102
+#define ESP_ERR_INVALID_STATE   0x103
+#define ESP_ERR_INVALID_SIZE    0x104
+#define ESP_ERR_NOT_FOUND       0x105
+#define ESP_ERR_TIMEOUT         0x107
+#define ESP_ERR_INVALID_CRC     0x109
+#define ESP_ERR_INVALID_MAC     0x10A
+#define ESP_ERR_NVS_NOT_FOUND   0x1102
+
+#define BIT( n ) ( 1UL << ( n ) )
+#define BIT0 0x00000001
+#define BIT1 0x00000002
+
+#define ESP_ERROR_CHECK( x ) (void)( x )
+
+const char *esp_err_to_name( esp_err_t code );
+
+// esp_log.h
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+#ifndef LOG_LOCAL_LEVEL
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
+
+void esp_log_write( esp_log_level_t level, const char *tag, const char *format, ... );
+uint32_t esp_log_timestamp( void );
+
+#define ESP_LOG_LEVEL_LOCAL( level, tag, format, ... ) \
+    do { \
+        if( LOG_LOCAL_LEVEL >= level ) { \
+            esp_log_write( level, tag, format "\n", ##__VA_ARGS__ ); \
+        } \
+    } while( 0 )
+
+#define ESP_LOGE( tag, format, ... ) ESP_LOG_LEVEL_LOCAL( ESP_LOG_ERROR, tag, format, ##__VA_ARGS__ )
+#define ESP_LOGW( tag, format, ... ) ESP_LOG_LEVEL_LOCAL( ESP_LOG_WARN, tag, format, ##__VA_ARGS__ )
+#define ESP_LOGI( tag, format, ... ) ESP_LOG_LEVEL_LOCAL( ESP_LOG_INFO, tag, format, ##__VA_ARGS__ )
+#define ESP_LOGD( tag, format, ... ) ESP_LOG_LEVEL_LOCAL( ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__ )
+#define ESP_LOGV( tag, format, ... ) ESP_LOG_LEVEL_LOCAL( ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__ )
+
+// freertos
+
+typedef void *TaskHandle_t;
+typedef void *QueueHandle_t;
+typedef void *SemaphoreHandle_t;
+typedef void *EventGroupHandle_t;
+typedef void *TimerHandle_t;
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t EventBits_t;
+typedef void (*TaskFunction_t)( void *arg );
+typedef void (*TimerCallbackFunction_t)( TimerHandle_t timer );
+
+#define portTICK_RATE_MS    1
+#define portTICK_PERIOD_MS  1
+#define portMAX_DELAY       (TickType_t)0xffffffffUL
+#define pdFALSE             0
+#define pdTRUE              1
+#define pdPASS              pdTRUE
+#define pdFAIL              pdFALSE
+#define pdMS_TO_TICKS( ms ) ( (TickType_t)( ms ) / portTICK_PERIOD_MS )
+
+BaseType_t xTaskCreate( TaskFunction_t task, const char *name, uint32_t stack, void *arg, UBaseType_t priority, TaskHandle_t *handle );
+void vTaskDelete( TaskHandle_t task );
+void vTaskDelay( TickType_t ticks );
+uint32_t ulTaskNotifyTake( BaseType_t clear, TickType_t wait );
+BaseType_t xTaskNotifyGive( TaskHandle_t task );
+TickType_t xTaskGetTickCount( void );
+TaskHandle_t xTaskGetCurrentTaskHandle( void );
+
+QueueHandle_t xQueueCreate( UBaseType_t length, UBaseType_t itemSize );
+BaseType_t xQueueSend( QueueHandle_t queue, const void *item, TickType_t wait );
+BaseType_t xQueueSendToBack( QueueHandle_t queue, const void *item, TickType_t wait );
+BaseType_t xQueueReceive( QueueHandle_t queue, void *item, TickType_t wait );
+UBaseType_t uxQueueMessagesWaiting( QueueHandle_t queue );
+
+SemaphoreHandle_t xSemaphoreCreateMutex( void );
+SemaphoreHandle_t xSemaphoreCreateRecursiveMutex( void );
+SemaphoreHandle_t xSemaphoreCreateBinary( void );
+SemaphoreHandle_t xSemaphoreCreateCounting( UBaseType_t max, UBaseType_t initial );
+BaseType_t xSemaphoreTake( SemaphoreHandle_t semaphore, TickType_t wait );
+BaseType_t xSemaphoreGive( SemaphoreHandle_t semaphore );
+BaseType_t xSemaphoreTakeRecursive( SemaphoreHandle_t semaphore, TickType_t wait );
+BaseType_t xSemaphoreGiveRecursive( SemaphoreHandle_t semaphore );
+void vSemaphoreDelete( SemaphoreHandle_t semaphore );
+
+EventGroupHandle_t xEventGroupCreate( void );
+void vEventGroupDelete( EventGroupHandle_t group );
+EventBits_t xEventGroupWaitBits( EventGroupHandle_t group, EventBits_t bits, BaseType_t clear, BaseType_t all, TickType_t wait );
+EventBits_t xEventGroupSetBits( EventGroupHandle_t group, EventBits_t bits );
+
+TimerHandle_t xTimerCreate( const char *name, TickType_t period, UBaseType_t reload, void *id, TimerCallbackFunction_t callback );
+void *pvTimerGetTimerID( TimerHandle_t timer );
+BaseType_t xTimerStart( TimerHandle_t timer, TickType_t wait );
+BaseType_t xTimerStop( TimerHandle_t timer, TickType_t wait );
+BaseType_t xTimerReset( TimerHandle_t timer, TickType_t wait );
+BaseType_t xTimerDelete( TimerHandle_t timer, TickType_t wait );
+BaseType_t xTimerChangePeriod( TimerHandle_t timer, TickType_t period, TickType_t wait );
+BaseType_t xTimerIsTimerActive( TimerHandle_t timer );
+
+// esp_system.h
+
+esp_err_t esp_base_mac_addr_get( uint8_t *mac );
+esp_err_t esp_efuse_mac_get_default( uint8_t *mac );
+
+// esp_event.h, esp_wifi.h, esp_netif.h
+
+typedef const char *esp_event_base_t;
+typedef void (*esp_event_handler_t)( void *arg, esp_event_base_t base, int32_t id, void *data );
+
+extern esp_event_base_t WIFI_EVENT;
+extern esp_event_base_t IP_EVENT;
+
+#define ESP_EVENT_ANY_ID -1
+
+enum {
+    WIFI_EVENT_STA_START = 2,
+    WIFI_EVENT_STA_DISCONNECTED = 5
+};
+
+enum {
+    IP_EVENT_STA_GOT_IP = 0
+};
+
+typedef struct {
+    uint32_t addr;
+} ip4_addr_t;
+
+typedef struct {
+    ip4_addr_t ip;
+    ip4_addr_t netmask;
+    ip4_addr_t gw;
+} tcpip_adapter_ip_info_t;
+
+typedef struct {
+    tcpip_adapter_ip_info_t ip_info;
+} ip_event_got_ip_t;
+
+typedef struct {
+    uint8_t ssid[32];
+    uint8_t ssid_len;
+    uint8_t bssid[6];
+    uint8_t reason;
+} wifi_event_sta_disconnected_t;
+
+typedef enum {
+    WIFI_MODE_NULL,
+    WIFI_MODE_STA
+} wifi_mode_t;
+
+typedef enum {
+    WIFI_AUTH_OPEN,
+    WIFI_AUTH_WEP,
+    WIFI_AUTH_WPA_PSK,
+    WIFI_AUTH_WPA2_PSK
+} wifi_auth_mode_t;
+
+typedef enum {
+    ESP_IF_WIFI_STA
+} esp_interface_t;
+
+typedef struct {
+    uint8_t ssid[32];
+    uint8_t password[64];
+    struct {
+        wifi_auth_mode_t authmode;
+    } threshold;
+} wifi_sta_config_t;
+
+typedef union {
+    wifi_sta_config_t sta;
+} wifi_config_t;
+
+typedef struct {
+    int reserved;
+} wifi_init_config_t;
+
+#define WIFI_INIT_CONFIG_DEFAULT() { 0 }
+
+void tcpip_adapter_init( void );
+esp_err_t esp_event_loop_create_default( void );
+esp_err_t esp_event_handler_register( esp_event_base_t base, int32_t id, esp_event_handler_t handler, void *arg );
+esp_err_t esp_event_handler_unregister( esp_event_base_t base, int32_t id, esp_event_handler_t handler );
+esp_err_t esp_wifi_init( const wifi_init_config_t *config );
+esp_err_t esp_wifi_set_mode( wifi_mode_t mode );
+esp_err_t esp_wifi_set_config( esp_interface_t interface, wifi_config_t *config );
+esp_err_t esp_wifi_start( void );
+esp_err_t esp_wifi_connect( void );
+char *ip4addr_ntoa( const ip4_addr_t *addr );
+
+// esp_sntp.h
+
+#define SNTP_OPMODE_POLL 0
+
+void sntp_setoperatingmode( uint8_t mode );
+void sntp_setservername( uint8_t index, const char *server );
+void sntp_init( void );
+
+// nvs.h, nvs_flash.h
+
+typedef uint32_t nvs_handle_t;
+typedef nvs_handle_t nvs_handle;
+
+typedef enum {
+    NVS_READONLY,
+    NVS_READWRITE
+} nvs_open_mode_t;
+
+esp_err_t nvs_flash_init( void );
+esp_err_t nvs_open( const char *name, nvs_open_mode_t mode, nvs_handle_t *handle );
+void nvs_close( nvs_handle_t handle );
+esp_err_t nvs_get_blob( nvs_handle_t handle, const char *key, void *value, size_t *length );
+esp_err_t nvs_set_blob( nvs_handle_t handle, const char *key, const void *value, size_t length );
+esp_err_t nvs_erase_key( nvs_handle_t handle, const char *key );
+esp_err_t nvs_commit( nvs_handle_t handle );
+
+// esp_partition.h, esp_spi_flash.h
+
+#define SPI_FLASH_SEC_SIZE 4096
+
+typedef enum {
+    ESP_PARTITION_TYPE_APP = 0x00,
+    ESP_PARTITION_TYPE_DATA = 0x01
+} esp_partition_type_t;
+
+typedef enum {
+    ESP_PARTITION_SUBTYPE_ANY = 0xff
+} esp_partition_subtype_t;
+
+typedef struct {
+    esp_partition_type_t type;
+    esp_partition_subtype_t subtype;
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+} esp_partition_t;
+
+const esp_partition_t *esp_partition_find_first( esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label );
+esp_err_t esp_partition_read( const esp_partition_t *partition, size_t offset, void *dst, size_t size );
+esp_err_t esp_partition_write( const esp_partition_t *partition, size_t offset, const void *src, size_t size );
+esp_err_t esp_partition_erase_range( const esp_partition_t *partition, size_t offset, size_t size );
+
+// driver/gpio.h
+
+typedef enum {
+    GPIO_NUM_NC = -1,
+    GPIO_NUM_0 = 0,
+    GPIO_NUM_2 = 2,
+    GPIO_NUM_MAX = 17
+} gpio_num_t;
+
+typedef enum {
+    GPIO_MODE_DISABLE,
+    GPIO_MODE_INPUT,
+    GPIO_MODE_OUTPUT,
+    GPIO_MODE_OUTPUT_OD
+} gpio_mode_t;
+
+typedef enum {
+    GPIO_PULLUP_DISABLE,
+    GPIO_PULLUP_ENABLE
+} gpio_pullup_t;
+
+typedef enum {
+    GPIO_PULLDOWN_DISABLE,
+    GPIO_PULLDOWN_ENABLE
+} gpio_pulldown_t;
+
+typedef enum {
+    GPIO_INTR_DISABLE
+} gpio_int_type_t;
+
+typedef struct {
+    uint32_t pin_bit_mask;
+    gpio_mode_t mode;
+    gpio_pullup_t pull_up_en;
+    gpio_pulldown_t pull_down_en;
+    gpio_int_type_t intr_type;
+} gpio_config_t;
+
+esp_err_t gpio_config( const gpio_config_t *config );
+esp_err_t gpio_set_level( gpio_num_t pin, uint32_t level );
+
+// mqtt_client.h
+
+typedef struct esp_mqtt_client *esp_mqtt_client_handle_t;
+
+typedef enum {
+    MQTT_EVENT_ERROR,
+    MQTT_EVENT_CONNECTED,
+    MQTT_EVENT_DISCONNECTED,
+    MQTT_EVENT_SUBSCRIBED,
+    MQTT_EVENT_UNSUBSCRIBED,
+    MQTT_EVENT_PUBLISHED,
+    MQTT_EVENT_DATA,
+    MQTT_EVENT_BEFORE_CONNECT
+} esp_mqtt_event_id_t;
+
+typedef struct {
+    esp_mqtt_event_id_t event_id;
+    esp_mqtt_client_handle_t client;
+    void *user_context;
+    char *data;
+    int data_len;
+    int total_data_len;
+    int current_data_offset;
+    char *topic;
+    int topic_len;
+    int msg_id;
+} esp_mqtt_event_t;
+
+typedef esp_mqtt_event_t *esp_mqtt_event_handle_t;
+
+typedef struct {
+    const char *uri;
+    int buffer_size;
+    int out_buffer_size;
+} esp_mqtt_client_config_t;
+
+esp_mqtt_client_handle_t esp_mqtt_client_init( const esp_mqtt_client_config_t *config );
+esp_err_t esp_mqtt_client_register_event( esp_mqtt_client_handle_t client, esp_mqtt_event_id_t event, esp_event_handler_t handler, void *arg );
+esp_err_t esp_mqtt_client_start( esp_mqtt_client_handle_t client );
+esp_err_t esp_mqtt_client_reconnect( esp_mqtt_client_handle_t client );
+esp_err_t esp_mqtt_client_disconnect( esp_mqtt_client_handle_t client );
+esp_err_t esp_mqtt_client_stop( esp_mqtt_client_handle_t client );
+esp_err_t esp_mqtt_client_destroy( esp_mqtt_client_handle_t client );
+int esp_mqtt_client_subscribe( esp_mqtt_client_handle_t client, const char *topic, int qos );
+int esp_mqtt_client_unsubscribe( esp_mqtt_client_handle_t client, const char *topic );
+int esp_mqtt_client_publish( esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain );
+
+// dht.h
+
+typedef enum {
+    DHT_TYPE_DHT11,
+    DHT_TYPE_AM2301
+} dht_sensor_type_t;
+
+esp_err_t dht_read_float_data( dht_sensor_type_t type, gpio_num_t pin, float *humidity, float *temperature );
+
+// onewire.h, ds18x20.h
+
+typedef uint64_t onewire_addr_t;
+typedef onewire_addr_t ds18x20_addr_t;
+
+#define ds18x20_ANY ( (ds18x20_addr_t)0xffffffffffffffffULL )
+
+void onewire_power( gpio_num_t pin );
+void onewire_depower( gpio_num_t pin );
+int ds18x20_scan_devices( gpio_num_t pin, ds18x20_addr_t *addrs, int count );
+esp_err_t ds18x20_measure( gpio_num_t pin, ds18x20_addr_t addr, bool wait );
+esp_err_t ds18x20_read_temperature( gpio_num_t pin, ds18x20_addr_t addr, float *temperature );
+esp_err_t ds18x20_read_scratchpad( gpio_num_t pin, ds18x20_addr_t addr, uint8_t *buffer );
+esp_err_t ds18x20_write_scratchpad( gpio_num_t pin, ds18x20_addr_t addr, uint8_t *buffer );
+esp_err_t ds18x20_copy_scratchpad( gpio_num_t pin, ds18x20_addr_t addr );
+
+// newlib keeps the offset from UTC here
+extern long _timezone;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
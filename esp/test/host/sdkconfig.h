@@ -0,0 +1,32 @@
+#ifndef __HOST_SDKCONFIG_H__
+#define __HOST_SDKCONFIG_H__
+
+// the defaults from main/Kconfig.projbuild
+
+#define CONFIG_ESP_WIFI_SSID "myssid"
+#define CONFIG_ESP_WIFI_PASSWORD "mypassword"
+#define CONFIG_ESP_MAXIMUM_RETRY 5
+#define CONFIG_MQTT_BROKER_URL "mqtt://mqtt.eclipse.org"
+#define CONFIG_AUTOHOME_DECODER_SCRATCH_SIZE 96
+#define CONFIG_AUTOHOME_MQTT_INFLIGHT 4
+#define CONFIG_AUTOHOME_MQTT_MAX_PAYLOAD 16384
+#define CONFIG_AUTOHOME_PUBLISH_ACTUATION_BUFFER 1024
+#define CONFIG_AUTOHOME_PUBLISH_TELEMETRY_BUFFER 2048
+#define CONFIG_AUTOHOME_PUBLISH_LOG_BUFFER 2048
+#define CONFIG_AUTOHOME_PUBLISH_MAX_MESSAGE 768
+#define CONFIG_AUTOHOME_PUBLISH_INFLIGHT 4
+#define CONFIG_AUTOHOME_READING_HEARTBEAT 300000
+#define CONFIG_AUTOHOME_READING_FRAME_WINDOW 500
+#define CONFIG_AUTOHOME_READING_FRAME_ENTRIES 8
+#define CONFIG_AUTOHOME_REMOTE_READINGS 16
+#define CONFIG_AUTOHOME_REMOTE_READING_TTL 900000
+#define CONFIG_AUTOHOME_SPOOL_PARTITION "telemetry"
+#define CONFIG_AUTOHOME_SPOOL_REPLAY_INTERVAL 200
+#define CONFIG_AUTOHOME_REMOTE_LOG_LEVEL 3
+#define CONFIG_AUTOHOME_LOG_QUEUE_SIZE 16
+#define CONFIG_AUTOHOME_LOG_MESSAGE_SIZE 128
+#define CONFIG_AUTOHOME_LOG_FLUSH_INTERVAL 2000
+#define CONFIG_AUTOHOME_SNAPSHOT_MAX_SIZE 1984
+#define CONFIG_AUTOHOME_SENSOR_STACK_SIZE 4096
+
+#endif
@@ -0,0 +1,75 @@
+#include "autohome.h"
+
+static const char *HOME = "8f3c2a10-4b5d-4e6f-8a7b-9c0d1e2f3a4b";
+static const char *ZONE = "1a2b3c4d-5e6f-4a8b-9c0d-e1f2a3b4c5d6";
+static const char *DEVICE = "c0ffee00-1234-4567-89ab-cdef01234567";
+
+static int failures = 0;
+
+#define CHECK( condition ) \
+    do { \
+        if( !( condition ) ) { \
+            printf( "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition ); \
+            ++failures; \
+        } \
+    } while( 0 )
+
+static void addTarget( Schedule &schedule, const Uuid &home, const Uuid &zone, const char *type )
+{
+    DeviceTarget &target = schedule.addTarget( home, zone );
+    target.setField( "device", DEVICE );
+    if( type ) {
+        target.setField( "type", type );
+    }
+}
+
+static void testLastListedTargetWins()
+{
+    Uuid home;
+    Uuid zone;
+    Uuid device;
+    ScheduleList schedules;
+    OverrideIndex overrides;
+    TargetTimeline timeline;
+
+    home.parse( HOME );
+    zone.parse( ZONE );
+    device.parse( DEVICE );
+
+    schedules.emplace_back();
+    Schedule &schedule = schedules.back();
+    for( int day = 0; day < 7; ++day ) {
+        schedule.addDay( day );
+    }
+    schedule.setStart( "00:00" );
+
+    // two targets for the same reading, then one for any type of the device
+    addTarget( schedule, home, zone, "temperature" );
+    addTarget( schedule, home, zone, "temperature" );
+    timeline.compile( schedules, overrides );
+
+    const DeviceTargetList &targets = schedule.getTargets();
+    const DeviceTarget *found = timeline.find( 1000000, home, zone, device, READING_TEMPERATURE );
+    CHECK( found == &targets[1] );
+    CHECK( schedule.getTarget( home, zone, device, READING_TEMPERATURE ) == &targets[1] );
+
+    addTarget( schedule, home, zone, NULL );
+    timeline.compile( schedules, overrides );
+
+    found = timeline.find( 1000000, home, zone, device, READING_TEMPERATURE );
+    CHECK( found == &targets[2] );
+    CHECK( schedule.getTarget( home, zone, device, READING_TEMPERATURE ) == &targets[2] );
+}
+
+int main()
+{
+    testLastListedTargetWins();
+
+    if( failures ) {
+        printf( "timeline: %d checks failed\n", failures );
+        return 1;
+    }
+
+    printf( "timeline: all checks passed\n" );
+    return 0;
+}
@@ -0,0 +1,283 @@
+// Turns binary zone logs (homes/<home>/zones/<zone>/trace) back into text.
+// The device only sends the addresses of its format strings and tags, so
+// the firmware image it is running is needed to look them up:
+//
+//   node decodelog.js build/autohome.elf payload.bin ...
+//   mosquitto_sub -t 'homes/+/zones/+/trace' -F %x | node decodelog.js build/autohome.elf
+//
+// With no payload files stdin is read, either as one raw payload or as one
+// hex encoded payload per line.
+
+var fs = require( 'fs' );
+
+const VERSION = 1;
+const HEADER = 18;
+const LEVELS = [ 'N', 'E', 'W', 'I', 'D', 'V' ];
+
+function loadImage( path ) {
+    let elf = fs.readFileSync( path );
+
+    if( elf.readUInt32BE( 0 ) != 0x7f454c46 || elf[4] != 1 || elf[5] != 1 ) {
+        throw new Error( `${path} is not a little endian 32 bit ELF file` );
+    }
+
+    let sections = [];
+    let offset = elf.readUInt32LE( 0x20 );
+    let size = elf.readUInt16LE( 0x2e );
+    let count = elf.readUInt16LE( 0x30 );
+
+    for( let i = 0; i < count; ++i ) {
+        let header = offset + i * size;
+        let type = elf.readUInt32LE( header + 4 );
+        let flags = elf.readUInt32LE( header + 8 );
+
+        // only sections loaded from the image hold string constants
+        if( ( flags & 0x2 ) && type != 8 ) {
+            sections.push({
+                address: elf.readUInt32LE( header + 12 ),
+                offset: elf.readUInt32LE( header + 16 ),
+                size: elf.readUInt32LE( header + 20 )
+            });
+        }
+    }
+
+    return { elf, sections, strings: new Map() };
+}
+
+function lookupString( image, address ) {
+    if( image.strings.has( address ) ) {
+        return image.strings.get( address );
+    }
+
+    let result = null;
+    for( let section of image.sections ) {
+        if( address >= section.address && address < section.address + section.size ) {
+            let start = section.offset + address - section.address;
+            let end = image.elf.indexOf( 0, start );
+            result = image.elf.toString( 'latin1', start, end < 0 ? start : end );
+            break;
+        }
+    }
+
+    image.strings.set( address, result );
+    return result;
+}
+
+function readArguments( data ) {
+    let args = [];
+    let pos = 0;
+
+    while( pos < data.length ) {
+        let type = String.fromCharCode( data[pos++] );
+        switch( type ) {
+        case 'i':
+            args.push( data.readInt32LE( pos ) );
+            pos += 4;
+            break;
+        case 'p':
+            args.push( data.readUInt32LE( pos ) );
+            pos += 4;
+            break;
+        case 'q':
+            args.push( data.readBigInt64LE( pos ) );
+            pos += 8;
+            break;
+        case 'd':
+            args.push( data.readDoubleLE( pos ) );
+            pos += 8;
+            break;
+        case 's': {
+            let len = data[pos++];
+            args.push( data.toString( 'latin1', pos, pos + len ) );
+            pos += len;
+            break;
+        }
+        default:
+            return args;
+        }
+    }
+
+    return args;
+}
+
+function pad( text, flags, width, zeroable ) {
+    if( text.length >= width ) {
+        return text;
+    }
+    if( flags.includes( '-' ) ) {
+        return text.padEnd( width );
+    }
+    if( zeroable && flags.includes( '0' ) ) {
+        let sign = /^[-+ ]/.test( text ) ? text[0] : '';
+        return sign + text.slice( sign.length ).padStart( width - sign.length, '0' );
+    }
+    return text.padStart( width );
+}
+
+function formatNumber( value, conversion, flags, precision ) {
+    let negative = false;
+    let text;
+
+    if( 'diouxX'.includes( conversion ) ) {
+        value = BigInt( value );
+        if( conversion != 'd' && conversion != 'i' && value < 0n ) {
+            // the device packs unsigned values into signed words
+            value += value < -0x80000000n ? 1n << 64n : 1n << 32n;
+        }
+        negative = value < 0n;
+        if( negative ) {
+            value = -value;
+        }
+        let radix = conversion == 'o' ? 8 : ( conversion == 'x' || conversion == 'X' ) ? 16 : 10;
+        text = value.toString( radix );
+        if( precision !== null ) {
+            text = precision == 0 && value == 0n ? '' : text.padStart( precision, '0' );
+        }
+        if( flags.includes( '#' ) && value != 0n && radix != 10 ) {
+            text = ( radix == 8 ? '0' : '0x' ) + text;
+        }
+        if( conversion == 'X' ) {
+            text = text.toUpperCase();
+        }
+    } else {
+        value = Number( value );
+        negative = value < 0 || Object.is( value, -0 );
+        value = Math.abs( value );
+        let digits = precision === null ? 6 : precision;
+        let lower = conversion.toLowerCase();
+
+        if( !isFinite( value ) ) {
+            text = isNaN( value ) ? 'nan' : 'inf';
+        } else if( lower == 'e' ) {
+            text = value.toExponential( digits ).replace( /e([+-])(\d)$/, 'e$10$2' );
+        } else if( lower == 'g' ) {
+            text = value.toPrecision( digits || 1 );
+            if( !flags.includes( '#' ) ) {
+                text = text.replace( /\.?0+(e|$)/, '$1' );
+            }
+            text = text.replace( /e([+-])(\d)$/, 'e$10$2' );
+        } else if( lower == 'a' ) {
+            text = value.toString( 16 );
+        } else {
+            text = value.toFixed( digits );
+        }
+        if( conversion != lower ) {
+            text = text.toUpperCase();
+        }
+    }
+
+    if( negative ) {
+        return '-' + text;
+    }
+    if( flags.includes( '+' ) ) {
+        return '+' + text;
+    }
+    if( flags.includes( ' ' ) ) {
+        return ' ' + text;
+    }
+    return text;
+}
+
+function format( template, args ) {
+    let next = 0;
+    let take = () => next < args.length ? args[next++] : undefined;
+
+    return template.replace( /%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d*))?(hh|h|ll|l|j|z|t|L)?([diouxXeEfFgGaAcspn%])/g,
+        ( match, flags, width, precision, length, conversion ) => {
+            if( conversion == '%' ) {
+                return '%';
+            }
+
+            width = width == '*' ? take() : parseInt( width || '0' );
+            precision = precision == '*' ? take() : precision === undefined ? null : parseInt( precision || '0' );
+            if( width < 0 ) {
+                flags += '-';
+                width = -width;
+            }
+
+            if( conversion == 'n' ) {
+                return '';
+            }
+
+            let value = take();
+            if( value === undefined ) {
+                // the record ran out of room before this argument
+                return '?';
+            }
+
+            switch( conversion ) {
+            case 's':
+                return pad( precision === null ? value : value.slice( 0, precision ), flags, width, false );
+            case 'c':
+                return pad( String.fromCharCode( Number( value ) & 0xff ), flags, width, false );
+            case 'p':
+                return pad( '0x' + Number( value ).toString( 16 ), flags, width, false );
+            default:
+                return pad( formatNumber( value, conversion, flags, precision ), flags, width, precision === null );
+            }
+        });
+}
+
+function decodePayload( image, payload ) {
+    let lines = [];
+
+    if( payload.length == 0 || payload[0] != VERSION ) {
+        throw new Error( `Unknown log payload version ${payload[0]}` );
+    }
+
+    let pos = 1;
+    while( pos + HEADER <= payload.length ) {
+        let formatAddress = payload.readUInt32LE( pos );
+        let tagAddress = payload.readUInt32LE( pos + 4 );
+        let time = payload.readUInt32LE( pos + 8 );
+        let uptime = payload.readUInt32LE( pos + 12 );
+        let level = payload[pos + 16];
+        let length = payload[pos + 17];
+        let args = readArguments( payload.slice( pos + HEADER, pos + HEADER + length ) );
+        pos += HEADER + length;
+
+        let template = lookupString( image, formatAddress );
+        let tag = lookupString( image, tagAddress ) || `0x${tagAddress.toString( 16 )}`;
+        let message = template === null
+            ? `<unknown format 0x${formatAddress.toString( 16 )}> ${args.join( ' ' )}`
+            : format( template, args );
+
+        lines.push( `${new Date( time * 1000 ).toISOString()} ${LEVELS[level] || level} (${uptime}) ${tag}: ${message}` );
+    }
+
+    return lines;
+}
+
+function readStdin() {
+    let data = fs.readFileSync( 0 );
+    let text = data.toString( 'latin1' );
+
+    if( /^[0-9a-fA-F\s]+$/.test( text ) ) {
+        return text.split( /\s+/ ).filter( ( line ) => line.length > 0 ).map( ( line ) => Buffer.from( line, 'hex' ) );
+    }
+    return [ data ];
+}
+
+function main( argv ) {
+    if( argv.length < 1 ) {
+        console.error( 'usage: node decodelog.js <firmware.elf> [payload ...]' );
+        process.exit( 1 );
+    }
+
+    let image = loadImage( argv[0] );
+    let payloads = argv.length > 1
+        ? argv.slice( 1 ).map( ( file ) => fs.readFileSync( file ) )
+        : readStdin();
+
+    for( let payload of payloads ) {
+        try {
+            for( let line of decodePayload( image, payload ) ) {
+                console.log( line );
+            }
+        } catch( err ) {
+            console.error( err.message );
+        }
+    }
+}
+
+main( process.argv.slice( 2 ) );